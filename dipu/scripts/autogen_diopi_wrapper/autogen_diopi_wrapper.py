@@ -867,6 +867,14 @@ def functions_code_gen(fun_config):
     custom_code_at_the_beginning = re.sub(";\s*$", ";\n", custom_code_at_the_beginning)
 
     interface_name = re.sub(R".*::(.*?)\(.*", R"\1", diopi_fun_call_code)
+    # Route the call through dipu::graph::callDiopi so that DIPU graphs can
+    # capture it, dummy calls are left alone.
+    diopi_fun_capture_call_code = re.sub(
+        R"^((?:diopiadaptor)?::(\w+))\((.*)\)\s*;\s*$",
+        R'dipu::graph::callDiopi(R"(\2)", \1, \3);',
+        diopi_fun_call_code,
+        flags=re.S,
+    )
     fbody = fun_template.substitute(
         comment=[fun_config["schema"]],
         cppsignautre=[create_cpp_signature_from_schema(fun_config["schema"])],
@@ -880,6 +888,7 @@ def functions_code_gen(fun_config):
         ],
         device_check_code=[create_device_check_code(fun_config)],
         diopi_fun_call_code=[diopi_fun_call_code],
+        diopi_fun_capture_call_code=[diopi_fun_capture_call_code],
         custom_code_before_return=[
             fun_config.get("custom_code_before_return", "").replace("; ", ";\n")
         ],
@@ -54,6 +54,7 @@ diopi_wrapper_file_template_content = """// autogened file
 #include "csrc_dipu/aten/ops/DIPUOpInferrer.h"
 #include "csrc_dipu/aten/ops/OpRegexMatch.hpp"
 #include "csrc_dipu/base/basedef.h"
+#include "csrc_dipu/diopirt/diopirt_capture.h"
 #include "csrc_dipu/diopirt/diopirt_impl.h"
 #include "csrc_dipu/profiler/profiler.h"
 #include "csrc_dipu/runtime/core/DIPUGeneratorImpl.h"
@@ -119,7 +120,7 @@ $cppsignautre {
   $custom_code_before_call_diopi
 
   dipu::profile::RecordBlockCreator dipuRecorder(R"($interface_name)");
-  ::diopiError_t ret = $diopi_fun_call_code
+  ::diopiError_t ret = $diopi_fun_capture_call_code
   dipuRecorder.end();
   TORCH_CHECK(ret == ::diopiSuccess, __FILE__, ":", __LINE__, R"($diopi_fun_call_code)", " error, error code is ", ret, "error message is ", diopiGetLastErrorString());
 
@@ -0,0 +1,104 @@
+// Copyright (c) 2024, DeepLink.
+//
+// Measures how allocator throughput scales with the number of threads that
+// allocate and free concurrently. Every thread uses its own pool stream, which
+// is the pattern of data-loader, comm-hook and training threads. Fails if an
+// allocation fails or overlaps, or if memory is still accounted as allocated
+// once every thread freed its blocks.
+//
+// The allocator is chosen as usual with DIPU_DEVICE_MEMCACHING_ALGORITHM, e.g.
+// DIPU_DEVICE_MEMCACHING_ALGORITHM=BF test_allocator_contention.
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+#include <c10/core/Allocator.h>
+#include <c10/util/Exception.h>
+
+#include <csrc_dipu/base/basedef.h>
+#include <csrc_dipu/runtime/core/DIPUStream.h>
+#include <csrc_dipu/runtime/core/allocator/DIPUCachingAllocatorUtils.h>
+#include <csrc_dipu/runtime/devproxy/deviceproxy.h>
+
+#include "test_expect.h"
+
+using namespace dipu;
+
+namespace {
+
+constexpr int kIterationsPerThread = 20000;
+constexpr int kMaxThreads = 32;
+
+// A mix of the small sizes which dominate eager mode training.
+constexpr size_t kSizes[] = {4, 512, 2048, 4096, 65536, 262144};
+
+double runOnce(int num_threads) {
+  std::atomic<bool> start{false};
+  std::atomic<int> failures{0};
+  std::vector<std::thread> threads;
+  threads.reserve(num_threads);
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&start, &failures, t]() {
+      devproxy::setDevice(0);
+      setCurrentDIPUStream(getDIPUStreamFromPool());
+      auto* allocator = c10::GetAllocator(DIPU_DEVICE_TYPE);
+      while (!start.load()) {
+        std::this_thread::yield();
+      }
+      try {
+        for (int i = 0; i < kIterationsPerThread; ++i) {
+          auto size = kSizes[(i + t) % std::size(kSizes)];
+          auto a = allocator->allocate(size);
+          auto b = allocator->allocate(size * 2);
+          auto* a_begin = static_cast<char*>(a.get());
+          auto* b_begin = static_cast<char*>(b.get());
+          if (a_begin == nullptr || b_begin == nullptr ||
+              (a_begin < b_begin + size * 2 && b_begin < a_begin + size)) {
+            ++failures;
+          }
+        }
+      } catch (const c10::Error& e) {
+        std::cerr << e.what() << std::endl;
+        ++failures;
+      }
+      getCurrentDIPUStream().synchronize();
+    });
+  }
+
+  auto begin = std::chrono::steady_clock::now();
+  start = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  auto end = std::chrono::steady_clock::now();
+  EXPECT(failures == 0);
+  double seconds = std::chrono::duration<double>(end - begin).count();
+  // Two allocations and two frees per iteration.
+  return 4.0 * kIterationsPerThread * num_threads / seconds;
+}
+
+}  // namespace
+
+int main() {
+  devproxy::setDevice(0);
+  c10::Device device(DIPU_DEVICE_TYPE, 0);
+
+  // Warm up so that device segments are already cached.
+  runOnce(1);
+  auto allocated = memoryAllocated(device);
+
+  double base = 0;
+  for (int num_threads = 1; num_threads <= kMaxThreads; num_threads *= 2) {
+    double ops = runOnce(num_threads);
+    if (num_threads == 1) {
+      base = ops;
+    }
+    std::cout << "threads: " << num_threads << ", ops/s: " << ops
+              << ", speedup: " << ops / base << std::endl;
+    EXPECT(memoryAllocated(device) == allocated);
+  }
+  return 0;
+}
@@ -0,0 +1,227 @@
+// Copyright (c) 2024, DeepLink.
+//
+// Replays an allocation trace recorded with DIPU_ALLOCATOR_TRACE_FILE against
+// every caching allocator algorithm, so that algorithms can be compared on a
+// real workload without a device. Device memory is stood in for by host
+// memory, streams are not modeled.
+//
+// Usage: test_allocator_replay [trace file]
+// Without a trace file a synthetic training-like trace is replayed.
+//
+// For each algorithm it reports the peak reserved bytes, the fragmentation at
+// that peak (1 - live requested bytes / reserved bytes) and the p50/p99
+// latency of allocations. It fails if an allocation fails or overlaps a live
+// one, or if memory is still accounted as allocated once the trace has freed
+// every block.
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <c10/core/Allocator.h>
+#include <c10/core/Device.h>
+
+#include <csrc_dipu/runtime/core/allocator/DIPUAllocatorTrace.h>
+#include <csrc_dipu/runtime/core/allocator/DIPUCachingAllocator.h>
+
+#include "test_expect.h"
+
+using namespace dipu;
+
+namespace {
+
+// Hands out host memory and keeps track of how much of it is reserved.
+class HostStandInAllocator : public c10::Allocator {
+ public:
+  c10::DataPtr allocate(size_t size) const override {
+    void* ptr = size == 0 ? nullptr : std::malloc(size);
+    if (ptr != nullptr) {
+      auto& self = instance();
+      std::lock_guard<std::mutex> lk(self.mutex_);
+      self.sizes_[ptr] = size;
+      self.reserved_ += size;
+      self.peak_reserved_ = std::max(self.peak_reserved_, self.reserved_);
+    }
+    return {ptr, ptr, &deleter, c10::Device(c10::DeviceType::CPU)};
+  }
+
+  c10::DeleterFnPtr raw_deleter() const override { return &deleter; }
+
+  static HostStandInAllocator& instance() {
+    static HostStandInAllocator allocator;
+    return allocator;
+  }
+
+  size_t peak_reserved() const { return peak_reserved_; }
+
+  void reset_peak() { peak_reserved_ = reserved_; }
+
+ private:
+  static void deleter(void* ptr) {
+    if (ptr == nullptr) {
+      return;
+    }
+    auto& self = instance();
+    {
+      std::lock_guard<std::mutex> lk(self.mutex_);
+      auto iter = self.sizes_.find(ptr);
+      self.reserved_ -= iter->second;
+      self.sizes_.erase(iter);
+    }
+    std::free(ptr);
+  }
+
+  mutable std::mutex mutex_;
+  std::unordered_map<void*, size_t> sizes_;
+  size_t reserved_ = 0;
+  size_t peak_reserved_ = 0;
+};
+
+// Activations of a few layers are allocated in the forward pass and freed in
+// reverse order in the backward pass, with temporaries in between.
+std::vector<AllocatorTraceEvent> syntheticTrace() {
+  constexpr int kIterations = 20;
+  constexpr int kLayers = 48;
+  std::mt19937 rng(2024);
+  std::uniform_int_distribution<int> shift(9, 24);
+  std::vector<size_t> activation_sizes(kLayers);
+  for (auto& size : activation_sizes) {
+    size = (size_t{1} << shift(rng)) + rng() % 4096;
+  }
+
+  std::vector<AllocatorTraceEvent> events;
+  uint32_t next_id = 0;
+  auto alloc = [&](size_t size) {
+    events.push_back({0, size, 0, next_id, 0,
+                      AllocatorTraceEventType::kAllocate, 0});
+    return next_id++;
+  };
+  auto release = [&](uint32_t id) {
+    events.push_back({0, 0, -1, id, 0, AllocatorTraceEventType::kFree, 0});
+  };
+
+  for (int i = 0; i < kIterations; ++i) {
+    std::vector<uint32_t> activations;
+    for (auto size : activation_sizes) {
+      auto temp = alloc(size / 2 + rng() % 1024);
+      activations.push_back(alloc(size));
+      release(temp);
+    }
+    for (int layer = kLayers - 1; layer >= 0; --layer) {
+      auto grad = alloc(activation_sizes[layer]);
+      release(activations[layer]);
+      release(grad);
+    }
+  }
+  return events;
+}
+
+struct ReplayResult {
+  size_t peak_reserved = 0;
+  double fragmentation = 0;
+  double p50_us = 0;
+  double p99_us = 0;
+};
+
+double percentile(std::vector<double>& values, double p) {
+  if (values.empty()) {
+    return 0;
+  }
+  auto n = static_cast<size_t>(p * static_cast<double>(values.size() - 1));
+  std::nth_element(values.begin(), values.begin() + n, values.end());
+  return values[n];
+}
+
+ReplayResult replay(const std::string& algorithm,
+                    const std::vector<AllocatorTraceEvent>& events,
+                    int8_t device) {
+  auto& raw = HostStandInAllocator::instance();
+  auto standalone = createStandaloneCacheAllocator(algorithm, &raw);
+  raw.reset_peak();
+
+  ReplayResult result;
+  std::unordered_map<uint32_t, std::pair<c10::DataPtr, size_t>> live;
+  // Start address to end address of the live blocks.
+  std::map<uintptr_t, uintptr_t> ranges;
+  size_t live_bytes = 0;
+  std::vector<double> latencies;
+  for (const auto& event : events) {
+    if (event.device != device) {
+      continue;
+    }
+    if (event.type == AllocatorTraceEventType::kAllocate) {
+      auto begin = std::chrono::steady_clock::now();
+      auto ptr = standalone.allocator->allocate(event.size);
+      auto end = std::chrono::steady_clock::now();
+      latencies.push_back(
+          std::chrono::duration<double, std::micro>(end - begin).count());
+      if (event.size > 0) {
+        auto start = reinterpret_cast<uintptr_t>(ptr.get());
+        EXPECT(start != 0);
+        auto next = ranges.lower_bound(start);
+        EXPECT(next == ranges.end() || next->first >= start + event.size);
+        EXPECT(next == ranges.begin() || std::prev(next)->second <= start);
+        ranges.emplace(start, start + event.size);
+      }
+      live_bytes += event.size;
+      live[event.ptr_id] = {std::move(ptr), event.size};
+      if (raw.peak_reserved() > result.peak_reserved) {
+        result.peak_reserved = raw.peak_reserved();
+        result.fragmentation =
+            1.0 - static_cast<double>(live_bytes) /
+                      static_cast<double>(result.peak_reserved);
+      }
+    } else if (event.type == AllocatorTraceEventType::kFree) {
+      auto iter = live.find(event.ptr_id);
+      if (iter != live.end()) {
+        live_bytes -= iter->second.second;
+        ranges.erase(reinterpret_cast<uintptr_t>(iter->second.first.get()));
+        live.erase(iter);
+      }
+    }
+  }
+  live.clear();
+  EXPECT(standalone.allocator->memory_allocated() == 0);
+  result.p50_us = percentile(latencies, 0.5);
+  result.p99_us = percentile(latencies, 0.99);
+  return result;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  // Replaying must not record another trace.
+  unsetenv("DIPU_ALLOCATOR_TRACE_FILE");
+
+  auto events = argc > 1 ? readAllocatorTrace(argv[1]) : syntheticTrace();
+  std::map<int8_t, size_t> devices;
+  for (const auto& event : events) {
+    devices[event.device] +=
+        event.type == AllocatorTraceEventType::kAllocate ? 1 : 0;
+  }
+
+  std::cout << std::fixed << std::setprecision(3);
+  for (auto [device, allocations] : devices) {
+    std::cout << "device: " << static_cast<int>(device)
+              << ", allocations: " << allocations << std::endl;
+    for (const auto& algorithm : standaloneCacheAllocatorNames()) {
+      auto result = replay(algorithm, events, device);
+      std::cout << "  " << algorithm
+                << ": peak reserved: " << result.peak_reserved
+                << ", fragmentation: " << result.fragmentation
+                << ", p50 us: " << result.p50_us
+                << ", p99 us: " << result.p99_us << std::endl;
+    }
+  }
+  return 0;
+}
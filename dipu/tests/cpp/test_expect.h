@@ -0,0 +1,17 @@
+// Copyright (c) 2024, DeepLink.
+//
+// Checks for the standalone tests, which run without gtest.
+#pragma once
+
+#include <cstdlib>
+#include <iostream>
+
+// Exits with an error naming cond unless it holds.
+#define EXPECT(cond)                                                     \
+  do {                                                                   \
+    if (!(cond)) {                                                       \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": expected " #cond    \
+                << std::endl;                                            \
+      std::exit(1);                                                      \
+    }                                                                    \
+  } while (false)
@@ -0,0 +1,80 @@
+// Copyright (c) 2024, DeepLink.
+//
+// Checks that HostExpandableSegment commits memory on map() and returns it on
+// unmap(). Pinning is off, so only mmap/mprotect/madvise are exercised and no
+// device is needed.
+#include <cstring>
+#include <iostream>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#include <csrc_dipu/runtime/core/allocator/HostExpandableSegment.h>
+
+#include "test_expect.h"
+
+using namespace dipu;
+
+namespace {
+
+constexpr size_t kPage = size_t{2} << 20U;
+constexpr size_t kPages = 64;
+
+// Number of system pages of [ptr, ptr + size) backed by memory.
+size_t residentPages(const char* ptr, size_t size) {
+  auto system_page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  std::vector<unsigned char> residency(size / system_page);
+  EXPECT(mincore(const_cast<char*>(ptr), size, residency.data()) == 0);
+  size_t resident = 0;
+  for (auto r : residency) {
+    resident += r & 1U;
+  }
+  return resident * system_page;
+}
+
+}  // namespace
+
+int main() {
+  HostExpandableSegment segment(kPages * kPage, kPage, /*pin=*/false);
+  EXPECT(segment.size() == kPages * kPage);
+  EXPECT(segment.mappedBytes() == 0);
+  EXPECT(residentPages(segment.ptr(), segment.size()) == 0);
+
+  // Mapping part of a page maps the whole page.
+  auto mapped = segment.map(SegmentRange(segment.ptr(), 100));
+  EXPECT(mapped.ptr == segment.ptr() && mapped.size == kPage);
+  EXPECT(residentPages(segment.ptr(), kPage) == kPage);
+
+  // Growing maps only the missing pages, the result covers the whole range.
+  mapped = segment.map(SegmentRange(segment.ptr(), 3 * kPage + 1));
+  EXPECT(mapped.ptr == segment.ptr() && mapped.size == 4 * kPage);
+  EXPECT(segment.mappedBytes() == 4 * kPage);
+  std::memset(segment.ptr(), 0x5a, 4 * kPage);
+
+  // Only pages completely inside the range are unmapped.
+  auto unmapped = segment.unmap(SegmentRange(segment.ptr() + 1, 4 * kPage));
+  EXPECT(unmapped.ptr == segment.ptr() + kPage);
+  EXPECT(unmapped.size == 3 * kPage);
+  EXPECT(segment.mappedBytes() == kPage);
+  EXPECT(residentPages(segment.ptr() + kPage, 3 * kPage) == 0);
+  EXPECT(segment.ptr()[kPage - 1] == 0x5a);
+
+  // Unmapped pages can be mapped again.
+  mapped = segment.map(SegmentRange(segment.ptr() + kPage, kPage));
+  EXPECT(mapped.size == kPage);
+  segment.ptr()[kPage] = 1;
+
+  // Pages mapped together are only unmapped together.
+  mapped = segment.map(SegmentRange(segment.ptr() + 4 * kPage, 4 * kPage));
+  EXPECT(mapped.size == 4 * kPage);
+  unmapped = segment.unmap(SegmentRange(segment.ptr() + 5 * kPage, 3 * kPage));
+  EXPECT(unmapped.size == 0);
+  EXPECT(segment.mappedBytes() == 6 * kPage);
+  unmapped = segment.unmap(SegmentRange(segment.ptr() + 4 * kPage, 4 * kPage));
+  EXPECT(unmapped.ptr == segment.ptr() + 4 * kPage);
+  EXPECT(unmapped.size == 4 * kPage);
+  EXPECT(segment.mappedBytes() == 2 * kPage);
+
+  std::cout << "host expandable segment: ok" << std::endl;
+  return 0;
+}
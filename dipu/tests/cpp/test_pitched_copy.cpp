@@ -0,0 +1,138 @@
+// Copyright (c) 2024, DeepLink.
+//
+// Checks the layouts planPitchedCopy accepts, that copying them with the host
+// reference implementation and its parallel version matches an element by
+// element strided copy, and each way doMemCopyH2H copies. No device is needed.
+#include <cstdint>
+#include <iostream>
+#include <numeric>
+#include <optional>
+#include <vector>
+
+#include <ATen/ATen.h>
+
+#include <csrc_dipu/aten/ops/DIPUCopy.hpp>
+#include <csrc_dipu/aten/ops/PitchedCopyPlan.hpp>
+
+#include "test_expect.h"
+
+using namespace dipu;
+
+namespace {
+
+using Shape = std::vector<int64_t>;
+
+std::optional<PitchedCopyPlan> plan(const Shape& sizes, const Shape& dst,
+                                    const Shape& src) {
+  return planPitchedCopy(sizes.size(), sizes.data(), dst.data(), src.data(),
+                         sizeof(float));
+}
+
+int64_t extent(const Shape& sizes, const Shape& strides) {
+  int64_t last = 0;
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    last += (sizes[i] - 1) * strides[i];
+  }
+  return last + 1;
+}
+
+// Copies with the plan and compares with copying every element.
+void checkCopy(const Shape& sizes, const Shape& dst_strides,
+               const Shape& src_strides) {
+  auto copy_plan = plan(sizes, dst_strides, src_strides);
+  EXPECT(copy_plan.has_value());
+  std::vector<float> src(extent(sizes, src_strides));
+  std::iota(src.begin(), src.end(), 1.F);
+  std::vector<float> expected(extent(sizes, dst_strides), 0.F);
+  std::vector<float> actual(expected.size(), 0.F);
+
+  std::vector<int64_t> index(sizes.size(), 0);
+  int64_t numel = 1;
+  for (auto size : sizes) {
+    numel *= size;
+  }
+  for (int64_t n = 0; n < numel; ++n) {
+    int64_t dst_offset = 0;
+    int64_t src_offset = 0;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+      dst_offset += index[i] * dst_strides[i];
+      src_offset += index[i] * src_strides[i];
+    }
+    expected[dst_offset] = src[src_offset];
+    for (size_t i = sizes.size(); i > 0; --i) {
+      if (++index[i - 1] < sizes[i - 1]) {
+        break;
+      }
+      index[i - 1] = 0;
+    }
+  }
+
+  pitchedCopyOnHost(*copy_plan, actual.data(), src.data());
+  EXPECT(actual == expected);
+  std::vector<float> parallel(expected.size(), 0.F);
+  parallelPitchedCopyOnHost(*copy_plan, parallel.data(), src.data());
+  EXPECT(parallel == expected);
+}
+
+// Host to host memCopy, between tensors of the same sizes and dtype.
+void checkCopyH2H(const at::Tensor& dst, const at::Tensor& src) {
+  dst.zero_();
+  doMemCopyH2H(dst, src, src.numel() * src.element_size());
+  EXPECT(at::equal(dst, src));
+}
+
+}  // namespace
+
+int main() {
+  // Contiguous on both sides is one row.
+  auto contiguous = plan({4, 8}, {8, 1}, {8, 1});
+  EXPECT(contiguous && contiguous->width == 32 * sizeof(float));
+  EXPECT(contiguous->height == 1 && contiguous->depth == 1);
+
+  // Columns 2..5 of a 4x8 matrix: 4 rows of 4 elements.
+  auto columns = plan({4, 4}, {8, 1}, {4, 1});
+  EXPECT(columns && columns->width == 4 * sizeof(float));
+  EXPECT(columns->height == 4);
+  EXPECT(columns->dst_pitch == 8 * sizeof(float));
+  EXPECT(columns->src_pitch == 4 * sizeof(float));
+  checkCopy({4, 4}, {8, 1}, {4, 1});
+
+  // Size 1 dimensions and dimensions contiguous on both sides are merged.
+  auto merged = plan({1, 4, 2, 3, 1}, {99, 12, 6, 1, 1}, {99, 6, 3, 1, 1});
+  EXPECT(merged && merged->width == 3 * sizeof(float));
+  EXPECT(merged->height == 8 && merged->depth == 1);
+  checkCopy({4, 2, 3}, {12, 6, 1}, {6, 3, 1});
+
+  // A slice of a 3d tensor is a 3d copy.
+  auto slice = plan({2, 3, 4}, {40, 8, 1}, {12, 4, 1});
+  EXPECT(slice && slice->depth == 2 && slice->height == 3);
+  EXPECT(slice->dst_slice == 40 * sizeof(float));
+  checkCopy({2, 3, 4}, {40, 8, 1}, {12, 4, 1});
+
+  // Every other element is copied one element per row.
+  auto every_other = plan({5}, {1}, {2});
+  EXPECT(every_other && every_other->width == sizeof(float));
+  EXPECT(every_other->height == 5);
+  checkCopy({5}, {1}, {2});
+
+  // Too many dimensions left, interleaved planes (a transpose), broadcast
+  // (overlapping rows), and negative strides are not pitched copies.
+  EXPECT(!plan({3, 5}, {1, 3}, {5, 1}).has_value());
+  EXPECT(!plan({2, 2, 2, 2}, {64, 16, 4, 1}, {8, 4, 2, 1}).has_value());
+  EXPECT(!plan({4, 4}, {4, 1}, {0, 1}).has_value());
+  EXPECT(!plan({4, 4}, {4, 1}, {-4, 1}).has_value());
+
+  // Rows enough to be split over threads.
+  checkCopy({4096, 1024}, {1024, 1}, {2048, 1});
+
+  // doMemCopyH2H: one memcpy for the same strides, a pitched copy for columns
+  // and ATen's copy for a transpose.
+  auto base = at::arange(64, at::kFloat).reshape({8, 8});
+  checkCopyH2H(at::empty({8, 8}), base);
+  checkCopyH2H(at::empty({8, 4}), base.slice(1, 2, 6));
+  checkCopyH2H(at::empty({8, 8}).slice(1, 0, 4), at::empty({8, 4}).fill_(1));
+  checkCopyH2H(at::empty({8, 8}), base.t());
+
+  std::cout << "pitched copy plan: ok" << std::endl;
+  return 0;
+}
@@ -0,0 +1,75 @@
+# Copyright (c) 2024, DeepLink.
+import itertools
+import os
+from utils.metrics import metric_sum
+from utils.test_in_subprocess import run_individual_test_cases
+
+
+def test_async_pool_reaper(algorithm: str):
+    os.environ["DIPU_DEVICE_MEMCACHING_ALGORITHM"] = algorithm
+    os.environ["DIPU_HOST_MEMCACHING_ALGORITHM"] = algorithm
+    os.environ["DIPU_ASYNC_POOL_REAPER"] = "1"
+    import torch
+    import torch_dipu
+
+    stream = torch.cuda.Stream()
+    expected = torch.ones(1 << 20, device="cuda")
+    with torch.cuda.stream(stream):
+        for _ in range(200):
+            # Blocks freed on a side stream carry events and go to the reaper.
+            # They are too large for the thread-local cache of BF.
+            x = torch.ones(1 << 20, device="cuda")
+            y = x * 2 - 1
+            assert torch.allclose(y, expected)
+            del x, y
+    stream.synchronize()
+
+    torch.cuda.empty_cache()
+    assert torch.cuda.memory_allocated() == expected.numel() * 4
+    assert metric_sum("allocator_reaper_reclaimed_bytes") > 0
+
+
+def test_async_pool_reaper_busy_stream(algorithm: str):
+    os.environ["DIPU_DEVICE_MEMCACHING_ALGORITHM"] = algorithm
+    os.environ["DIPU_ASYNC_POOL_REAPER"] = "1"
+    os.environ["DIPU_ASYNC_POOL_REAPER_INTERVAL_US"] = "50"
+    import time
+    import torch
+    import torch_dipu
+
+    busy = torch.cuda.Stream()
+    side = torch.cuda.Stream()
+    a = torch.randn(2048, 2048, device="cuda")
+    torch.cuda.synchronize()
+    with torch.cuda.stream(busy):
+        x = torch.empty(1 << 20, device="cuda")
+        for _ in range(200):
+            a = a @ a / 2048
+        del x
+    with torch.cuda.stream(side):
+        y = torch.empty(1 << 20, device="cuda")
+        y.fill_(1)
+        del y
+    side.synchronize()
+
+    # The block freed on the side stream is reclaimed without waiting for the
+    # kernels of the busy stream, which hold back the block freed there.
+    deadline = time.monotonic() + 1
+    while metric_sum("allocator_reaper_reclaimed_count") == 0:
+        assert time.monotonic() < deadline
+        time.sleep(0.001)
+    busy.synchronize()
+
+
+if __name__ == "__main__":
+    run_individual_test_cases(
+        itertools.product(
+            (test_async_pool_reaper, test_async_pool_reaper_busy_stream),
+            (
+                {"args": ("BF",)},
+                {"args": ("BS",)},
+                {"args": ("RAW",)},
+            ),
+        ),
+        in_parallel=False,
+    )
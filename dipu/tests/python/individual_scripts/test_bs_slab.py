@@ -0,0 +1,83 @@
+# Copyright (c) 2024, DeepLink.
+# With DIPU_BS_SLAB_MAX_SIZE set, small blocks of the BS allocator are slots of
+# shared slab segments, which are given back through the async pool by a
+# tagged handle rather than by their size.
+import os
+from utils.test_in_subprocess import run_individual_test_cases
+
+
+def segment_of(memory, ptr: int) -> int:
+    for segment in memory._snapshot()["segments"]:
+        if segment["address"] <= ptr < segment["address"] + segment["total_size"]:
+            return segment["address"]
+    assert False, f"{ptr:#x} is in no segment"
+
+
+def test_bs_slab():
+    os.environ["DIPU_DEVICE_MEMCACHING_ALGORITHM"] = "BS"
+    os.environ["DIPU_BS_SLAB_MAX_SIZE"] = "4096"
+    import torch
+    import torch_dipu
+    from torch_dipu.dipu import memory
+
+    torch.cuda.empty_cache()
+    allocated = torch.cuda.memory_allocated()
+    reserved = torch.cuda.memory_reserved()
+
+    # Slots of one size class share a segment and do not overlap.
+    small = [torch.full((64,), float(i), device="cuda") for i in range(100)]
+    assert len({t.data_ptr() for t in small}) == len(small)
+    assert len({segment_of(memory, t.data_ptr()) for t in small}) == 1
+    for i, t in enumerate(small):
+        assert torch.all(t.cpu() == i)
+
+    # A freed slot comes back through its handle and is reused first, also
+    # when regular blocks are freed in between.
+    large = torch.empty(1 << 20, device="cuda")
+    ptr = small[-1].data_ptr()
+    del small[-1], large
+    again = torch.empty(64, device="cuda")
+    assert again.data_ptr() == ptr
+    large = torch.empty(1 << 20, device="cuda")
+    assert segment_of(memory, large.data_ptr()) != segment_of(memory, ptr)
+
+    # Segments without live slots are released by empty_cache.
+    del small, again, large
+    torch.cuda.synchronize()
+    torch.cuda.empty_cache()
+    assert torch.cuda.memory_allocated() == allocated
+    assert torch.cuda.memory_reserved() == reserved
+
+
+def test_bs_slab_unaligned_sizes():
+    os.environ["DIPU_DEVICE_MEMCACHING_ALGORITHM"] = "BS"
+    # The largest size class needs a slot of 1024 bytes, more than both sizes.
+    os.environ["DIPU_BS_SLAB_MAX_SIZE"] = "1000"
+    os.environ["DIPU_BS_SLAB_SEGMENT_SIZE"] = "600"
+    import torch
+    import torch_dipu
+
+    # Each segment still holds a slot of the largest size class.
+    blocks = [torch.full((250,), float(i), device="cuda") for i in range(3)]
+    assert len({t.data_ptr() for t in blocks}) == len(blocks)
+    for i, t in enumerate(blocks):
+        assert torch.all(t.cpu() == i)
+
+
+def test_bs_slab_disabled():
+    os.environ["DIPU_DEVICE_MEMCACHING_ALGORITHM"] = "BS"
+    import torch
+    import torch_dipu
+    from torch_dipu.dipu import memory
+
+    # Off by default: every small block is a segment of its own.
+    a = torch.empty(64, device="cuda")
+    b = torch.empty(64, device="cuda")
+    assert segment_of(memory, a.data_ptr()) != segment_of(memory, b.data_ptr())
+
+
+if __name__ == "__main__":
+    run_individual_test_cases(
+        (test_bs_slab, test_bs_slab_unaligned_sizes, test_bs_slab_disabled),
+        in_parallel=False,
+    )
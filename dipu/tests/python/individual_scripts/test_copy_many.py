@@ -0,0 +1,105 @@
+# Copyright (c) 2024, DeepLink.
+# copy_many_ sends the small dense host-to-device (and blocking device-to-host)
+# copies of a batch in one transfer, and copies the rest like copy_.
+from utils.metrics import metric_sum
+from utils.test_in_subprocess import run_individual_test_cases
+
+
+def make_batch(torch):
+    return {
+        "input_ids": torch.randint(0, 30000, (8, 128)),
+        "attention_mask": torch.ones(8, 128, dtype=torch.bool),
+        "labels": torch.randint(0, 10, (8,)),
+        "pixel_values": torch.randn(8, 3, 16, 16).to(memory_format=torch.channels_last),
+        "weights": torch.randn(8, dtype=torch.float16),
+        "empty": torch.empty(0),
+        # Copied on their own: too large, a view with holes, and a cast.
+        "large": torch.randn(1 << 20),
+        "strided": torch.randn(16, 16)[:, ::2],
+        "cast": torch.randn(4, 4, dtype=torch.float64),
+    }
+
+
+def test_copy_many_h2d():
+    import torch
+    import torch_dipu
+
+    torch_dipu._C.enable_metrics(True)
+    for non_blocking in (False, True):
+        srcs = list(make_batch(torch).values())
+        if non_blocking:
+            srcs = [src.pin_memory() for src in srcs]
+        dsts = [torch.empty_like(src, device="cuda") for src in srcs]
+        dsts[-1] = torch.empty(4, 4, device="cuda")
+        torch_dipu.dipu.copy_many_(dsts, srcs, non_blocking=non_blocking)
+        torch.cuda.synchronize()
+        for dst, src in zip(dsts, srcs):
+            assert torch.equal(dst.cpu(), src.to(dst.dtype))
+
+    counts = metric_sum("copy_batched_tensor_count", by="direction")
+    print(f"batched tensors: {counts}")
+    assert counts.get("h2d", 0) == 2 * 5
+
+
+def test_copy_many_d2h():
+    import torch
+    import torch_dipu
+
+    torch_dipu._C.enable_metrics(True)
+    srcs = [t.cuda() for t in make_batch(torch).values()]
+    dsts = [torch.empty_like(src, device="cpu") for src in srcs]
+    torch_dipu.dipu.copy_many_(dsts, srcs)
+    for dst, src in zip(dsts, srcs):
+        assert torch.equal(dst, src.cpu())
+    # All but the empty and the large tensor, the others are dense copies of
+    # the same dtype on the device.
+    assert metric_sum("copy_batched_tensor_count", by="direction").get("d2h", 0) == 7
+
+    # Into pinned memory without blocking, copied one by one.
+    dsts = [torch.empty_like(src, device="cpu").pin_memory() for src in srcs]
+    torch_dipu.dipu.copy_many_(dsts, srcs, non_blocking=True)
+    torch.cuda.synchronize()
+    for dst, src in zip(dsts, srcs):
+        assert torch.equal(dst, src.cpu())
+    assert metric_sum("copy_batched_tensor_count", by="direction").get("d2h", 0) == 7
+
+
+def test_copy_many_in_order():
+    import torch
+    import torch_dipu
+
+    # Each pair sees what the pairs before it wrote.
+    ones = torch.ones(16)
+    twos = torch.full((16,), 2.0)
+    device = torch.empty(16, device="cuda")
+    first = torch.empty(16)
+    second = torch.empty(16)
+    torch_dipu.dipu.copy_many_(
+        [device, first, device, second], [ones, device, twos, device]
+    )
+    assert torch.equal(first, ones)
+    assert torch.equal(second, twos)
+
+
+def test_copy_many_mismatch():
+    import torch
+    import torch_dipu
+
+    try:
+        torch_dipu.dipu.copy_many_([torch.empty(1, device="cuda")], [])
+    except RuntimeError as e:
+        assert "copy_many_" in str(e)
+    else:
+        assert False, "copy_many_ accepted lists of different lengths"
+
+
+if __name__ == "__main__":
+    run_individual_test_cases(
+        (
+            test_copy_many_h2d,
+            test_copy_many_d2h,
+            test_copy_many_in_order,
+            test_copy_many_mismatch,
+        ),
+        in_parallel=False,
+    )
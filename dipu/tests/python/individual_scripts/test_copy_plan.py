@@ -0,0 +1,82 @@
+# Copyright (c) 2024, DeepLink.
+# copy_ records a plan per pair of dtypes and layouts when asked to, and copies
+# between a host view with holes and the device relay through one contiguous
+# device tensor either way.
+import os
+from utils.test_in_subprocess import run_individual_test_cases
+
+
+def find_plan(torch_dipu, direction, dst, src) -> dict:
+    for plan in torch_dipu.dipu.copy_plans():
+        if (
+            plan["direction"] == direction
+            and plan["dst_dtype"] == dst.dtype
+            and plan["src_dtype"] == src.dtype
+            and plan["sizes"] == list(dst.shape)
+            and plan["dst_strides"] == list(dst.stride())
+            and plan["src_strides"] == list(src.stride())
+        ):
+            return plan
+    assert False, f"no {direction} plan for {dst.shape} {dst.stride()}"
+
+
+def test_copy_plans():
+    import torch
+    import torch_dipu
+
+    # Not recorded by default.
+    torch.randn(8, 8).cuda()
+    assert torch_dipu.dipu.copy_plans() == []
+    torch_dipu.dipu.record_copy_plans()
+
+    # A direct copy, planned once for all the copies of the same layouts.
+    src = torch.randn(16, 16)
+    dst = torch.empty(16, 16, device="cuda")
+    for _ in range(3):
+        dst.copy_(src)
+    assert torch.equal(dst.cpu(), src)
+    plan = find_plan(torch_dipu, "h2d", dst, src)
+    assert plan["steps"] == ["memcpy"]
+    assert plan["intermediates"] == 0
+    assert plan["count"] == 3
+
+    # Cast and slice: the columns are sent into a contiguous relay, which is
+    # then cast into dst on the device.
+    src = torch.randn(32, 64, dtype=torch.float64)[:, :16]
+    dst = torch.empty(32, 16, device="cuda")
+    dst.copy_(src)
+    assert torch.equal(dst.cpu(), src.float())
+    plan = find_plan(torch_dipu, "h2d", dst, src)
+    assert plan["steps"][0] == "pitched_memcpy"
+    assert plan["intermediates"] >= 1
+
+    # And back, into a sliced host tensor whose holes are left untouched.
+    base = torch.zeros(32, 64, dtype=torch.float64)
+    dst = base[:, :16]
+    src = torch.randn(32, 16, device="cuda")
+    dst.copy_(src)
+    assert torch.equal(dst, src.cpu().double())
+    assert torch.count_nonzero(base[:, 16:]) == 0
+    plan = find_plan(torch_dipu, "d2h", dst, src)
+    assert plan["steps"][-1] == "pitched_memcpy"
+    assert plan["intermediates"] >= 1
+
+    for plan in torch_dipu.dipu.copy_plans():
+        assert plan["count"] > 0
+        assert plan["intermediates"] <= 2
+
+
+def test_dump_copy_plans():
+    os.environ["DIPU_DUMP_COPY_PLANS"] = "1"
+    import torch
+    import torch_dipu
+
+    torch.randn(8, 8).cuda().cpu()
+    torch_dipu._C.release_all_resources()
+
+
+if __name__ == "__main__":
+    run_individual_test_cases(
+        (test_copy_plans, test_dump_copy_plans),
+        in_parallel=False,
+    )
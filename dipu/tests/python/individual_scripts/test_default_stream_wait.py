@@ -0,0 +1,39 @@
+# Copyright (c) 2024, DeepLink.
+import os
+from utils.metrics import metric_sum
+from utils.test_in_subprocess import run_individual_test_cases
+
+
+def events_used() -> int:
+    return metric_sum("event_pool_count", event="created") + metric_sum(
+        "event_pool_count", event="reused"
+    )
+
+
+def test_default_stream_wait_elided():
+    os.environ["DIPU_DEVICE_MEMCACHING_ALGORITHM"] = "BF"
+    import torch
+    import torch_dipu
+
+    x = torch.ones(1024, device="cuda")
+    torch.cuda.synchronize()
+    stream = torch.cuda.Stream()
+    with torch.cuda.stream(stream):
+        torch.empty(256, device="cuda")
+        before = events_used()
+        for _ in range(1000):
+            torch.empty(256, device="cuda")
+        # The default stream is idle, so no event was recorded.
+        assert events_used() - before < 10
+
+    # New work on the default stream is still waited for.
+    y = x * 2
+    with torch.cuda.stream(stream):
+        z = torch.empty(1024, device="cuda")
+        z.copy_(y)
+    stream.synchronize()
+    assert torch.equal(z.cpu(), torch.full((1024,), 2.0))
+
+
+if __name__ == "__main__":
+    run_individual_test_cases((test_default_stream_wait_elided,), in_parallel=False)
@@ -0,0 +1,58 @@
+# Copyright (c) 2024, DeepLink.
+# Counts the device queries and switches sent to the vendor runtime per eager
+# op, with the per-thread device cache of devproxy (after) and without it
+# (before, DIPU_DEVICE_CACHE=0).
+import os
+from utils.metrics import metric_sum
+from utils.test_in_subprocess import run_individual_test_cases
+
+OPS = 1000
+
+
+def run_eager_ops():
+    import torch
+    import torch_dipu
+
+    x = torch.ones(1024, device="cuda")
+    stream = torch.cuda.Stream()
+    event = torch.cuda.Event()
+    x.add_(1)
+    torch.cuda.synchronize()
+
+    before = metric_sum("device_vendor_call_count")
+    for _ in range(OPS):
+        with torch.cuda.stream(stream):
+            x.add_(1)
+        event.record(stream)
+        event.query()
+    torch.cuda.synchronize()
+    calls = (metric_sum("device_vendor_call_count") - before) / OPS
+    assert torch.equal(x.cpu(), torch.full((1024,), OPS + 2.0))
+    return calls
+
+
+def test_with_device_cache():
+    calls = run_eager_ops()
+    print(f"vendor device calls per op with cache: {calls:.3f}")
+    assert calls < 0.01
+
+    import torch_dipu
+
+    # Resyncing with the vendor runtime keeps the device.
+    device = torch_dipu._C._dipu_current_device()
+    torch_dipu._C._dipu_syncDeviceCache()
+    assert torch_dipu._C._dipu_current_device() == device
+
+
+def test_without_device_cache():
+    os.environ["DIPU_DEVICE_CACHE"] = "0"
+    calls = run_eager_ops()
+    print(f"vendor device calls per op without cache: {calls:.3f}")
+    assert calls >= 1
+
+
+if __name__ == "__main__":
+    run_individual_test_cases(
+        (test_with_device_cache, test_without_device_cache),
+        in_parallel=False,
+    )
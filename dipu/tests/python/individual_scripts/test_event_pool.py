@@ -0,0 +1,49 @@
+# Copyright (c) 2024, DeepLink.
+import os
+import threading
+from utils.metrics import metric_sum
+from utils.test_in_subprocess import run_individual_test_cases
+
+
+def test_event_pool_reuse():
+    import torch
+    import torch_dipu
+
+    def churn():
+        stream = torch.cuda.Stream()
+        for _ in range(500):
+            event = torch.cuda.Event()
+            event.record(stream)
+            event.synchronize()
+
+    threads = [threading.Thread(target=churn) for _ in range(4)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+    counts = metric_sum("event_pool_count", by="event")
+    assert counts.get("created", 0) > 0
+    assert counts.get("reused", 0) > counts["created"]
+
+
+def test_event_pool_capacity():
+    os.environ["DIPU_EVENT_POOL_CAPACITY"] = "1"
+    import torch
+    import torch_dipu
+
+    stream = torch.cuda.Stream()
+    events = [torch.cuda.Event() for _ in range(8)]
+    for event in events:
+        event.record(stream)
+    stream.synchronize()
+    del events
+
+    # Only one idle event is kept, the others go back to the driver.
+    assert metric_sum("event_pool_count", by="event").get("destroyed", 0) >= 7
+
+
+if __name__ == "__main__":
+    run_individual_test_cases(
+        (test_event_pool_reuse, test_event_pool_capacity), in_parallel=True
+    )
@@ -0,0 +1,78 @@
+# Copyright (c) 2024, DeepLink.
+# Large non-blocking copies from pageable host memory go through
+# double-buffered pinned staging (DIPU_H2D_STAGING_CHUNK_MB) instead of
+# synchronizing the stream. Small (DIPU_H2D_STAGING_MIN_KB) and blocking copies
+# still synchronize it.
+import os
+from utils.test_in_subprocess import run_individual_test_cases
+
+
+def queue_work(torch):
+    x = torch.randn(4096, 4096, device="cuda")
+    for _ in range(50):
+        x = x @ x
+        x = x / x.norm()
+    return x
+
+
+def check_copies(torch):
+    # Below the staging threshold, several chunks, and several chunks plus a
+    # partial one.
+    for numel in (1000, 1 << 20, (3 << 20) + 123):
+        src = torch.randn(numel)
+        dst = torch.empty(numel, device="cuda")
+        dst.copy_(src, non_blocking=True)
+        expected = src.clone()
+        # The source may be reused as soon as copy_ returns.
+        src.fill_(-1)
+        torch.cuda.synchronize()
+        assert torch.equal(dst.cpu(), expected)
+
+    # A dense non-contiguous tensor is staged as well, in less than a chunk.
+    src = torch.randn(64, 3, 32, 32).to(memory_format=torch.channels_last)
+    dst = torch.empty_like(src, device="cuda")
+    dst.copy_(src, non_blocking=True)
+    torch.cuda.synchronize()
+    assert torch.equal(dst.cpu(), src)
+
+
+def test_staged():
+    os.environ["DIPU_H2D_STAGING_CHUNK_MB"] = "1"
+    os.environ["DIPU_H2D_STAGING_MIN_KB"] = "64"
+    import torch
+    import torch_dipu
+
+    check_copies(torch)
+
+    # Neither small nor blocking copies are staged, both wait for queued work.
+    for numel, non_blocking in ((1000, True), (4 << 20, False)):
+        queue_work(torch)
+        src = torch.randn(numel)
+        dst = torch.empty(numel, device="cuda")
+        dst.copy_(src, non_blocking=non_blocking)
+        assert torch.cuda.current_stream().query()
+        assert torch.equal(dst.cpu(), src)
+
+    queue_work(torch)
+    src = torch.randn(4 << 20)
+    dst = torch.empty(4 << 20, device="cuda")
+    dst.copy_(src, non_blocking=True)
+    # The queued work is still running, the copy did not wait for it.
+    assert not torch.cuda.current_stream().query()
+    torch.cuda.synchronize()
+    assert torch.equal(dst.cpu(), src)
+
+
+def test_not_staged():
+    os.environ["DIPU_H2D_STAGING_CHUNK_MB"] = "0"
+    import torch
+    import torch_dipu
+
+    check_copies(torch)
+
+
+if __name__ == "__main__":
+    run_individual_test_cases(
+        (test_staged, test_not_staged),
+        in_parallel=False,
+    )
@@ -0,0 +1,61 @@
+# Copyright (c) 2024, DeepLink.
+import os
+from utils.test_in_subprocess import run_individual_test_cases
+
+
+def test_iteration_reservation(warmup: int):
+    os.environ["DIPU_DEVICE_MEMCACHING_ALGORITHM"] = "BF"
+    os.environ["DIPU_BF_ITERATION_WARMUP"] = str(warmup)
+    import torch
+    import torch_dipu
+    from torch_dipu import dipu
+
+    weight = torch.randn(1024, 1024, device="cuda")
+    side = torch.cuda.Stream()
+    side.wait_stream(torch.cuda.current_stream())
+
+    def step():
+        acts = [weight * i for i in range(8)]
+        out = sum(a.sum() for a in acts)
+        del acts
+        return out.item()
+
+    def iterations(count):
+        for _ in range(count):
+            dipu.mark_iteration_boundary()
+            step()
+            # Every stream allocating in steady state gets its own arena.
+            with torch.cuda.stream(side):
+                step()
+        dipu.mark_iteration_boundary()
+
+    iterations(warmup + 5)
+    report = dipu.iteration_memory_report()
+    print(report)
+    assert report["iterations"] == warmup + 6
+    assert report["warmup_iterations"] == warmup
+    assert report["peak_bytes"] >= 9 * weight.numel() * 4
+    assert report["transient_peak_bytes"] >= 8 * weight.numel() * 4
+    assert report["arena_bytes"] >= report["transient_peak_bytes"]
+    assert report["device_allocations_after_warmup"] == 0
+    assert report["reserved_to_peak_ratio"] >= 1.0
+
+    # Releasing the arenas starts warm-up over.
+    torch.cuda.empty_cache()
+    assert torch.cuda.memory_reserved() > 0
+    report = dipu.iteration_memory_report()
+    assert report["iterations"] == 0
+    assert report["arena_bytes"] == 0
+
+    iterations(warmup + 3)
+    report = dipu.iteration_memory_report()
+    assert report["iterations"] == warmup + 4
+    assert report["arena_bytes"] >= report["transient_peak_bytes"] > 0
+    assert report["device_allocations_after_warmup"] == 0
+
+
+if __name__ == "__main__":
+    run_individual_test_cases(
+        [(test_iteration_reservation, {"args": (2,)})],
+        in_parallel=False,
+    )
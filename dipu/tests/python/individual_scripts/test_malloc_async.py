@@ -0,0 +1,80 @@
+# Copyright (c) 2024, DeepLink.
+import itertools
+import os
+from utils.test_in_subprocess import run_individual_test_cases
+
+
+def test_malloc_async(algorithm: str):
+    os.environ["DIPU_DEVICE_MEMCACHING_ALGORITHM"] = algorithm
+    import torch
+    import torch_dipu
+
+    stream = torch.cuda.Stream()
+    size = 3 << 20
+    ptr = torch_dipu.malloc_async(size, stream)
+    assert ptr != 0
+    assert torch.cuda.memory_allocated() >= size
+    torch_dipu.free_async(ptr, stream)
+
+    # Memory freed on a stream is reused by the next allocation on it.
+    assert torch_dipu.malloc_async(size, stream) == ptr
+    torch_dipu.free_async(ptr, stream)
+
+    # Handing memory over from one stream to another.
+    other = torch.cuda.Stream()
+    ptr = torch_dipu.malloc_async(size, stream)
+    other.wait_stream(stream)
+    torch_dipu.free_async(ptr, other)
+    reused = torch_dipu.malloc_async(size, other)
+    if algorithm == "BF":
+        # TORCH keeps blocks with their allocation stream.
+        assert reused == ptr
+    torch_dipu.free_async(reused, other)
+
+    assert torch_dipu.malloc_async(0, stream) == 0
+    torch.cuda.synchronize()
+    torch.cuda.empty_cache()
+    assert torch.cuda.memory_allocated() == 0
+
+    try:
+        torch_dipu.free_async(ptr + 512, stream)
+    except RuntimeError:
+        pass
+    else:
+        assert False, "freeing an unknown pointer must fail"
+
+
+def test_oom_reclaims_async_blocks(algorithm: str):
+    os.environ["DIPU_DEVICE_MEMCACHING_ALGORITHM"] = algorithm
+    import torch
+    import torch_dipu
+
+    stream = torch.cuda.Stream()
+    free, _ = torch.cuda.mem_get_info()
+    chunk = 256 << 20
+    # Take most of the device memory with mallocAsync and free it on a stream.
+    ptrs = [torch_dipu.malloc_async(chunk, stream) for _ in range(free // chunk - 2)]
+    for ptr in ptrs:
+        torch_dipu.free_async(ptr, stream)
+    # A plain tensor allocation that needs that memory gets it back instead of
+    # running out of memory.
+    x = torch.empty(len(ptrs) * chunk, dtype=torch.uint8, device="cuda")
+    del x
+    torch.cuda.synchronize()
+    torch.cuda.empty_cache()
+
+
+if __name__ == "__main__":
+    run_individual_test_cases(
+        itertools.chain(
+            itertools.product(
+                (test_malloc_async,),
+                ({"args": ("BF",)}, {"args": ("TORCH",)}),
+            ),
+            itertools.product(
+                (test_oom_reclaims_async_blocks,),
+                ({"args": ("BF",)}, {"args": ("BS",)}, {"args": ("RAW",)}),
+            ),
+        ),
+        in_parallel=False,
+    )
@@ -0,0 +1,55 @@
+# Copyright (c) 2024, DeepLink.
+import os
+from utils.test_in_subprocess import run_individual_test_cases
+
+
+def test_sample_interval():
+    os.environ["DIPU_MEM_CHECK_SAMPLE"] = "1"
+    os.environ["DIPU_MEM_CHECK_SAMPLE_INTERVAL"] = "1"
+    import torch
+    import torch_dipu
+    from torch_dipu.dipu import memory
+
+    leaked = [torch.empty(1024, device="cuda") for _ in range(16)]
+    stacks = memory.sampled_memory_stacks()
+    assert sum(s["count"] for s in stacks) >= len(leaked)
+    assert sum(s["size"] for s in stacks) >= 16 * 1024 * 4
+    assert all(s["frames"] for s in stacks)
+    assert [s["size"] for s in stacks] == sorted(
+        (s["size"] for s in stacks), reverse=True
+    )
+
+    count = sum(s["count"] for s in stacks)
+    del leaked
+    assert sum(s["count"] for s in memory.sampled_memory_stacks()) <= count - 16
+
+
+def test_sample_bytes():
+    os.environ["DIPU_MEM_CHECK_SAMPLE"] = "1"
+    os.environ["DIPU_MEM_CHECK_SAMPLE_BYTES"] = str(1 << 20)
+    import torch
+    import torch_dipu
+    from torch_dipu.dipu import memory
+
+    # 64MB in total, about 64 samples are expected.
+    leaked = [torch.empty(1 << 16, device="cuda") for _ in range(256)]
+    count = sum(s["count"] for s in memory.sampled_memory_stacks())
+    assert 16 < count < 256
+    del leaked
+    assert sum(s["count"] for s in memory.sampled_memory_stacks()) < count
+
+
+def test_sampling_disabled():
+    import torch
+    import torch_dipu
+    from torch_dipu.dipu import memory
+
+    x = torch.empty(1 << 20, device="cuda")
+    assert memory.sampled_memory_stacks() == []
+
+
+if __name__ == "__main__":
+    run_individual_test_cases(
+        (test_sample_interval, test_sample_bytes, test_sampling_disabled),
+        in_parallel=True,
+    )
@@ -0,0 +1,61 @@
+# Copyright (c) 2024, DeepLink.
+import itertools
+import os
+from utils.test_in_subprocess import run_individual_test_cases
+
+
+def test_memory_pool(algorithm: str):
+    os.environ["DIPU_DEVICE_MEMCACHING_ALGORITHM"] = algorithm
+    import torch
+    import torch_dipu
+
+    nbytes = 4 << 20
+    base = torch.empty(nbytes, dtype=torch.uint8, device="cuda")
+    reserved = torch.cuda.memory_reserved()
+
+    with torch_dipu.memory_pool("eval"):
+        x = torch.empty(nbytes, dtype=torch.uint8, device="cuda")
+        with torch_dipu.memory_pool("workspace"):
+            y = torch.empty(nbytes, dtype=torch.uint8, device="cuda")
+        z = torch.empty(nbytes, dtype=torch.uint8, device="cuda")
+
+    stats = torch_dipu.memory_pool_stats("eval")
+    assert stats["allocated_bytes"] >= 2 * nbytes
+    assert stats["reserved_bytes"] >= stats["allocated_bytes"]
+    assert stats["max_allocated_bytes"] >= stats["allocated_bytes"]
+    assert torch_dipu.memory_pool_stats("workspace")["allocated_bytes"] >= nbytes
+    assert torch_dipu.memory_pool_stats("unused")["reserved_bytes"] == 0
+
+    # Memory freed inside a pool is not handed out outside of it.
+    x_ptr = x.data_ptr()
+    del x
+    torch.cuda.synchronize()
+    w = torch.empty(nbytes, dtype=torch.uint8, device="cuda")
+    assert w.data_ptr() != x_ptr
+    pool_reserved = torch_dipu.memory_pool_stats("eval")["reserved_bytes"]
+    with torch_dipu.memory_pool("eval"):
+        x = torch.empty(nbytes, dtype=torch.uint8, device="cuda")
+    assert torch_dipu.memory_pool_stats("eval")["reserved_bytes"] == pool_reserved
+
+    del x, y, z
+    torch.cuda.synchronize()
+    torch_dipu.release_memory_pool("eval")
+    torch_dipu.release_memory_pool("workspace")
+    assert torch_dipu.memory_pool_stats("eval")["reserved_bytes"] == 0
+    assert torch_dipu.memory_pool_stats("workspace")["reserved_bytes"] == 0
+    assert base.numel() == nbytes
+    assert torch.cuda.memory_reserved() >= reserved
+
+
+if __name__ == "__main__":
+    run_individual_test_cases(
+        itertools.product(
+            (test_memory_pool,),
+            (
+                {"args": ("BF",)},
+                {"args": ("BS",)},
+                {"args": ("TORCH",)},
+            ),
+        ),
+        in_parallel=False,
+    )
@@ -0,0 +1,60 @@
+# Copyright (c) 2024, DeepLink.
+import itertools
+import os
+import pickle
+import tempfile
+from utils.test_in_subprocess import run_individual_test_cases
+
+
+def test_memory_snapshot(algorithm: str):
+    os.environ["DIPU_DEVICE_MEMCACHING_ALGORITHM"] = algorithm
+    import torch
+    import torch_dipu
+    from torch_dipu.dipu import memory
+
+    keep = [torch.empty(size, device="cuda") for size in (1 << 20, 1000, 3 << 20)]
+    freed = torch.empty(2 << 20, device="cuda")
+    del freed
+    torch.cuda.synchronize()
+
+    snapshot = memory._snapshot()
+    segments = snapshot["segments"]
+    assert segments
+    assert snapshot["device_traces"] == []
+    assert sum(s["total_size"] for s in segments) == torch.cuda.memory_reserved()
+
+    allocated = {}
+    for segment in segments:
+        assert segment["segment_type"] in ("large", "small")
+        assert sum(b["size"] for b in segment["blocks"]) == segment["total_size"]
+        for block in segment["blocks"]:
+            assert block["state"] in (
+                "active_allocated",
+                "active_pending_free",
+                "inactive",
+            )
+            if block["state"] == "active_allocated":
+                allocated[block["address"]] = block["size"]
+    for tensor in keep:
+        assert allocated[tensor.data_ptr()] >= tensor.numel() * 4
+    assert sum(s["allocated_size"] for s in segments) == sum(allocated.values())
+
+    with tempfile.TemporaryDirectory() as tmp:
+        path = os.path.join(tmp, "snapshot.pickle")
+        memory._dump_snapshot(path)
+        with open(path, "rb") as f:
+            assert pickle.load(f)["segments"]
+
+
+if __name__ == "__main__":
+    run_individual_test_cases(
+        itertools.product(
+            (test_memory_snapshot,),
+            (
+                {"args": ("BF",)},
+                {"args": ("BS",)},
+                {"args": ("TORCH",)},
+            ),
+        ),
+        in_parallel=False,
+    )
@@ -0,0 +1,78 @@
+# Copyright (c) 2024, DeepLink.
+import os
+from utils.metrics import metric_sum
+from utils.test_in_subprocess import run_individual_test_cases
+
+MB = 1 << 20
+
+
+def test_size_classes():
+    import torch
+    import torch_dipu
+
+    size = 3 * MB + 4096
+    x = torch.empty(size, dtype=torch.uint8, pin_memory=True)
+    # Powers of two would waste almost 1MB here.
+    assert 0 < metric_sum("pinned_host_wasted_bytes") < size // 4
+    del x
+    assert metric_sum("pinned_host_wasted_bytes") == 0
+    assert metric_sum("pinned_host_cross_node_count") == 0
+
+
+def test_power_of_two_classes():
+    os.environ["DIPU_HOST_SIZE_CLASS_STEPS"] = "1"
+    import torch
+    import torch_dipu
+
+    size = 3 * MB + 4096
+    x = torch.empty(size, dtype=torch.uint8, pin_memory=True)
+    assert metric_sum("pinned_host_wasted_bytes") == 4 * MB - size
+
+
+def test_reserve():
+    os.environ["DIPU_HOST_PINNED_RESERVE_MB"] = "16"
+    import torch
+    import torch_dipu
+
+    tensors = [torch.full((MB,), float(i), pin_memory=True) for i in range(3)]
+    for i, tensor in enumerate(tensors):
+        assert tensor.is_pinned()
+        assert torch.equal(tensor.cuda().cpu(), torch.full((MB,), float(i)))
+    # Reserved blocks stay cached.
+    torch.cuda.empty_cache()
+    y = torch.ones(MB, pin_memory=True)
+    assert y.is_pinned()
+
+
+def test_expandable_segments():
+    os.environ["DIPU_HOST_EXPANDABLE_SEGMENTS"] = "1"
+    import torch
+    import torch_dipu
+
+    # Each growth of the segment is pinned through the vendor's hostRegister,
+    # so the device sees the blocks as pinned and copies them asynchronously.
+    tensors = [torch.full((MB,), float(i), pin_memory=True) for i in range(3)]
+    for i, tensor in enumerate(tensors):
+        assert tensor.is_pinned()
+        device = tensor.to("cuda", non_blocking=True)
+        back = torch.empty(MB, pin_memory=True)
+        back.copy_(device, non_blocking=True)
+        torch.cuda.synchronize()
+        assert torch.equal(back, torch.full((MB,), float(i)))
+    # Freed growths are unregistered and given back, new ones pinned again.
+    del tensors, tensor, back
+    torch.cuda.empty_cache()
+    y = torch.ones(4 * MB, pin_memory=True)
+    assert y.is_pinned()
+
+
+if __name__ == "__main__":
+    run_individual_test_cases(
+        (
+            test_size_classes,
+            test_power_of_two_classes,
+            test_reserve,
+            test_expandable_segments,
+        ),
+        in_parallel=False,
+    )
@@ -0,0 +1,62 @@
+# Copyright (c) 2024, DeepLink.
+# item() reads the element through a ring of pinned slots and waits for its copy
+# only, item_async() returns a future of it.
+from utils.metrics import metric_sum
+from utils.test_in_subprocess import run_individual_test_cases
+
+SLOTS = 256
+
+
+def test_item():
+    import torch
+    import torch_dipu
+
+    for dtype in (torch.float32, torch.float16, torch.bfloat16, torch.int64):
+        x = torch.arange(10, device="cuda").to(dtype)
+        assert x[7].item() == 7
+    assert torch.tensor(True, device="cuda").item() is True
+    assert torch.tensor(2.5, device="cuda").item() == 2.5
+
+    # Ordered after the work queued on the current stream.
+    x = torch.zeros(1 << 20, device="cuda")
+    for _ in range(20):
+        x.add_(1)
+    assert x.sum().item() == 20 * (1 << 20)
+
+    # On another stream, against the work queued on it.
+    stream = torch.cuda.Stream()
+    with torch.cuda.stream(stream):
+        y = x.mul(2)
+        assert y[0].item() == 40
+
+
+def test_item_async():
+    import torch
+    import torch_dipu
+
+    torch_dipu._C.enable_metrics(True)
+    x = torch.zeros(1024, device="cuda")
+    futures = []
+    # More reads than slots in the ring, those finding it empty use the
+    # caching host allocator instead.
+    for i in range(SLOTS * 2):
+        x.add_(1)
+        futures.append(torch_dipu.dipu.item_async(x[i % 1024]))
+    values = torch.futures.wait_all(futures)
+    assert values == [float(i + 1) for i in range(SLOTS * 2)]
+
+    counts = metric_sum("scalar_readback_count", by="path")
+    print(f"scalar readbacks: {counts}")
+    assert counts.get("ring", 0) > 0
+    assert counts.get("ring", 0) + counts.get("fallback", 0) == SLOTS * 2
+
+    chained = torch_dipu.dipu.item_async(x.sum()).then(lambda f: f.value() * 2)
+    assert chained.wait() == 2 * x.sum().item()
+    assert torch_dipu.dipu.item_async(torch.tensor(3)).wait() == 3
+
+
+if __name__ == "__main__":
+    run_individual_test_cases(
+        (test_item, test_item_async),
+        in_parallel=False,
+    )
@@ -0,0 +1,38 @@
+# Copyright (c) 2024, DeepLink.
+import os
+from utils.metrics import metric_sum
+from utils.test_in_subprocess import run_individual_test_cases
+
+
+def test_stream_borrow():
+    os.environ["DIPU_DEVICE_MEMCACHING_ALGORITHM"] = "BF"
+    import torch
+    import torch_dipu
+
+    nbytes = 64 << 20
+    producer = torch.cuda.Stream()
+    consumer = torch.cuda.Stream()
+
+    with torch.cuda.stream(producer):
+        x = torch.ones(nbytes // 4, device="cuda")
+        del x
+    producer.synchronize()
+    reserved = torch.cuda.memory_reserved()
+    count = metric_sum("allocator_stream_borrow_count")
+
+    # The chunk idling in the producer's bins is reused instead of growing.
+    with torch.cuda.stream(consumer):
+        y = torch.full((nbytes // 4,), 2.0, device="cuda")
+        assert torch.cuda.memory_reserved() == reserved
+        assert torch.allclose(y.sum().cpu(), torch.tensor(nbytes / 2))
+        del y
+    consumer.synchronize()
+
+    assert metric_sum("allocator_stream_borrow_count") > count
+
+
+if __name__ == "__main__":
+    run_individual_test_cases(
+        [(test_stream_borrow, {})],
+        in_parallel=False,
+    )
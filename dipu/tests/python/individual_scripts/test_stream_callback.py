@@ -0,0 +1,71 @@
+# Copyright (c) 2024, DeepLink.
+import threading
+from utils.test_in_subprocess import run_individual_test_cases
+
+
+def test_stream_callback_order():
+    import torch
+    import torch_dipu
+
+    done = threading.Event()
+    order = []
+    streams = [torch.cuda.Stream(), torch.cuda.Stream()]
+    x = torch.ones(1 << 20, device="cuda")
+    for i in range(10):
+        stream = streams[i % 2]
+        with torch.cuda.stream(stream):
+            x.mul_(1)
+        stream.add_callback(lambda i=i: order.append(i))
+    streams[0].add_callback(done.set)
+
+    assert done.wait(timeout=60)
+    assert order == list(range(10))
+
+
+def test_stream_callback_after_work():
+    import torch
+    import torch_dipu
+
+    stream = torch.cuda.Stream()
+    result = {}
+    done = threading.Event()
+    with torch.cuda.stream(stream):
+        y = torch.full((1024,), 3.0, device="cuda") * 2
+        host = torch.empty(1024, pin_memory=True)
+        host.copy_(y, non_blocking=True)
+
+    def callback():
+        # The copy has completed without anyone synchronizing.
+        result["sum"] = host.sum().item()
+        done.set()
+
+    stream.add_callback(callback)
+    assert done.wait(timeout=60)
+    assert result["sum"] == 6.0 * 1024
+
+
+def test_stream_callback_error():
+    import torch
+    import torch_dipu
+
+    done = threading.Event()
+
+    def failing():
+        raise RuntimeError("expected failure")
+
+    stream = torch.cuda.current_stream()
+    stream.add_callback(failing)
+    # A failing callback does not stop the queue.
+    stream.add_callback(done.set)
+    assert done.wait(timeout=60)
+
+
+if __name__ == "__main__":
+    run_individual_test_cases(
+        (
+            test_stream_callback_order,
+            test_stream_callback_after_work,
+            test_stream_callback_error,
+        ),
+        in_parallel=True,
+    )
@@ -0,0 +1,64 @@
+# Copyright (c) 2024, DeepLink.
+import os
+import threading
+from utils.test_in_subprocess import run_individual_test_cases
+
+
+def test_stream_pool_size():
+    os.environ["DIPU_STREAMS_PER_POOL"] = "3"
+    import torch
+    import torch_dipu
+
+    streams = [torch.cuda.Stream() for _ in range(6)]
+    assert len({s.dipu_stream for s in streams}) == 3
+    assert streams[0] == streams[3]
+    assert all(s.priority == 0 for s in streams)
+
+
+def test_stream_pool_priority():
+    import torch
+    import torch_dipu
+
+    least, greatest = torch.cuda.Stream.priority_range()
+    assert greatest < least
+    low = torch.cuda.Stream(priority=least)
+    high = torch.cuda.Stream(priority=greatest)
+    assert low.priority == least
+    assert high.priority == greatest
+    assert low.dipu_stream != high.dipu_stream
+
+    x = torch.ones(1024, device="cuda")
+    with torch.cuda.stream(high):
+        y = x * 2
+    high.synchronize()
+    assert torch.equal(y.cpu(), torch.full((1024,), 2.0))
+
+
+def test_sticky_pool_stream():
+    os.environ["DIPU_STICKY_POOL_STREAM"] = "1"
+    os.environ["DIPU_STREAMS_PER_POOL"] = "4"
+    import torch
+    import torch_dipu
+
+    streams = {}
+
+    def worker(index):
+        torch.cuda.set_device(0)
+        own = [torch.cuda.Stream() for _ in range(3)]
+        assert len({s.dipu_stream for s in own}) == 1
+        streams[index] = own[0].dipu_stream
+
+    threads = [threading.Thread(target=worker, args=(i,)) for i in range(4)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    # Threads are spread over the whole pool.
+    assert len(set(streams.values())) == 4
+
+
+if __name__ == "__main__":
+    run_individual_test_cases(
+        (test_stream_pool_size, test_stream_pool_priority, test_sticky_pool_stream),
+        in_parallel=True,
+    )
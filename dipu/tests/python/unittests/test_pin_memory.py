@@ -31,6 +31,12 @@ class TestPinMemory(TestCase):
         x = torch.empty(3, 4, pin_memory=False)
         self.assertFalse(x.is_pinned())
 
+    def test_pin_memory_views(self):
+        x = torch.empty(1 << 20, pin_memory=True)
+        self.assertTrue(x[1:].is_pinned())
+        self.assertTrue(x.view(1024, 1024)[512].is_pinned())
+        self.assertFalse(torch.empty(1 << 20)[1:].is_pinned())
+
 
 if __name__ == "__main__":
     run_tests()
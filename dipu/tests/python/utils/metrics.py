@@ -0,0 +1,29 @@
+# Copyright (c) 2024, DeepLink.
+from typing import Dict, Optional, Union
+
+
+def metric_sum(
+    name: str, by: Optional[str] = None, **labels: str
+) -> Union[int, float, Dict[str, Union[int, float]]]:
+    r"""Sums the values of the metric ``name`` whose labels include ``labels``,
+    or, with ``by``, returns the sums per value of that label.
+
+    torch_dipu is only imported here, so that tests can set the environment
+    before importing it.
+    """
+    import torch_dipu
+
+    total = 0
+    sums = {}
+    for group in torch_dipu._C.metrics():
+        if group.name != name:
+            continue
+        for group_labels, value in group.values:
+            group_labels = dict(group_labels)
+            if any(group_labels.get(k) != v for k, v in labels.items()):
+                continue
+            total += value
+            if by is not None:
+                key = group_labels.get(by)
+                sums[key] = sums.get(key, 0) + value
+    return total if by is None else sums
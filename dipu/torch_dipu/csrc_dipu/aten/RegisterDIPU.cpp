@@ -53,6 +53,7 @@
 #include "csrc_dipu/aten/DIPUATenFunctions.h"
 #include "csrc_dipu/base/basedef.h"
 #include "csrc_dipu/profiler/profiler.h"
+#include "csrc_dipu/runtime/core/DIPUGraph.h"
 #include "csrc_dipu/runtime/core/DIPUStream.h"
 #include "csrc_dipu/runtime/core/allocator/DIPUCachingAllocatorUtils.h"
 #include "csrc_dipu/utils/helpfunc.hpp"
@@ -133,6 +134,10 @@ void dipu_fallback(const c10::OperatorHandle& op, DispatchKeySet dispatch_keys,
   dipu::dump_fallback_op_args(op, stack);
   const auto name = c10::toString(op.operator_name());
   DIPU_OP_LOG_WARNING_ONCE("fallback to cpu, name=" << name << std::endl);
+  if (dipu::DIPUGraph::anyCapturing()) {
+    dipu::DIPUGraph::checkNotRecording(dipu::getCurrentDIPUStream(),
+                                       ("cpu fallback of " + name).c_str());
+  }
 
 #if DIPU_TORCH_VERSION < 20100
   // TORCH_CHECK(name.find("foreach") == std::string::npos,
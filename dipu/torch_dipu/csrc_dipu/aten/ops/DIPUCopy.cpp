@@ -3,10 +3,26 @@
 #include "DIPUCopy.hpp"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
+#include <ATen/Parallel.h>
 #include <c10/util/Exception.h>
+#include <c10/util/SmallVector.h>
 
 #include "csrc_dipu/aten/DIPUATenFunctions.h"
+#include "csrc_dipu/base/environ.hpp"
+#include "csrc_dipu/metrics/metrics.h"
+#include "csrc_dipu/runtime/core/DIPUScalarReadback.h"
 
 namespace dipu {
 
@@ -31,31 +47,440 @@ DIPUCopyBase* getDipuCopyInstance() {
 
 void setDipuCopyInstance(DIPUCopyBase* op) { dipu_copy_op() = op; }
 
+namespace {
+
+// Bytes each thread copies at least.
+constexpr int64_t kHostCopyGrainSize = int64_t{1} << 20U;
+
+}  // namespace
+
+void parallelMemCopyOnHost(void* dst, const void* src, size_t nbytes) {
+  at::parallel_for(0, static_cast<int64_t>(nbytes), kHostCopyGrainSize,
+                   [&](int64_t begin, int64_t end) {
+                     std::memcpy(static_cast<char*>(dst) + begin,
+                                 static_cast<const char*>(src) + begin,
+                                 end - begin);
+                   });
+}
+
+void parallelPitchedCopyOnHost(const PitchedCopyPlan& plan, void* dst,
+                               const void* src) {
+  auto rows = static_cast<int64_t>(plan.depth * plan.height);
+  auto grain = std::max<int64_t>(
+      1, kHostCopyGrainSize / static_cast<int64_t>(plan.width));
+  at::parallel_for(0, rows, grain, [&](int64_t begin, int64_t end) {
+    pitchedCopyRowsOnHost(plan, dst, src, static_cast<size_t>(begin),
+                          static_cast<size_t>(end));
+  });
+}
+
+void doStagedMemCopyH2D(void* dst, const void* src, size_t nbytes,
+                        const DIPUStream& stream) {
+  constexpr size_t kMegaByte = size_t{1} << 20U;
+  auto chunk = static_cast<size_t>(environ::h2dStagingChunkMB()) * kMegaByte;
+  auto* host = allocator::getCachingHostAllocator();
+  std::array<c10::DataPtr, 2> buffers;
+  std::array<DIPUEvent, 2> sent;
+  for (size_t offset = 0, i = 0; offset < nbytes; offset += chunk, ++i) {
+    auto size = std::min(chunk, nbytes - offset);
+    auto& buffer = buffers[i % 2];
+    if (buffer) {
+      // Still holds the chunk before the previous one.
+      sent[i % 2].synchronize();
+    } else {
+      buffer = host->allocate(std::min(chunk, nbytes));
+    }
+    parallelMemCopyOnHost(buffer.get(), static_cast<const char*>(src) + offset,
+                          size);
+    devproxy::memCopyH2DAsync(stream.rawstream(), size,
+                              static_cast<char*>(dst) + offset, buffer.get());
+    sent[i % 2].record(stream);
+  }
+  // The allocator keeps the buffers until their last chunk has been sent.
+  for (auto& buffer : buffers) {
+    if (buffer) {
+      TORCH_CHECK(allocator::CachingHostAllocator_recordEvent(
+                      buffer.get(), buffer.get_context(), stream),
+                  "CachingHostAllocator_recordEvent fail");
+    }
+  }
+}
+
+namespace {
+
+// Larger pairs are copied on their own, packing them costs more host time than
+// the transfer setup it saves.
+constexpr size_t kBatchCopyMaxBytes = size_t{1} << 20U;
+// Keeps every packed tensor aligned in the staging buffers.
+constexpr size_t kBatchCopyAlignment = 64;
+
+// The pairs of copy_many_ sent in one transfer.
+struct CopyBatch {
+  std::vector<size_t> pairs;
+  std::vector<size_t> offsets;
+  size_t nbytes = 0;
+
+  void add(size_t pair, size_t pair_nbytes) {
+    pairs.push_back(pair);
+    offsets.push_back(nbytes);
+    nbytes += (pair_nbytes + kBatchCopyAlignment - 1) / kBatchCopyAlignment *
+              kBatchCopyAlignment;
+  }
+};
+
+void countBatchedCopies(DIPUCopyType type, size_t tensors) {
+  if (!metrics::enable()) {
+    return;
+  }
+  auto make = [](const char* direction) {
+    return metrics::default_collector()
+        .make_integer_counter("copy_batched_tensor_count",
+                              "tensors copied in a batch by copy_many_")
+        .with({{"direction", direction}});
+  };
+  // Using * to avoid being destructed.
+  static auto* counters = new std::array<metrics::LabeledIntegerCounter, 2>{
+      make("h2d"), make("d2h")};
+  (*counters)[type == DIPUCopyType::H2D ? 0 : 1].add(
+      static_cast<int64_t>(tensors));
+}
+
+// Same as tryRecordOrSyncStreamHD does for the device tensor of a copy.
+void recordDeviceTensor(const at::Tensor& tensor, const DIPUStream& stream) {
+  if (!isTorchAllocator() && getDefaultDIPUStream() != stream) {
+    recordStream(tensor, stream);
+  }
+}
+
+void copyBatchH2D(at::TensorList dsts, at::TensorList srcs,
+                  const CopyBatch& batch, bool non_blocking) {
+  auto stream = getCurrentDIPUStream();
+  DIPUGraph::checkNotRecording(stream, "copy_many_");
+  auto staging = allocator::getCachingHostAllocator()->allocate(batch.nbytes);
+  auto* host = static_cast<char*>(staging.get());
+  for (size_t i = 0; i < batch.pairs.size(); ++i) {
+    const auto& src = srcs[batch.pairs[i]];
+    std::memcpy(host + batch.offsets[i], src.data_ptr(), src.nbytes());
+  }
+
+  const auto& first = dsts[batch.pairs.front()];
+  auto packed = at::empty({static_cast<int64_t>(batch.nbytes)},
+                          first.options().dtype(at::kByte));
+  auto* device = static_cast<char*>(packed.data_ptr());
+  devproxy::memCopyH2DAsync(stream.rawstream(), batch.nbytes, device, host);
+  TORCH_CHECK(allocator::CachingHostAllocator_recordEvent(
+                  host, staging.get_context(), stream),
+              "CachingHostAllocator_recordEvent fail");
+
+  auto index = first.device().index();
+  for (size_t i = 0; i < batch.pairs.size(); ++i) {
+    const auto& dst = dsts[batch.pairs[i]];
+    MemChecker::instance().check(dst);
+    devproxy::memCopyD2DAsync(stream.rawstream(), dst.nbytes(), index,
+                              dst.data_ptr(), index,
+                              device + batch.offsets[i]);
+    if (non_blocking) {
+      recordDeviceTensor(dst, stream);
+    }
+  }
+  if (!non_blocking) {
+    stream.synchronize();
+  }
+  countBatchedCopies(DIPUCopyType::H2D, batch.pairs.size());
+}
+
+void copyBatchD2H(at::TensorList dsts, at::TensorList srcs,
+                  const CopyBatch& batch) {
+  auto stream = getCurrentDIPUStream();
+  DIPUGraph::checkNotRecording(stream, "copy_many_");
+  const auto& first = srcs[batch.pairs.front()];
+  auto packed = at::empty({static_cast<int64_t>(batch.nbytes)},
+                          first.options().dtype(at::kByte));
+  auto* device = static_cast<char*>(packed.data_ptr());
+  auto index = first.device().index();
+  for (size_t i = 0; i < batch.pairs.size(); ++i) {
+    const auto& src = srcs[batch.pairs[i]];
+    MemChecker::instance().check(src);
+    devproxy::memCopyD2DAsync(stream.rawstream(), src.nbytes(), index,
+                              device + batch.offsets[i], index,
+                              src.data_ptr());
+  }
+
+  auto staging = allocator::getCachingHostAllocator()->allocate(batch.nbytes);
+  auto* host = static_cast<char*>(staging.get());
+  devproxy::memCopyD2HAsync(stream.rawstream(), batch.nbytes, host, device);
+  DIPUEvent copied;
+  copied.record(stream);
+  copied.synchronize();
+  for (size_t i = 0; i < batch.pairs.size(); ++i) {
+    const auto& dst = dsts[batch.pairs[i]];
+    std::memcpy(dst.data_ptr(), host + batch.offsets[i], dst.nbytes());
+  }
+  countBatchedCopies(DIPUCopyType::D2H, batch.pairs.size());
+}
+
+using CopyBatches = std::map<c10::DeviceIndex, CopyBatch>;
+
+void flushBatches(at::TensorList dsts, at::TensorList srcs, CopyBatches& h2d,
+                  CopyBatches& d2h, bool non_blocking) {
+  for (auto& [index, batch] : h2d) {
+    const DIPUGuard guard(index);
+    if (batch.pairs.size() == 1) {
+      dsts[batch.pairs.front()].copy_(srcs[batch.pairs.front()], non_blocking);
+    } else {
+      copyBatchH2D(dsts, srcs, batch, non_blocking);
+    }
+  }
+  for (auto& [index, batch] : d2h) {
+    const DIPUGuard guard(index);
+    if (batch.pairs.size() == 1) {
+      dsts[batch.pairs.front()].copy_(srcs[batch.pairs.front()], non_blocking);
+    } else {
+      copyBatchD2H(dsts, srcs, batch);
+    }
+  }
+  h2d.clear();
+  d2h.clear();
+}
+
+}  // namespace
+
+void copy_many_(at::TensorList dsts, at::TensorList srcs, bool non_blocking) {
+  TORCH_CHECK(dsts.size() == srcs.size(), "copy_many_ got ", dsts.size(),
+              " destinations but ", srcs.size(), " sources");
+  dipu::profile::RecordBlockCreator dipu_recorder(__FUNCTION__);
+
+  CopyBatches h2d;
+  CopyBatches d2h;
+  // Storages read and written by the pending batches. A pair touching one of
+  // them flushes the batches first, so the pairs take effect in order.
+  std::unordered_set<const c10::StorageImpl*> reads;
+  std::unordered_set<const c10::StorageImpl*> writes;
+  for (size_t i = 0; i < dsts.size(); ++i) {
+    const auto& dst = dsts[i];
+    const auto& src = srcs[i];
+    TORCH_CHECK(dst.defined(), "dst is undefined");
+    TORCH_CHECK(src.defined(), "src is undefined");
+    if (dst.numel() == 0) {
+      continue;
+    }
+    const auto* dst_storage = dst.storage().unsafeGetStorageImpl();
+    const auto* src_storage = src.storage().unsafeGetStorageImpl();
+    if (writes.count(dst_storage) > 0 || reads.count(dst_storage) > 0 ||
+        writes.count(src_storage) > 0) {
+      flushBatches(dsts, srcs, h2d, d2h, non_blocking);
+      reads.clear();
+      writes.clear();
+    }
+    auto info = CopyParamsInfo(dst, src);
+    bool batched = info.directMemCopy_ && dst.nbytes() <= kBatchCopyMaxBytes;
+    if (batched && info.copyType_ == DIPUCopyType::H2D) {
+      h2d[dst.device().index()].add(i, dst.nbytes());
+    } else if (batched && info.copyType_ == DIPUCopyType::D2H &&
+               (!non_blocking || !isPinnedPtr(dst.storage().data()))) {
+      // A blocking copy, or one into pageable memory, which
+      // tryRecordOrSyncStreamHD synchronizes anyway.
+      d2h[src.device().index()].add(i, dst.nbytes());
+    } else {
+      dst.copy_(src, non_blocking);
+      continue;
+    }
+    reads.insert(src_storage);
+    writes.insert(dst_storage);
+  }
+  flushBatches(dsts, srcs, h2d, d2h, non_blocking);
+}
+
+namespace {
+
+// Copies of more pairs of layouts than this are planned every time instead,
+// e.g. with dynamic shapes.
+constexpr size_t kMaxCachedCopyPlans = 4096;
+
+struct CopyPlanKey {
+  at::ScalarType dst_dtype;
+  at::ScalarType src_dtype;
+  DIPUCopyType type;
+  int strategy;
+  // sizes, then dst strides, then src strides.
+  c10::SmallVector<int64_t, 24> layout;
+
+  bool operator==(const CopyPlanKey& other) const {
+    return dst_dtype == other.dst_dtype && src_dtype == other.src_dtype &&
+           type == other.type && strategy == other.strategy &&
+           layout == other.layout;
+  }
+};
+
+struct CopyPlanKeyHash {
+  size_t operator()(const CopyPlanKey& key) const {
+    size_t hash = (static_cast<size_t>(key.dst_dtype) << 24U) ^
+                  (static_cast<size_t>(key.src_dtype) << 16U) ^
+                  (static_cast<size_t>(key.type) << 8U) ^
+                  static_cast<size_t>(key.strategy);
+    for (auto value : key.layout) {
+      // boost::hash_combine
+      // NOLINTNEXTLINE(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+      hash ^= std::hash<int64_t>()(value) + 0x9e3779b9 + (hash << 6) +
+              (hash >> 2);
+    }
+    return hash;
+  }
+};
+
+struct CopyPlanEntry {
+  CopyPlan plan;
+  uint64_t count = 0;
+};
+
+struct CopyPlanCache {
+  std::mutex mutex;
+  // Entries are never erased, findCopyPlan hands out references to them.
+  std::unordered_map<CopyPlanKey, CopyPlanEntry, CopyPlanKeyHash> plans;
+  uint64_t uncached = 0;
+};
+
+CopyPlanCache& copyPlanCache() {
+  // Using * to avoid being destructed.
+  static auto* cache = new CopyPlanCache();
+  return *cache;
+}
+
+const char* copyTypeName(DIPUCopyType type) {
+  switch (type) {
+    case DIPUCopyType::D2Self:
+      return "d2self";
+    case DIPUCopyType::D2OtherD:
+      return "d2otherd";
+    case DIPUCopyType::D2H:
+      return "d2h";
+    case DIPUCopyType::H2D:
+      return "h2d";
+    default:
+      return "h2h";
+  }
+}
+
+const char* copyStepName(CopyPlan::Step step) {
+  switch (step) {
+    case CopyPlan::Step::MemCopy:
+      return "memcpy";
+    case CopyPlan::Step::PitchedMemCopy:
+      return "pitched_memcpy";
+    case CopyPlan::Step::Cast:
+      return "cast";
+    case CopyPlan::Step::DeviceCopy:
+      return "diopi_copy";
+    default:
+      return "cpu_copy";
+  }
+}
+
+}  // namespace
+
+bool recordCopyPlans(std::optional<bool> update) {
+  static auto value = std::atomic_bool(environ::dumpCopyPlans());
+  if (update) {
+    value.store(update.value(), std::memory_order_release);
+  }
+  return value.load(std::memory_order_acquire);
+}
+
+const CopyPlan& findCopyPlan(const at::Tensor& dst, const at::Tensor& src,
+                             DIPUCopyType copyType, int strategy,
+                             c10::function_ref<CopyPlan()> build,
+                             CopyPlan& uncached) {
+  CopyPlanKey key{dst.scalar_type(), src.scalar_type(), copyType, strategy};
+  key.layout.append(dst.sizes().begin(), dst.sizes().end());
+  key.layout.append(dst.strides().begin(), dst.strides().end());
+  key.layout.append(src.strides().begin(), src.strides().end());
+
+  auto& cache = copyPlanCache();
+  {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto found = cache.plans.find(key);
+    if (found != cache.plans.end()) {
+      ++found->second.count;
+      return found->second.plan;
+    }
+  }
+
+  auto plan = build();
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  if (cache.plans.size() >= kMaxCachedCopyPlans) {
+    ++cache.uncached;
+    uncached = std::move(plan);
+    return uncached;
+  }
+  // Another thread may have built it meanwhile, it is the same plan.
+  auto& entry = cache.plans[std::move(key)];
+  if (entry.count == 0) {
+    entry.plan = std::move(plan);
+  }
+  ++entry.count;
+  return entry.plan;
+}
+
+std::vector<CopyPlanRecord> copyPlanReport() {
+  std::vector<CopyPlanRecord> records;
+  auto& cache = copyPlanCache();
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  records.reserve(cache.plans.size());
+  for (const auto& [key, entry] : cache.plans) {
+    auto ndim = key.layout.size() / 3;
+    auto layout = key.layout.begin();
+    CopyPlanRecord record;
+    record.direction = copyTypeName(key.type);
+    record.dst_dtype = key.dst_dtype;
+    record.src_dtype = key.src_dtype;
+    record.sizes.assign(layout, layout + ndim);
+    record.dst_strides.assign(layout + ndim, layout + 2 * ndim);
+    record.src_strides.assign(layout + 2 * ndim, layout + 3 * ndim);
+    for (auto step : entry.plan.steps) {
+      record.steps.emplace_back(copyStepName(step));
+    }
+    record.intermediates = entry.plan.intermediates;
+    record.count = entry.count;
+    records.push_back(std::move(record));
+  }
+  std::sort(records.begin(), records.end(),
+            [](const auto& a, const auto& b) { return a.count > b.count; });
+  return records;
+}
+
+void dumpCopyPlans(std::ostream& os) {
+  auto records = copyPlanReport();
+  uint64_t uncached = 0;
+  {
+    auto& cache = copyPlanCache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    uncached = cache.uncached;
+  }
+  os << "dipu copy plans: " << records.size() << " cached, " << uncached
+     << " uncached copies\n";
+  for (const auto& record : records) {
+    os << "  " << record.count << " x " << record.direction << ' '
+       << record.src_dtype << " -> " << record.dst_dtype << " sizes "
+       << at::IntArrayRef(record.sizes) << " strides "
+       << at::IntArrayRef(record.src_strides) << " -> "
+       << at::IntArrayRef(record.dst_strides) << ": ";
+    for (size_t i = 0; i < record.steps.size(); ++i) {
+      os << (i == 0 ? "" : " > ") << record.steps[i];
+    }
+    os << " (" << record.intermediates << " intermediates)\n";
+  }
+  os.flush();
+}
+
 }  // namespace dipu
 
 namespace dipu {
 namespace native {
 namespace dipu_aten {
 at::Scalar _local_scalar_dense_dipu(const at::Tensor& self) {
-  at::Scalar r;
-  AT_DISPATCH_ALL_TYPES_AND3(
-      at::kHalf, at::kBool, at::kBFloat16, self.scalar_type(),
-      "_local_scalar_dense_dipu", [&] {
-        scalar_t value;
-        dipu::DIPUStream stream = dipu::getCurrentDIPUStream();
-        MemChecker::instance().check(self);
-#if DIPU_VENDOR_NAME_ASCEND
-        dipu::devproxy::syncStream(stream.rawstream());
-        dipu::devproxy::memCopyD2H(sizeof(scalar_t), &value,
-                                   self.data_ptr<scalar_t>());
-#else
-        dipu::devproxy::memCopyD2HAsync(stream.rawstream(), sizeof(scalar_t),
-                                        &value, self.data_ptr<scalar_t>());
-        dipu::devproxy::syncStream(stream.rawstream());
-#endif
-        r = at::Scalar(value);
-      });
-  return r;
+  MemChecker::instance().check(self);
+  // Waits for the copy of the element only, through a pinned slot.
+  return dipu::readScalar(self);
 }
 }  // namespace dipu_aten
 }  // namespace native
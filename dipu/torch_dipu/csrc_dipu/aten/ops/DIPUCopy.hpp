@@ -1,6 +1,12 @@
 // Copyright (c) 2023, DeepLink.
 #pragma once
 
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <vector>
+
 #include <ATen/ATen.h>
 #include <ATen/MemoryOverlap.h>
 #include <ATen/Tensor.h>
@@ -8,11 +14,16 @@
 #include <c10/core/DeviceGuard.h>
 #include <c10/core/Stream.h>
 #include <c10/util/Exception.h>
+#include <c10/util/FunctionRef.h>
+#include <c10/util/strides.h>
 
 #include "csrc_dipu/aten/DIPUATenFunctions.h"
 #include "csrc_dipu/aten/ops/OpUtils.hpp"
+#include "csrc_dipu/aten/ops/PitchedCopyPlan.hpp"
+#include "csrc_dipu/base/environ.hpp"
 #include "csrc_dipu/profiler/profiler.h"
 #include "csrc_dipu/runtime/core/DIPUEvent.h"
+#include "csrc_dipu/runtime/core/DIPUGraph.h"
 #include "csrc_dipu/runtime/core/DIPUGuard.h"
 #include "csrc_dipu/runtime/core/DIPUStream.h"
 #include "csrc_dipu/runtime/core/allocator/DIPUCachingAllocator.h"
@@ -98,15 +109,34 @@ inline int64_t getMemCopyBytes(const at::Tensor& dst, const at::Tensor& src,
   return std::min(srcBytes, dstBytes);
 }
 
+// Non-blocking H2D copies of at least DIPU_H2D_STAGING_MIN_KB from pageable
+// memory are staged through pinned buffers of DIPU_H2D_STAGING_CHUNK_MB (0
+// disables staging), double-buffered: the CPU fills one buffer while the chunk
+// in the other is in flight. The source is no longer used once
+// doStagedMemCopyH2D returns, so no stream sync is needed to keep it alive.
+// Blocking copies synchronize the stream anyway and are never staged.
+inline bool isStagedH2DCopy(const at::Tensor& src, int64_t nbytes,
+                            bool nonBlocking) {
+  constexpr int64_t kKiloByte = 1024;
+  return nonBlocking && environ::h2dStagingChunkMB() > 0 &&
+         nbytes >= environ::h2dStagingMinKB() * kKiloByte &&
+         !isPinnedPtr(src.storage().data());
+}
+
+void doStagedMemCopyH2D(void* dst, const void* src, size_t nbytes,
+                        const DIPUStream& stream);
+
 inline void doMemCopyH2D(const at::Tensor& dst, const at::Tensor& src,
                          dipu::DIPUStream& stream, int64_t nbytes,
-                         bool isSynchronousCopy) {
+                         bool isSynchronousCopy, bool nonBlocking) {
   void* src_ptr = src.data_ptr();
   void* dst_ptr = dst.data_ptr();
 
   MemChecker::instance().check(dst);
   if (isSynchronousCopy) {
     dipu::devproxy::memCopyH2D(nbytes, dst_ptr, src_ptr);
+  } else if (isStagedH2DCopy(src, nbytes, nonBlocking)) {
+    doStagedMemCopyH2D(dst_ptr, src_ptr, nbytes, stream);
   } else {
     dipu::devproxy::memCopyH2DAsync(stream.rawstream(), nbytes, dst_ptr,
                                     src_ptr);
@@ -128,15 +158,35 @@ inline void doMemCopyD2H(const at::Tensor& dst, const at::Tensor& src,
   }
 }
 
+// Host copies split over the intra-op thread pool once they are large enough
+// to pay for it.
+void parallelMemCopyOnHost(void* dst, const void* src, size_t nbytes);
+
+void parallelPitchedCopyOnHost(const PitchedCopyPlan& plan, void* dst,
+                               const void* src);
+
 inline void doMemCopyH2H(const at::Tensor& dst, const at::Tensor& src,
                          int64_t nbytes) {
-  if (!dst.is_contiguous() || !src.is_contiguous()) {
-    std::cerr << "Tensors must be contiguous for memory copy." << std::endl;
-    return;
-  }
   void* src_ptr = src.data_ptr();
   void* dst_ptr = dst.data_ptr();
-  memcpy(dst_ptr, src_ptr, nbytes);
+  // Same layout, as memCopy callers guarantee: nbytes of raw memory.
+  if (dst.strides().equals(src.strides())) {
+    parallelMemCopyOnHost(dst_ptr, src_ptr, nbytes);
+    return;
+  }
+  TORCH_CHECK(dst.scalar_type() == src.scalar_type() &&
+                  dst.sizes().equals(src.sizes()),
+              "host copy between different dtypes or sizes is not allowed");
+  auto plan =
+      planPitchedCopy(dst.dim(), dst.sizes().data(), dst.strides().data(),
+                      src.strides().data(), dst.element_size());
+  if (plan) {
+    parallelPitchedCopyOnHost(*plan, dst_ptr, src_ptr);
+    return;
+  }
+  // Transposes, channels last conversion and the like: ATen's CPU copy
+  // kernel is vectorized and parallel already.
+  dst.copy_(src);
 }
 
 inline void doMemCopyD2D(const at::Tensor& dst, const at::Tensor& src,
@@ -147,14 +197,43 @@ inline void doMemCopyD2D(const at::Tensor& dst, const at::Tensor& src,
                                   src.device().index(), src.data_ptr());
 }
 
+// Copies between a host and a device tensor laid out as `plan`, with one
+// pitched copy instead of a relay tensor and a second full copy.
+inline void doPitchedMemCopy(const at::Tensor& dst, const at::Tensor& src,
+                             const PitchedCopyPlan& plan,
+                             dipu::DIPUStream& stream, DIPUCopyType copyType) {
+  DIPUGraph::checkNotRecording(stream, "copy_");
+  auto kind = devproxy::MemCPKind::D2H;
+  if (copyType == DIPUCopyType::H2D) {
+    kind = devproxy::MemCPKind::H2D;
+    MemChecker::instance().check(dst);
+  } else {
+    MemChecker::instance().check(src);
+  }
+  if (plan.depth == 1) {
+    devproxy::memCopy2DAsync(stream.rawstream(), kind, dst.data_ptr(),
+                             plan.dst_pitch, src.data_ptr(), plan.src_pitch,
+                             plan.width, plan.height);
+  } else {
+    devproxy::memCopy3DAsync(stream.rawstream(), kind, dst.data_ptr(),
+                             plan.dst_pitch, plan.dst_slice, src.data_ptr(),
+                             plan.src_pitch, plan.src_slice, plan.width,
+                             plan.height, plan.depth);
+  }
+}
+
+// nonBlocking is that of the copy_ this memCopy belongs to, if it is its only
+// one, see isStagedH2DCopy.
 inline void memCopy(const at::Tensor& dst, const at::Tensor& src,
                     dipu::DIPUStream& stream, DIPUCopyType copyType,
-                    bool nonOverlappingAndDense, bool isSynchronousCopy) {
+                    bool nonOverlappingAndDense, bool isSynchronousCopy,
+                    bool nonBlocking = false) {
+  DIPUGraph::checkNotRecording(stream, "copy_");
   int64_t nbytes = getMemCopyBytes(dst, src, nonOverlappingAndDense);
   switch (copyType) {
     case DIPUCopyType::H2D:
       // src is cpu.
-      doMemCopyH2D(dst, src, stream, nbytes, isSynchronousCopy);
+      doMemCopyH2D(dst, src, stream, nbytes, isSynchronousCopy, nonBlocking);
       break;
     case DIPUCopyType::D2H:
       // dst is cpu.
@@ -168,6 +247,74 @@ inline void memCopy(const at::Tensor& dst, const at::Tensor& src,
   }
 }
 
+// planPitchedCopy between a host and a device layout, also nullopt if the
+// vendor has no native pitched copy and the fallback needs too many calls.
+inline std::optional<PitchedCopyPlan> planHostDevicePitchedCopy(
+    at::IntArrayRef sizes, at::IntArrayRef dst_strides,
+    at::IntArrayRef src_strides, size_t itemsize) {
+  auto plan = planPitchedCopy(sizes.size(), sizes.data(), dst_strides.data(),
+                              src_strides.data(), itemsize);
+  // The fallback costs a copy call per row, only worth it for a few.
+  constexpr size_t kMaxFallbackRows = 64;
+  if (plan && !devproxy::isMemCopy2DSupported() &&
+      plan->height * plan->depth > kMaxFallbackRows) {
+    return std::nullopt;
+  }
+  return plan;
+}
+
+// The kernels and transfers DIPUCopyInplace runs to copy a (dst, src) pair,
+// and the temporary tensors it allocates for them. Copies with more than one
+// step are the ones worth looking at in copyPlanReport().
+struct CopyPlan {
+  enum class Step : uint8_t {
+    MemCopy,
+    PitchedMemCopy,
+    Cast,        // diopiCastDtype
+    DeviceCopy,  // diopiCopy, casts and restrides in one kernel
+    CpuCopy,     // ATen's CPU copy, between host relays
+  };
+  std::vector<Step> steps;
+  int intermediates = 0;
+  // If set, H2D/D2H copies relay through a contiguous device tensor filled
+  // (or read back) with this pitched copy, instead of a relay with the strides
+  // of the host tensor, which has to move its holes as well.
+  std::optional<PitchedCopyPlan> relayCopy;
+};
+
+// Whether copies record their plans for copyPlanReport(), initially if
+// DIPU_DUMP_COPY_PLANS is set. Plans do not drive the copies, so they are not
+// built at all otherwise.
+bool recordCopyPlans(std::optional<bool> update = std::nullopt);
+
+// Returns the plan of copying src into dst with the given copy type and
+// strategy (DIPUCopyInplace's template flags), which only depend on dtypes,
+// sizes and strides: it is built by `build` the first time a pair of such
+// tensors is copied and cached. Once the cache is full, plans are built into
+// `uncached` every time. Only called if recordCopyPlans().
+const CopyPlan& findCopyPlan(const at::Tensor& dst, const at::Tensor& src,
+                             DIPUCopyType copyType, int strategy,
+                             c10::function_ref<CopyPlan()> build,
+                             CopyPlan& uncached);
+
+struct CopyPlanRecord {
+  std::string direction;
+  at::ScalarType dst_dtype;
+  at::ScalarType src_dtype;
+  std::vector<int64_t> sizes;
+  std::vector<int64_t> dst_strides;
+  std::vector<int64_t> src_strides;
+  std::vector<std::string> steps;
+  int intermediates = 0;
+  uint64_t count = 0;
+};
+
+// Every cached plan with the number of copies that used it, most used first.
+std::vector<CopyPlanRecord> copyPlanReport();
+
+// Prints copyPlanReport(), done at exit if DIPU_DUMP_COPY_PLANS is set.
+void dumpCopyPlans(std::ostream& os);
+
 class CopyParamsInfo {
  public:
   DIPUCopyType copyType_;
@@ -184,6 +331,10 @@ class CopyParamsInfo {
 
   // composite info, can direct mem copy
   bool directMemCopy_ = false;
+  // else, for h2d/d2h, can one pitched mem copy do it.
+  std::optional<PitchedCopyPlan> pitchedCopy_;
+  // else, for h2d/d2h, see CopyPlan::relayCopy. Set by copyAll.
+  std::optional<PitchedCopyPlan> relayCopy_;
 
   void recomputeTensorsInfo(const at::Tensor& dst, const at::Tensor& src) {
     sameDtype_ = dst.scalar_type() == src.scalar_type();
@@ -195,6 +346,13 @@ class CopyParamsInfo {
         sameDtype_ && sameSize_ && sameStride_ && denseAndNoOverlap_;
     srcDevice_ = src.device().index();
     dstDevice_ = dst.device().index();
+
+    pitchedCopy_.reset();
+    if (!directMemCopy_ && sameDtype_ && sameSize_ &&
+        (copyType_ == DIPUCopyType::H2D || copyType_ == DIPUCopyType::D2H)) {
+      pitchedCopy_ = planHostDevicePitchedCopy(
+          dst.sizes(), dst.strides(), src.strides(), dst.element_size());
+    }
   }
 
   explicit CopyParamsInfo(const at::Tensor& dst, const at::Tensor& src,
@@ -298,8 +456,12 @@ inline void tryRecordOrSyncStreamHD(const CopyParamsInfo& info,
       (info.copyType_ == DIPUCopyType::H2D ? dst : src);
   bool is_pinned = isPinnedPtr(cpu_tensor.storage().data());
   // When copy between cpu tensor(not pinned) and device tensor, do sync stream
-  // to ensure free safety while block_cpu is True.
-  if (!is_pinned && block_cpu) {
+  // to ensure free safety while block_cpu is True. Not needed if the copy was
+  // a direct H2D one staged through pinned memory (see directMemCopy).
+  bool is_staged =
+      info.copyType_ == DIPUCopyType::H2D && info.directMemCopy_ &&
+      isStagedH2DCopy(src, static_cast<int64_t>(dst.nbytes()), non_blocking);
+  if (!is_pinned && block_cpu && !is_staged) {
     cur_stream.synchronize();
     return;
   }
@@ -443,9 +605,9 @@ class DIPUCopyInplace : public DIPUCopyBase {
   // and dtype. both 2 can be view.
   void doDirectMemCopy(at::Tensor& dst, const at::Tensor& src,
                        DIPUStream& curStream, DIPUCopyType copyType,
-                       bool needMemCpSync = true) {
+                       bool needMemCpSync = true, bool nonBlocking = false) {
     memCopy(dst, src, curStream, copyType, /*nonOverlappingAndDense=*/true,
-            /*isSynchronousCopy=*/false);
+            /*isSynchronousCopy=*/false, nonBlocking);
 
     if (needMemCpSync) {
       dipu::devproxy::syncStream(curStream.rawstream());
@@ -501,6 +663,17 @@ class DIPUCopyInplace : public DIPUCopyBase {
       // dst_cpu/otherdevice.
       case DIPUCopyType::D2OtherD:
       case DIPUCopyType::D2H: {
+        if (info.copyType_ == DIPUCopyType::D2H && info.relayCopy_) {
+          // contiguous relay, read back into dst with one pitched copy.
+          auto relayCopy = *info.relayCopy_;
+          auto dstInDevSrc =
+              at::empty(dst.sizes(), dst.options().device(src.device()));
+          doRelayCopyOnDevice(dstInDevSrc, src, non_blocking, info);
+          doPitchedMemCopy(dst, dstInDevSrc, relayCopy, info.curStream_,
+                           DIPUCopyType::D2H);
+          dipu::devproxy::syncStream(info.curStream_.rawstream());
+          break;
+        }
         auto curCopyType = info.copyType_;
         // same stride as dst.
         // TODO(fandaoyi):: check if D2OtherD need change device guard.
@@ -513,6 +686,16 @@ class DIPUCopyInplace : public DIPUCopyBase {
       // create src_device (relay, same stride)
       // direct src_cpu -> src_device, src_device -> dst(device)
       case DIPUCopyType::H2D: {
+        if (info.relayCopy_) {
+          // contiguous relay, filled from src with one pitched copy.
+          auto srcInDstdev =
+              at::empty(src.sizes(), src.options().device(dst.device()));
+          doPitchedMemCopy(srcInDstdev, src, *info.relayCopy_,
+                           info.curStream_, DIPUCopyType::H2D);
+          dipu::devproxy::syncStream(info.curStream_.rawstream());
+          doRelayCopyOnDevice(dst, srcInDstdev, non_blocking, info);
+          break;
+        }
         auto srcInDstdev =
             makeSameStrideTensor(src, info.curStream_, dst.device());
         doDirectMemFill(srcInDstdev, src, info.curStream_, DIPUCopyType::H2D);
@@ -526,6 +709,20 @@ class DIPUCopyInplace : public DIPUCopyBase {
     }
   }
 
+  // the on device part of doDeviceRelayCopy with a contiguous relay, whose
+  // layout may differ from the host tensor's.
+  void doRelayCopyOnDevice(at::Tensor& dst, const at::Tensor& src,
+                           bool non_blocking, CopyParamsInfo& info) {
+    info.updateCopyType(DIPUCopyType::D2Self);
+    info.recomputeTensorsInfo(dst, src);
+    if (info.directMemCopy_) {
+      doDirectMemCopy(dst, src, info.curStream_, info.copyType_,
+                      /*needMemCpSync=*/false);
+    } else {
+      copyNodirectOnDevice(dst, src, non_blocking, info);
+    }
+  }
+
   // NOTICE: doDeviceRelayCopy need create a relay tensor having same stride as
   // the dst/src. it's expensive if the tensor is a view with big hollow, so
   // supply this simple wrap method to help d2h, h2d, d2d copy. cannot used in
@@ -689,11 +886,137 @@ class DIPUCopyInplace : public DIPUCopyBase {
   // This virtual method, which is simply a wrapper of doDirectMemCopy by
   // default, is only used in copyAll. It keeps all original information
   // including non_blocking, and is thus suitable for overriding on different
-  // devices for more control of the direct memory copy process
+  // devices for more control of the direct memory copy process. Overrides
+  // have to pass non_blocking on to stage H2D copies, as
+  // tryRecordOrSyncStreamHD expects.
   virtual void directMemCopy(at::Tensor& dst, const at::Tensor& src,
                              CopyParamsInfo& info, bool non_blocking) {
     doDirectMemCopy(dst, src, info.curStream_, info.copyType_,
-                    /*needMemCpSync=*/false);
+                    /*needMemCpSync=*/false, non_blocking);
+  }
+
+  // Steps of the default copyXX strategy for dst and src, described by info,
+  // see findCopyPlan. Vendors overriding copyNodirectXX may take others.
+  CopyPlan buildCopyPlan(const at::Tensor& dst, const at::Tensor& src,
+                         const CopyParamsInfo& info) {
+    using Step = CopyPlan::Step;
+    CopyPlan plan;
+    if (info.directMemCopy_) {
+      plan.steps = {Step::MemCopy};
+      return plan;
+    }
+    if (info.pitchedCopy_) {
+      plan.steps = {Step::PitchedMemCopy};
+      return plan;
+    }
+    bool dstDense = dst.is_non_overlapping_and_dense();
+    bool srcDense = src.is_non_overlapping_and_dense();
+    switch (info.copyType_) {
+      case DIPUCopyType::D2Self:
+        planCopyOnDevice(plan, info.sameDtype_,
+                         info.sameStride_ && info.denseAndNoOverlap_,
+                         dstDense);
+        break;
+      case DIPUCopyType::H2H:
+        plan.steps = {Step::CpuCopy};
+        break;
+      default: {
+        if (!DiopiCopy) {
+          planCpuRelay(plan, dipu::isDeviceTensor(src),
+                       dipu::isDeviceTensor(dst), dstDense);
+          break;
+        }
+        // see doDeviceRelayCopy, the relay is on the device.
+        ++plan.intermediates;
+        auto contiguous = c10::contiguous_strides(dst.sizes());
+        plan.relayCopy = planRelayCopy(dst, src, info);
+        if (info.copyType_ == DIPUCopyType::H2D) {
+          plan.steps.push_back(plan.relayCopy ? Step::PitchedMemCopy
+                                              : Step::MemCopy);
+          // the relay is contiguous or has the strides of src.
+          bool sameDense =
+              plan.relayCopy
+                  ? dstDense && dst.strides().equals(contiguous)
+                  : info.sameStride_ && info.denseAndNoOverlap_;
+          planCopyOnDevice(plan, info.sameDtype_, sameDense, dstDense);
+        } else if (plan.relayCopy) {
+          planCopyOnDevice(plan, info.sameDtype_,
+                           srcDense && src.strides().equals(contiguous),
+                           /*dstDense=*/true);
+          plan.steps.push_back(Step::PitchedMemCopy);
+        } else {
+          // the relay has the strides of dst, and is prefilled from it if
+          // not dense.
+          if (!dstDense) {
+            plan.steps.push_back(Step::MemCopy);
+          }
+          planCopyOnDevice(plan, info.sameDtype_,
+                           info.sameStride_ && info.denseAndNoOverlap_,
+                           dstDense);
+          plan.steps.push_back(Step::MemCopy);
+        }
+      }
+    }
+    return plan;
+  }
+
+  // CopyPlan::relayCopy, for copies which are neither direct nor pitched.
+  static std::optional<PitchedCopyPlan> planRelayCopy(
+      const at::Tensor& dst, const at::Tensor& src,
+      const CopyParamsInfo& info) {
+    if (!DiopiCopy || (info.copyType_ != DIPUCopyType::H2D &&
+                       info.copyType_ != DIPUCopyType::D2H)) {
+      return std::nullopt;
+    }
+    bool h2d = info.copyType_ == DIPUCopyType::H2D;
+    const auto& host = h2d ? src : dst;
+    if (host.is_non_overlapping_and_dense()) {
+      return std::nullopt;
+    }
+    auto contiguous = c10::contiguous_strides(dst.sizes());
+    return h2d ? planHostDevicePitchedCopy(dst.sizes(), contiguous,
+                                           src.strides(), src.element_size())
+               : planHostDevicePitchedCopy(dst.sizes(), dst.strides(),
+                                           contiguous, dst.element_size());
+  }
+
+  // copyNodirectOnDevice, or a direct copy when the relay allows it.
+  static void planCopyOnDevice(CopyPlan& plan, bool sameDtype,
+                               bool sameDense, bool dstDense) {
+    using Step = CopyPlan::Step;
+    if (DiopiCast && !sameDtype) {
+      // the cast keeps the layout of src.
+      plan.steps.push_back(Step::Cast);
+      ++plan.intermediates;
+      sameDtype = true;
+    }
+    if (sameDtype && sameDense) {
+      plan.steps.push_back(Step::MemCopy);
+    } else if (DiopiCopy) {
+      plan.steps.push_back(Step::DeviceCopy);
+    } else {
+      planCpuRelay(plan, true, true, dstDense);
+    }
+  }
+
+  // see doCpuRelayCopy.
+  static void planCpuRelay(CopyPlan& plan, bool srcOnDevice, bool dstOnDevice,
+                           bool dstDense) {
+    using Step = CopyPlan::Step;
+    if (srcOnDevice) {
+      plan.steps.push_back(Step::MemCopy);
+      ++plan.intermediates;
+    }
+    if (!dstOnDevice) {
+      plan.steps.push_back(Step::CpuCopy);
+      return;
+    }
+    if (!dstDense) {
+      plan.steps.push_back(Step::MemCopy);
+    }
+    plan.steps.push_back(Step::CpuCopy);
+    plan.steps.push_back(Step::MemCopy);
+    ++plan.intermediates;
   }
 
   // overriding this func is possible but not recommended
@@ -704,10 +1027,27 @@ class DIPUCopyInplace : public DIPUCopyBase {
       tmpSrc = src.expand_as(dst);
       info.recomputeTensorsInfo(dst, tmpSrc);
     }
+    if (recordCopyPlans()) {
+      CopyPlan uncached;
+      findCopyPlan(
+          dst, tmpSrc, info.copyType_, int{DiopiCopy} | (int{DiopiCast} << 1),
+          [&] { return buildCopyPlan(dst, tmpSrc, info); }, uncached);
+    }
     if (info.directMemCopy_) {
       directMemCopy(dst, tmpSrc, info, non_blocking);
       return;
     }
+    if (info.pitchedCopy_) {
+      doPitchedMemCopy(dst, tmpSrc, *info.pitchedCopy_, info.curStream_,
+                       info.copyType_);
+      // Some vendors' copyPostProcess expect blocking h2d/d2h copies to be
+      // synchronous already.
+      if (!non_blocking) {
+        info.curStream_.synchronize();
+      }
+      return;
+    }
+    info.relayCopy_ = planRelayCopy(dst, tmpSrc, info);
     switch (info.copyType_) {
       case DIPUCopyType::D2Self:
         copyNodirectOnDevice(dst, tmpSrc, non_blocking, info);
@@ -728,4 +1068,14 @@ DIPUCopyBase* getDipuCopyInstance();
 
 void setDipuCopyInstance(DIPUCopyBase* op);
 
+// Does dsts[i].copy_(srcs[i], non_blocking) for every i. Small dense H2D pairs
+// of one device are packed into one pinned staging buffer, sent with a single
+// transfer and scattered on the device, instead of paying for a copy call and
+// a DMA setup per tensor. D2H pairs are gathered on the device and sent back
+// the same way; as the host scatter has to wait for the transfer, they are only
+// batched when the copy would block anyway. Any other pair goes through copy_.
+// The pairs take effect in order: a pair sharing a storage with a pending
+// batch, other than two sources, sends the batch first.
+void copy_many_(at::TensorList dsts, at::TensorList srcs, bool non_blocking);
+
 }  // namespace dipu
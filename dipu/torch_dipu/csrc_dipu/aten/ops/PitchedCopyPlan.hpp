@@ -0,0 +1,112 @@
+// Copyright (c) 2024, DeepLink.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <vector>
+
+namespace dipu {
+
+// A copy between two strided layouts of the same sizes, seen as `depth` planes
+// of `height` rows of `width` contiguous bytes, which maps directly to
+// memCopy2DAsync / memCopy3DAsync. Pitches and slices are the bytes between
+// the starts of two rows and of two planes.
+struct PitchedCopyPlan {
+  size_t width = 0;
+  size_t height = 1;
+  size_t depth = 1;
+  size_t dst_pitch = 0;
+  size_t src_pitch = 0;
+  size_t dst_slice = 0;
+  size_t src_slice = 0;
+};
+
+// The pitched copy between dst and src layouts (strides in elements of
+// `itemsize` bytes), nullopt if they do not form one, e.g. more than three
+// dimensions are left after merging the contiguous ones, or rows overlap.
+inline std::optional<PitchedCopyPlan> planPitchedCopy(
+    size_t ndim, const int64_t* sizes, const int64_t* dst_strides,
+    const int64_t* src_strides, size_t itemsize) {
+  struct Dim {
+    int64_t size;
+    int64_t dst_stride;
+    int64_t src_stride;
+  };
+  // Innermost first, dimensions of size 1 dropped, and those contiguous in
+  // both layouts merged into the next inner one.
+  std::vector<Dim> dims;
+  for (size_t i = ndim; i > 0; --i) {
+    Dim dim{sizes[i - 1], dst_strides[i - 1], src_strides[i - 1]};
+    if (dim.size == 1) {
+      continue;
+    }
+    if (dim.size == 0 || dim.dst_stride < 0 || dim.src_stride < 0) {
+      return std::nullopt;
+    }
+    if (!dims.empty()) {
+      auto& inner = dims.back();
+      if (dim.dst_stride == inner.dst_stride * inner.size &&
+          dim.src_stride == inner.src_stride * inner.size) {
+        inner.size *= dim.size;
+        continue;
+      }
+    }
+    dims.push_back(dim);
+  }
+
+  PitchedCopyPlan plan;
+  plan.width = itemsize;
+  size_t rows = 0;
+  if (!dims.empty() && dims[0].dst_stride == 1 && dims[0].src_stride == 1) {
+    plan.width *= static_cast<size_t>(dims[0].size);
+    rows = 1;
+  }
+  if (dims.size() - rows > 2) {
+    return std::nullopt;
+  }
+  plan.dst_pitch = plan.src_pitch = plan.width;
+  if (dims.size() > rows) {
+    const auto& dim = dims[rows];
+    plan.height = static_cast<size_t>(dim.size);
+    plan.dst_pitch = static_cast<size_t>(dim.dst_stride) * itemsize;
+    plan.src_pitch = static_cast<size_t>(dim.src_stride) * itemsize;
+  }
+  plan.dst_slice = plan.dst_pitch * plan.height;
+  plan.src_slice = plan.src_pitch * plan.height;
+  if (dims.size() > rows + 1) {
+    const auto& dim = dims[rows + 1];
+    plan.depth = static_cast<size_t>(dim.size);
+    plan.dst_slice = static_cast<size_t>(dim.dst_stride) * itemsize;
+    plan.src_slice = static_cast<size_t>(dim.src_stride) * itemsize;
+  }
+  if (plan.dst_pitch < plan.width || plan.src_pitch < plan.width ||
+      plan.dst_slice < plan.dst_pitch * plan.height ||
+      plan.src_slice < plan.src_pitch * plan.height) {
+    return std::nullopt;
+  }
+  return plan;
+}
+
+// Reference implementation of a pitched copy between host buffers, the
+// semantics memCopy2DAsync / memCopy3DAsync implement on devices. Copies the
+// rows [begin, end) of the depth * height ones.
+inline void pitchedCopyRowsOnHost(const PitchedCopyPlan& plan, void* dst,
+                                  const void* src, size_t begin, size_t end) {
+  for (size_t row = begin; row < end; ++row) {
+    size_t z = row / plan.height;
+    size_t y = row % plan.height;
+    std::memcpy(
+        static_cast<char*>(dst) + z * plan.dst_slice + y * plan.dst_pitch,
+        static_cast<const char*>(src) + z * plan.src_slice + y * plan.src_pitch,
+        plan.width);
+  }
+}
+
+inline void pitchedCopyOnHost(const PitchedCopyPlan& plan, void* dst,
+                              const void* src) {
+  pitchedCopyRowsOnHost(plan, dst, src, 0, plan.depth * plan.height);
+}
+
+}  // namespace dipu
@@ -12,8 +12,13 @@
 #include <string>
 
 #include "csrc_dipu/aten/OpRegister.hpp"
+#include "csrc_dipu/aten/ops/DIPUCopy.hpp"
+#include "csrc_dipu/base/environ.hpp"
+#include "csrc_dipu/runtime/core/DIPUCompletionQueue.h"
 #include "csrc_dipu/runtime/core/DIPUEventPool.h"
 #include "csrc_dipu/runtime/core/DIPUGeneratorImpl.h"
+#include "csrc_dipu/runtime/core/allocator/DIPUAllocatorTrace.h"
+#include "csrc_dipu/runtime/core/allocator/DIPUAsyncResourceReaper.h"
 #include "csrc_dipu/runtime/core/allocator/DIPUCachingAllocatorUtils.h"
 #include "csrc_dipu/runtime/devproxy/deviceproxy.h"
 
@@ -50,8 +55,16 @@ void releaseAllResourcesImpl() {
     return;
   }
   called = true;
+  if (environ::dumpCopyPlans()) {
+    dumpCopyPlans(std::cout);
+  }
   releaseAllGenerator();
+  CompletionQueue::stopAll();
+  AsyncResourceReaper::stopAll();
   releaseAllDeviceMem();
+  if (AllocatorTraceRecorder::enabled()) {
+    AllocatorTraceRecorder::instance().flush();
+  }
   releaseAllEvent();
   devproxy::finalizeVendor();
 }
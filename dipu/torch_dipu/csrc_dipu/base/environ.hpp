@@ -92,6 +92,66 @@ DIPU_ENV_VAR(deviceMemCachingAlgorithm, "DIPU_DEVICE_MEMCACHING_ALGORITHM",
              std::string, kTorchAllocatorName);
 DIPU_ENV_VAR(torchAllocatorConf, "DIPU_TORCH_ALLOCATOR_CONF", std::string, "");
 
+// Whether a per-device background thread reclaims the resources of
+// AsyncResourcePool, and how often (in microseconds) it queries pending events,
+// which bounds how long a completed resource waits to be reclaimed.
+DIPU_ENV_VAR(asyncResourceReaper, "DIPU_ASYNC_POOL_REAPER", bool, false);
+DIPU_ENV_VAR(asyncResourceReaperIntervalUs,
+             "DIPU_ASYNC_POOL_REAPER_INTERVAL_US", int64_t, 100);
+
+// Blocks of the BS allocator not larger than DIPU_BS_SLAB_MAX_SIZE bytes are
+// carved out of slab segments of DIPU_BS_SLAB_SEGMENT_SIZE bytes instead of
+// being allocated one by one. Off by default: every slab segment stays
+// reserved while any of its slots is in use, which only pays off for
+// workloads churning through many small blocks. The sizes are raised to hold
+// at least one slot of the largest slab block, rounded up to 512 bytes.
+DIPU_ENV_VAR(bsSlabMaxSize, "DIPU_BS_SLAB_MAX_SIZE", int64_t, 0);
+DIPU_ENV_VAR(bsSlabSegmentSize, "DIPU_BS_SLAB_SEGMENT_SIZE", int64_t,
+             2 << 20);
+
+// Most idle device events each device's event pool keeps, events returned
+// to a full pool are destroyed.
+DIPU_ENV_VAR(eventPoolCapacity, "DIPU_EVENT_POOL_CAPACITY", int64_t, 1024);
+
+// Size of each of the low and high priority stream pools of a device, at most
+// 32. If DIPU_STICKY_POOL_STREAM is set, a thread asking a pool for streams
+// always gets the same one, threads are spread over the pool round robin.
+DIPU_ENV_VAR(streamsPerPool, "DIPU_STREAMS_PER_POOL", int64_t, 8);
+DIPU_ENV_VAR(stickyPoolStream, "DIPU_STICKY_POOL_STREAM", bool, false);
+
+// Whether devproxy trusts its per-thread cache of the current device. Disable
+// it if a vendor library switches devices behind DIPU's back, every device
+// query and switch then goes to the vendor runtime.
+DIPU_ENV_VAR(deviceCache, "DIPU_DEVICE_CACHE", bool, true);
+
+// Pinned host memory: number of size classes each power of two is divided
+// into (1 rounds up to powers of two), whether free blocks are kept per NUMA
+// node, and the MB of pinned memory each node reserves on first use.
+DIPU_ENV_VAR(hostSizeClassSteps, "DIPU_HOST_SIZE_CLASS_STEPS", int64_t, 4);
+DIPU_ENV_VAR(hostNumaArenas, "DIPU_HOST_NUMA_ARENAS", bool, true);
+DIPU_ENV_VAR(hostPinnedReserveMB, "DIPU_HOST_PINNED_RESERVE_MB", int64_t, 0);
+// Carve pinned host blocks out of one growing segment per NUMA node, needs a
+// vendor implementing hostRegister (only cuda does). Each of the (up to 8)
+// segments reserves address space, not memory, for all of the physical memory
+// of the host.
+DIPU_ENV_VAR(hostExpandableSegments, "DIPU_HOST_EXPANDABLE_SEGMENTS", bool,
+             false);
+
+// Size of the pinned buffers non-blocking copies from pageable host memory to
+// the device are staged through, 0 copies straight from pageable memory and
+// synchronizes the stream instead. Smaller copies than DIPU_H2D_STAGING_MIN_KB
+// are not staged either. Blocking copies never are.
+DIPU_ENV_VAR(h2dStagingChunkMB, "DIPU_H2D_STAGING_CHUNK_MB", int64_t, 4);
+DIPU_ENV_VAR(h2dStagingMinKB, "DIPU_H2D_STAGING_MIN_KB", int64_t, 1024);
+
+// Record how each (dst, src) pair of dtypes and layouts is copied, and how
+// often, and print it at exit. See dumpCopyPlans in DIPUCopy.hpp.
+DIPU_ENV_VAR(dumpCopyPlans, "DIPU_DUMP_COPY_PLANS", bool, false);
+
+// If not empty, allocator events are recorded to this file. See
+// DIPUAllocatorTrace.h.
+DIPU_ENV_VAR(allocatorTraceFile, "DIPU_ALLOCATOR_TRACE_FILE", std::string, "");
+
 #undef DIPU_ENV_VAR
 
 }  // namespace dipu::environ
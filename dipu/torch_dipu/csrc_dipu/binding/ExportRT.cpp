@@ -31,12 +31,18 @@
 #include <pybind11/pytypes.h>
 
 #include "csrc_dipu/aten/DIPUATenFunctions.h"
+#include "csrc_dipu/aten/ops/DIPUCopy.hpp"
 #include "csrc_dipu/base/DIPUGlobals.h"
 #include "csrc_dipu/base/basedef.h"
 #include "csrc_dipu/metrics/metrics.h"
+#include "csrc_dipu/runtime/core/DIPUCompletionQueue.h"
 #include "csrc_dipu/runtime/core/DIPUEvent.h"
 #include "csrc_dipu/runtime/core/DIPUGeneratorImpl.h"
+#include "csrc_dipu/runtime/core/DIPUGraph.h"
+#include "csrc_dipu/runtime/core/DIPUGuard.h"
+#include "csrc_dipu/runtime/core/DIPUScalarReadback.h"
 #include "csrc_dipu/runtime/core/DIPUStream.h"
+#include "csrc_dipu/runtime/core/MemChecker.h"
 #include "csrc_dipu/runtime/core/allocator/DIPUCachingAllocatorUtils.h"
 #include "csrc_dipu/runtime/core/allocator/DIPUCachingDeviceAllocator.h"
 #include "csrc_dipu/runtime/device/basedef.h"
@@ -112,6 +118,7 @@ void exportDevices(py::module& m) {
   m.def("_dipu_current_device",
         []() { return static_cast<int>(devproxy::current_device()); });
   m.def("_dipu_synchronize", devproxy::syncDevice);
+  m.def("_dipu_syncDeviceCache", devproxy::syncDeviceCache);
   m.def("_dipu_getDeviceProperties", getDevicePropertiesFromCache,
         py::arg("device"));
 
@@ -124,6 +131,37 @@ void exportDevices(py::module& m) {
   m.def("_dipu_getDeviceStatus", getDeviceStatus, py::arg("device"));
 }
 
+// Runs a python function on the completion queue thread, with the arguments
+// made by `make_args` under the GIL.
+template <typename MakeArgs>
+auto pythonCallback(py::function fn, MakeArgs make_args) {
+  // The function must also be released with the GIL held, on whatever thread
+  // drops the last reference. It is leaked once python is finalized.
+  auto holder = std::shared_ptr<py::function>(
+      new py::function(std::move(fn)), [](py::function* f) {
+        if (Py_IsInitialized() != 0) {
+          py::gil_scoped_acquire gil;
+          delete f;
+        }
+      });
+  return [holder, make_args](auto&&... args) {
+    if (Py_IsInitialized() == 0) {
+      return;
+    }
+    py::gil_scoped_acquire gil;
+    try {
+      (*holder)(*make_args(args...));
+    } catch (py::error_already_set& e) {
+      e.restore();
+      PyErr_Print();
+    }
+  };
+}
+
+CompletionQueue::Callback pythonCallback(py::function fn) {
+  return pythonCallback(std::move(fn), []() { return py::tuple(); });
+}
+
 void exportStream(py::module& m) {
   // Stream Management. follow the api in torch/csrc/cuda/Stream.cpp
   py::class_<DIPUStream>(m, "_DIPUStreamBase")
@@ -143,7 +181,8 @@ void exportStream(py::module& m) {
                    reinterpret_cast<deviceStream_t>(stream_ptr),
                    devproxy::current_device());
              }
-             return getDIPUStreamFromPool();
+             // Lower numbers are higher priorities.
+             return getDIPUStreamFromPool(-1, priority < 0);
            }),
            py::arg("priority") = 0, py::arg("stream_id") = 0,
            py::arg("device_index") = 0, py::arg("device_type") = 0,
@@ -158,12 +197,14 @@ void exportStream(py::module& m) {
              stream.synchronize();
            })
       .def("__eq__", &DIPUStream::operator==)
-      .def("priority_range",
-           // not support priority now, return a mock value.
-           [](DIPUStream& stream) -> py::tuple {
-             py::tuple range = py::make_tuple(0, 0);
-             return range;
+      .def("add_callback",
+           [](DIPUStream& stream, py::function fn) {
+             addStreamCallback(stream, pythonCallback(std::move(fn)));
            })
+      .def_property_readonly("priority", &DIPUStream::priority)
+      .def_static("priority_range",
+                  // (least, greatest), only two pools are distinguished.
+                  []() -> py::tuple { return py::make_tuple(0, -1); })
       // cpp properties
       .def_property_readonly(
           "stream_id",
@@ -193,6 +234,22 @@ void exportStream(py::module& m) {
 
   m.def("_dipu_getCurrentStream", getCurrentDIPUStream);
   m.def("_dipu_getDefaultStream", getDefaultDIPUStream);
+
+  m.def("_dipu_itemAsync", [](const at::Tensor& self, py::function fn) {
+    TORCH_CHECK(self.numel() == 1, "a Tensor with ", self.numel(),
+                " elements cannot be converted to Scalar");
+    DIPUGuard guard(self.device().index());
+    // Same conversion as Tensor.item().
+    readScalarAsync(self, pythonCallback(std::move(fn), [](const auto& value) {
+                      if (value.isFloatingPoint()) {
+                        return py::make_tuple(value.toDouble());
+                      }
+                      if (value.isBoolean()) {
+                        return py::make_tuple(value.toBool());
+                      }
+                      return py::make_tuple(value.toLong());
+                    }));
+  });
 }
 
 void exportEvent(py::module& m) {
@@ -229,6 +286,27 @@ void exportEvent(py::module& m) {
           "device", [](DIPUEvent& self) { return self.device().value(); });
 }
 
+void exportGraph(py::module& m) {
+  py::class_<DIPUGraph>(m, "_DIPUGraph")
+      .def(py::init<>())
+      .def("capture_begin", &DIPUGraph::captureBegin)
+      .def("capture_end", &DIPUGraph::captureEnd)
+      .def("replay",
+           [](DIPUGraph& self) {
+             py::gil_scoped_release no_gil;
+             self.replay();
+           })
+      .def("reset", &DIPUGraph::reset)
+      .def("num_nodes", &DIPUGraph::numNodes)
+      .def("is_native", &DIPUGraph::isNative)
+      .def("pool", &DIPUGraph::pool);
+
+  m.def("_dipu_isCurrentStreamCapturing", []() -> bool {
+    return DIPUGraph::anyCapturing() &&
+           DIPUGraph::capturing(getCurrentDIPUStream().rawstream()) != nullptr;
+  });
+}
+
 void exportCommunicator(py::module& m) {
   py::class_<ProcessGroupDICL, c10d::Backend,
              c10::intrusive_ptr<ProcessGroupDICL>>(m, "ProcessGroupDICL")
@@ -258,15 +336,121 @@ void exportCommunicator(py::module& m) {
   // py::cpp_function(createProcessGroupDICL));
 }
 
+void registerIterationMemoryReport(py::module& m) {
+  py::class_<IterationMemoryReport>(m, "_DIPUIterationMemoryReport")
+      .def_readonly("iterations", &IterationMemoryReport::iterations)
+      .def_readonly("warmup_iterations",
+                    &IterationMemoryReport::warmup_iterations)
+      .def_readonly("peak_bytes", &IterationMemoryReport::peak_bytes)
+      .def_readonly("transient_peak_bytes",
+                    &IterationMemoryReport::transient_peak_bytes)
+      .def_readonly("arena_bytes", &IterationMemoryReport::arena_bytes)
+      .def_readonly("reserved_bytes", &IterationMemoryReport::reserved_bytes)
+      .def_readonly("device_allocations_after_warmup",
+                    &IterationMemoryReport::device_allocations_after_warmup);
+}
+
+// Same layout as torch.cuda.memory._snapshot(), so that the result can be
+// pickled and loaded by torch's memory visualizer.
+py::dict memorySnapshotToDict(const c10::Device& device) {
+  auto segments = memorySnapshot(device);
+  py::list segments_list;
+  for (const auto& segment : segments) {
+    size_t allocated_size = 0;
+    size_t active_size = 0;
+    size_t requested_size = 0;
+    py::list blocks;
+    for (const auto& block : segment.blocks) {
+      const char* state = "inactive";
+      if (block.state == MemoryBlockInfo::State::kAllocated) {
+        state = "active_allocated";
+        allocated_size += block.size;
+        requested_size += block.requested_size;
+      } else if (block.state == MemoryBlockInfo::State::kPendingFree) {
+        state = "active_pending_free";
+      }
+      if (block.state != MemoryBlockInfo::State::kFree) {
+        active_size += block.size;
+      }
+      py::dict block_dict;
+      block_dict["address"] = block.address;
+      block_dict["size"] = block.size;
+      block_dict["requested_size"] = block.requested_size;
+      block_dict["state"] = state;
+      block_dict["frames"] = py::list();
+      blocks.append(block_dict);
+    }
+    py::dict segment_dict;
+    segment_dict["device"] = segment.device;
+    segment_dict["address"] = segment.address;
+    segment_dict["total_size"] = segment.total_size;
+    segment_dict["allocated_size"] = allocated_size;
+    segment_dict["active_size"] = active_size;
+    segment_dict["requested_size"] = requested_size;
+    segment_dict["stream"] = segment.stream;
+    segment_dict["segment_type"] = segment.is_large ? "large" : "small";
+    segment_dict["segment_pool_id"] = py::make_tuple(0, 0);
+    segment_dict["is_expandable"] = false;
+    segment_dict["frames"] = py::list();
+    segment_dict["blocks"] = blocks;
+    segments_list.append(segment_dict);
+  }
+  py::dict result;
+  result["segments"] = segments_list;
+  result["device_traces"] = py::list();
+  return result;
+}
+
+py::dict memoryPoolStatsToDict(const c10::Device& device,
+                               MemoryPoolId pool) {
+  auto stats = memoryPoolStats(device, pool);
+  py::dict result;
+  result["allocated_bytes"] = stats.allocated_bytes;
+  result["reserved_bytes"] = stats.reserved_bytes;
+  result["max_allocated_bytes"] = stats.max_allocated_bytes;
+  result["max_reserved_bytes"] = stats.max_reserved_bytes;
+  return result;
+}
+
+py::list sampledMemoryStacks() {
+  py::list result;
+  for (const auto& stack : MemChecker::instance().sampled_stacks()) {
+    py::dict stack_dict;
+    stack_dict["frames"] = stack.frames;
+    stack_dict["count"] = stack.count;
+    stack_dict["size"] = stack.bytes;
+    result.append(stack_dict);
+  }
+  return result;
+}
+
 void exportMemCaching(py::module& m) {
+  registerIterationMemoryReport(m);
   m.def("_dipu_emptyCache", emptyCachedMem);
   m.def("init_resource", initResource);
-  m.def("release_all_resources", releaseAllResources);
+  // Pending completion callbacks may need the GIL.
+  m.def("release_all_resources", releaseAllResources,
+        py::call_guard<py::gil_scoped_release>());
   m.def("memory_reserved", memoryReserved);
   m.def("memory_allocated", memoryAllocated);
   m.def("max_memory_reserved", maxMemoryReserved);
   m.def("max_memory_allocated", maxMemoryAllocated);
   m.def("reset_peak_memory_stats", resetPeakStats);
+  m.def("_dipu_markIterationBoundary", markIterationBoundary);
+  m.def("_dipu_iterationMemoryReport", iterationMemoryReport);
+  m.def("_dipu_memorySnapshot", memorySnapshotToDict);
+  m.def("_dipu_sampledMemoryStacks", sampledMemoryStacks);
+  m.def("_dipu_getMemoryPool", getMemoryPool);
+  m.def("_dipu_setCurrentMemoryPool", setCurrentMemoryPool);
+  m.def("_dipu_memoryPoolStats", memoryPoolStatsToDict);
+  m.def("_dipu_releaseMemoryPool", releaseMemoryPool);
+  m.def("_dipu_mallocAsync", [](size_t size, const DIPUStream& stream) {
+    return reinterpret_cast<uint64_t>(mallocAsync(size, stream));
+  });
+  m.def("_dipu_freeAsync", [](uint64_t ptr, const DIPUStream& stream) {
+    // NOLINTNEXTLINE(performance-no-int-to-ptr)
+    freeAsync(reinterpret_cast<void*>(ptr), stream);
+  });
   m.def("_dipu_dipuCachingAllocator_set_allocator_settings",
         dipu::allocator::setAllocatorSettings);
 }
@@ -334,6 +518,27 @@ void exportAutocast(py::module& m) {
 
 void exportUtils(py::module& m) {
   m.def("get_dipu_torch_version", []() -> int { return DIPU_TORCH_VERSION; });
+  m.def("_dipu_copyMany", [](const std::vector<at::Tensor>& dsts,
+                             const std::vector<at::Tensor>& srcs,
+                             bool non_blocking) {
+    py::gil_scoped_release no_gil;
+    copy_many_(dsts, srcs, non_blocking);
+  });
+  m.def("_dipu_recordCopyPlans",
+        [](bool enabled) { recordCopyPlans(enabled); });
+  m.def("_dipu_copyPlans", []() {
+    using namespace py::literals;
+    py::list plans;
+    for (auto& record : copyPlanReport()) {
+      plans.append(py::dict(
+          "direction"_a = record.direction, "dst_dtype"_a = record.dst_dtype,
+          "src_dtype"_a = record.src_dtype, "sizes"_a = record.sizes,
+          "dst_strides"_a = record.dst_strides,
+          "src_strides"_a = record.src_strides, "steps"_a = record.steps,
+          "intermediates"_a = record.intermediates, "count"_a = record.count));
+    }
+    return plans;
+  });
 }
 
 void exportMetrics(py::module& m) {
@@ -371,6 +576,7 @@ DIPU_API void exportDIPURuntime(PyObject* module) {
   exportDevices(m);
   exportStream(m);
   exportEvent(m);
+  exportGraph(m);
   exportCommunicator(m);
   exportMemCaching(m);
   patchStorage(m);
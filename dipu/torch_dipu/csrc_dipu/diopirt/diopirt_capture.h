@@ -0,0 +1,188 @@
+// Copyright (c) 2024, DeepLink.
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <ATen/Tensor.h>
+#include <ATen/core/Generator.h>
+#include <c10/macros/Macros.h>
+#include <c10/util/Exception.h>
+#include <c10/util/Optional.h>
+
+#include <diopi/diopirt.h>
+
+#include "csrc_dipu/runtime/core/DIPUGraph.h"
+
+#include "diopirt_impl.h"
+
+namespace dipu {
+namespace graph {
+
+// Owned copy of an argument of a captured DIOPI call, get() returns the value
+// to pass on replay. Plain values are copied. Pointers are only captured when
+// it is known what they point to, any other argument makes the call
+// uncapturable.
+template <typename T, typename = void>
+struct CapturedArg {
+  static constexpr bool kCapturable =
+      std::is_arithmetic_v<T> || std::is_enum_v<T>;
+  T value;
+  explicit CapturedArg(T v) : value(v) {}
+  T get() { return value; }
+};
+
+// Tensor handles point to an at::Tensor, keep a reference to it.
+template <typename Handle>
+struct CapturedTensor {
+  static constexpr bool kCapturable = true;
+  c10::optional<at::Tensor> tensor;
+  explicit CapturedTensor(Handle handle) {
+    if (handle != nullptr) {
+      tensor = *reinterpret_cast<const at::Tensor*>(handle);
+    }
+  }
+  Handle get() {
+    return tensor ? reinterpret_cast<Handle>(&*tensor) : nullptr;
+  }
+};
+
+template <>
+struct CapturedArg<diopiTensorHandle_t>
+    : CapturedTensor<diopiTensorHandle_t> {
+  using CapturedTensor::CapturedTensor;
+};
+
+template <>
+struct CapturedArg<diopiConstTensorHandle_t>
+    : CapturedTensor<diopiConstTensorHandle_t> {
+  using CapturedTensor::CapturedTensor;
+};
+
+template <>
+struct CapturedArg<diopiGeneratorHandle_t> {
+  static constexpr bool kCapturable = true;
+  c10::optional<at::Generator> generator;
+  explicit CapturedArg(diopiGeneratorHandle_t handle) {
+    if (handle != nullptr) {
+      generator = *reinterpret_cast<at::Generator*>(handle);
+    }
+  }
+  diopiGeneratorHandle_t get() {
+    return generator ? reinterpret_cast<diopiGeneratorHandle_t>(&*generator)
+                     : nullptr;
+  }
+};
+
+template <>
+struct CapturedArg<diopiSize_t> {
+  static constexpr bool kCapturable = true;
+  std::vector<int64_t> data;
+  bool is_null;
+  int64_t len;
+  explicit CapturedArg(diopiSize_t size)
+      : is_null(size.data == nullptr), len(size.len) {
+    if (!is_null) {
+      data.assign(size.data, size.data + size.len);
+    }
+  }
+  diopiSize_t get() {
+    return diopiSize_t{is_null ? nullptr : data.data(), len};
+  }
+};
+
+template <>
+struct CapturedArg<diopiScalar_t> {
+  static constexpr bool kCapturable = true;
+  diopiScalar_t value;
+  explicit CapturedArg(diopiScalar_t v) : value(v) {}
+  diopiScalar_t get() { return value; }
+};
+
+// Optional scalars, e.g. `const diopiScalar_t*` or `const int64_t*`.
+template <typename T>
+struct CapturedArg<const T*,
+                   std::enable_if_t<std::is_arithmetic_v<T> ||
+                                    std::is_same_v<T, diopiScalar_t>>> {
+  static constexpr bool kCapturable = true;
+  c10::optional<T> value;
+  explicit CapturedArg(const T* ptr) {
+    if (ptr != nullptr) {
+      value = *ptr;
+    }
+  }
+  const T* get() { return value ? &*value : nullptr; }
+};
+
+template <>
+struct CapturedArg<const char*> {
+  static constexpr bool kCapturable = true;
+  c10::optional<std::string> value;
+  explicit CapturedArg(const char* str) {
+    if (str != nullptr) {
+      value = str;
+    }
+  }
+  const char* get() { return value ? value->c_str() : nullptr; }
+};
+
+template <typename... Params>
+class CapturedDiopiCall final : public DIPUGraph::Node {
+ public:
+  using Function = diopiError_t (*)(diopiContextHandle_t, Params...);
+
+  CapturedDiopiCall(const char* name, Function fn, Params... args)
+      : name_(name), fn_(fn), args_(CapturedArg<Params>(args)...) {}
+
+  void replay(const DIPUStream& stream) override {
+    ::diopiContext context(stream.rawstream());
+    diopiError_t ret = std::apply(
+        [&](auto&... args) { return fn_(&context, args.get()...); }, args_);
+    TORCH_CHECK(ret == diopiSuccess, name_,
+                " failed when replaying dipu graph, error code is ", ret,
+                " error message is ", diopiGetLastErrorString());
+  }
+
+ private:
+  const char* name_;
+  Function fn_;
+  std::tuple<CapturedArg<Params>...> args_;
+};
+
+template <typename... Params>
+diopiError_t captureDiopi(const char* name,
+                          diopiError_t (*fn)(diopiContextHandle_t, Params...),
+                          diopiContextHandle_t ctx, Params... args) {
+  auto* graph = DIPUGraph::capturing(ctx->stream);
+  // Other streams run as usual, and with native capture the vendor records
+  // whatever is run on the capture stream.
+  if (graph == nullptr || graph->isNative()) {
+    return fn(ctx, args...);
+  }
+  constexpr bool capturable = (CapturedArg<Params>::kCapturable && ...);
+  TORCH_CHECK(capturable, name, " can not be captured into a dipu graph");
+  graph->record(
+      std::make_unique<CapturedDiopiCall<Params...>>(name, fn, args...));
+  return diopiSuccess;
+}
+
+// Called by the generated op wrappers instead of calling the DIOPI function
+// directly, so that a DIPUGraph capturing the stream of ctx records it.
+template <typename... Params, typename... Args>
+diopiError_t callDiopi(const char* name,
+                       diopiError_t (*fn)(diopiContextHandle_t, Params...),
+                       diopiContextHandle_t ctx, Args&&... args) {
+  if (C10_LIKELY(!DIPUGraph::anyCapturing())) {
+    return fn(ctx, std::forward<Args>(args)...);
+  }
+  return captureDiopi<Params...>(
+      name, fn, ctx, static_cast<Params>(std::forward<Args>(args))...);
+}
+
+}  // namespace graph
+}  // namespace dipu
@@ -0,0 +1,248 @@
+// Copyright (c) 2024, DeepLink.
+#include "AddressRangeRegistry.h"
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <c10/util/Exception.h>
+
+namespace dipu {
+
+// Three-level radix tree over the page numbers of a 48-bit address space.
+// Every page holds two counters: ranges which cover the whole page, and ranges
+// which cover only a part of it. Nodes are created on first use and never
+// freed, so readers need no lock.
+class AddressRangeRegistry::PageTable {
+  static constexpr unsigned kPageShift = 12U;
+  static constexpr unsigned kAddressBits = 48U;
+  static constexpr unsigned kLevelBits = 12U;
+  static constexpr size_t kFanout = size_t{1} << kLevelBits;
+  static constexpr uint64_t kLevelMask = kFanout - 1;
+  static constexpr uint64_t kFullOne = 1;
+  static constexpr uint64_t kPartialOne = uint64_t{1} << 32U;
+  static constexpr uint64_t kFullMask = kPartialOne - 1;
+
+  struct Leaf {
+    std::array<std::atomic<uint64_t>, kFanout> pages{};
+  };
+  struct Mid {
+    std::array<std::atomic<Leaf*>, kFanout> leaves{};
+  };
+  std::array<std::atomic<Mid*>, kFanout> root_{};
+
+  // Exact ranges, only looked at for partially covered pages.
+  mutable std::mutex mutex_;
+  std::map<uintptr_t, size_t> ranges_;
+
+  template <typename T>
+  static T* getOrCreate(std::atomic<T*>& slot) {
+    T* node = slot.load(std::memory_order_acquire);
+    if (node != nullptr) {
+      return node;
+    }
+    auto created = std::make_unique<T>();
+    if (slot.compare_exchange_strong(node, created.get(),
+                                     std::memory_order_acq_rel)) {
+      return created.release();
+    }
+    return node;
+  }
+
+  std::atomic<uint64_t>* page(uintptr_t page_number, bool create) {
+    auto& mid_slot = root_[(page_number >> (2 * kLevelBits)) & kLevelMask];
+    Mid* mid = create ? getOrCreate(mid_slot)
+                      : mid_slot.load(std::memory_order_acquire);
+    if (mid == nullptr) {
+      return nullptr;
+    }
+    auto& leaf_slot = mid->leaves[(page_number >> kLevelBits) & kLevelMask];
+    Leaf* leaf = create ? getOrCreate(leaf_slot)
+                        : leaf_slot.load(std::memory_order_acquire);
+    if (leaf == nullptr) {
+      return nullptr;
+    }
+    return &leaf->pages[page_number & kLevelMask];
+  }
+
+  static bool addressable(uintptr_t address) {
+    return (address >> kAddressBits) == 0;
+  }
+
+  void mark(uintptr_t start, size_t size, bool add) {
+    uintptr_t end = start + size;
+    if (size == 0 || !addressable(end - 1)) {
+      return;
+    }
+    for (uintptr_t p = start >> kPageShift; p <= (end - 1) >> kPageShift;
+         ++p) {
+      bool full = (p << kPageShift) >= start &&
+                  ((p + 1) << kPageShift) <= end;
+      uint64_t delta = full ? kFullOne : kPartialOne;
+      auto* counter = page(p, add);
+      if (add) {
+        counter->fetch_add(delta, std::memory_order_release);
+      } else {
+        counter->fetch_sub(delta, std::memory_order_release);
+      }
+    }
+  }
+
+  bool containsSlow(uintptr_t address) const {
+    std::lock_guard<std::mutex> lk(mutex_);
+    auto iter = ranges_.upper_bound(address);
+    if (iter == ranges_.begin()) {
+      return false;
+    }
+    --iter;
+    return address < iter->first + iter->second;
+  }
+
+ public:
+  void insert(uintptr_t start, size_t size) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    ranges_.emplace(start, size);
+    mark(start, size, true);
+  }
+
+  void erase(uintptr_t start, size_t size) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    ranges_.erase(start);
+    mark(start, size, false);
+  }
+
+  bool contains(uintptr_t address) {
+    if (!addressable(address)) {
+      return containsSlow(address);
+    }
+    auto* counter = page(address >> kPageShift, false);
+    if (counter == nullptr) {
+      return false;
+    }
+    uint64_t value = counter->load(std::memory_order_acquire);
+    if ((value & kFullMask) != 0) {
+      return true;
+    }
+    return value != 0 && containsSlow(address);
+  }
+};
+
+AddressRangeRegistry& AddressRangeRegistry::instance() {
+  // Using * to avoid being destructed.
+  static auto* registry = new AddressRangeRegistry();
+  return *registry;
+}
+
+AddressRangeRegistry::Domain AddressRangeRegistry::newDomain(
+    bool track_pages) {
+  {
+    std::lock_guard<std::mutex> lk(free_domains_mutex_);
+    auto& free = free_domains_[track_pages ? 1 : 0];
+    if (!free.empty()) {
+      Domain domain = free.back();
+      free.pop_back();
+      return domain;
+    }
+  }
+  Domain domain = next_domain_++;
+  TORCH_CHECK(domain < kMaxDomains, "too many address range domains");
+  if (track_pages) {
+    page_tables_[domain].store(new PageTable(), std::memory_order_release);
+  }
+  return domain;
+}
+
+bool AddressRangeRegistry::insert(Domain domain, const void* ptr,
+                                  size_t size) {
+  Key key{domain, reinterpret_cast<uintptr_t>(ptr)};
+  {
+    auto& s = stripe(key);
+    std::lock_guard<std::mutex> lk(s.mutex);
+    if (!s.ranges.emplace(key, size).second) {
+      return false;
+    }
+  }
+  ++counts_[domain];
+  if (auto* table = page_tables_[domain].load(std::memory_order_acquire)) {
+    table->insert(key.address, size);
+  }
+  return true;
+}
+
+bool AddressRangeRegistry::erase(Domain domain, const void* ptr,
+                                 size_t* size) {
+  Key key{domain, reinterpret_cast<uintptr_t>(ptr)};
+  size_t erased_size = 0;
+  {
+    auto& s = stripe(key);
+    std::lock_guard<std::mutex> lk(s.mutex);
+    auto iter = s.ranges.find(key);
+    if (iter == s.ranges.end()) {
+      return false;
+    }
+    erased_size = iter->second;
+    s.ranges.erase(iter);
+  }
+  --counts_[domain];
+  if (auto* table = page_tables_[domain].load(std::memory_order_acquire)) {
+    table->erase(key.address, erased_size);
+  }
+  if (size != nullptr) {
+    *size = erased_size;
+  }
+  return true;
+}
+
+bool AddressRangeRegistry::find(Domain domain, const void* ptr,
+                                size_t* size) const {
+  Key key{domain, reinterpret_cast<uintptr_t>(ptr)};
+  auto& s = stripe(key);
+  std::lock_guard<std::mutex> lk(s.mutex);
+  auto iter = s.ranges.find(key);
+  if (iter == s.ranges.end()) {
+    return false;
+  }
+  if (size != nullptr) {
+    *size = iter->second;
+  }
+  return true;
+}
+
+bool AddressRangeRegistry::contains(Domain domain, const void* ptr) const {
+  auto* table = page_tables_[domain].load(std::memory_order_acquire);
+  return table != nullptr && table->contains(reinterpret_cast<uintptr_t>(ptr));
+}
+
+size_t AddressRangeRegistry::count(Domain domain) const {
+  return counts_[domain].load(std::memory_order_relaxed);
+}
+
+void AddressRangeRegistry::forEach(
+    Domain domain, const std::function<void(const void*, size_t)>& fn) const {
+  for (auto& s : stripes_) {
+    std::lock_guard<std::mutex> lk(s.mutex);
+    for (const auto& [key, size] : s.ranges) {
+      if (key.domain == domain) {
+        fn(reinterpret_cast<const void*>(key.address), size);
+      }
+    }
+  }
+}
+
+void AddressRangeRegistry::releaseDomain(Domain domain) {
+  clear(domain);
+  bool track_pages =
+      page_tables_[domain].load(std::memory_order_acquire) != nullptr;
+  std::lock_guard<std::mutex> lk(free_domains_mutex_);
+  free_domains_[track_pages ? 1 : 0].push_back(domain);
+}
+
+void AddressRangeRegistry::clear(Domain domain) {
+  std::vector<const void*> ptrs;
+  forEach(domain, [&ptrs](const void* ptr, size_t) { ptrs.push_back(ptr); });
+  for (const void* ptr : ptrs) {
+    erase(domain, ptr);
+  }
+}
+
+}  // namespace dipu
@@ -0,0 +1,110 @@
+// Copyright (c) 2024, DeepLink.
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <c10/util/flat_hash_map.h>
+
+namespace dipu {
+
+// A concurrent index of address ranges, shared by everything which needs to
+// map a pointer back to the allocation it belongs to: pinned host memory
+// (isPinnedPtr), MemChecker and AllocatorMetrics.
+//
+// Ranges are grouped into domains, each user creates its own. Within a domain
+// ranges are found by their start address. Domains created with `track_pages`
+// also answer contains() for any address inside a range: the pages touched by
+// each range are counted in a radix tree over page numbers, so the query is a
+// few atomic loads and takes no lock unless the page is only partially
+// covered.
+class AddressRangeRegistry {
+ public:
+  using Domain = uint32_t;
+  static constexpr Domain kMaxDomains = 4096;
+
+  static AddressRangeRegistry& instance();
+
+  // Reuses a released domain of the same kind if there is one.
+  Domain newDomain(bool track_pages = false);
+
+  // Clears the domain and makes its id available to newDomain again.
+  void releaseDomain(Domain domain);
+
+  // Returns false if a range starting at ptr is already in the domain.
+  bool insert(Domain domain, const void* ptr, size_t size);
+
+  // Returns false if no range starts at ptr.
+  bool erase(Domain domain, const void* ptr, size_t* size = nullptr);
+
+  bool find(Domain domain, const void* ptr, size_t* size = nullptr) const;
+
+  // Whether ptr lies inside any range of a domain created with track_pages.
+  bool contains(Domain domain, const void* ptr) const;
+
+  // Number of ranges in the domain.
+  size_t count(Domain domain) const;
+
+  // Slow, visits every stripe.
+  void forEach(Domain domain,
+               const std::function<void(const void*, size_t)>& fn) const;
+
+  void clear(Domain domain);
+
+  AddressRangeRegistry(const AddressRangeRegistry&) = delete;
+  AddressRangeRegistry& operator=(const AddressRangeRegistry&) = delete;
+  AddressRangeRegistry(AddressRangeRegistry&&) = delete;
+  AddressRangeRegistry& operator=(AddressRangeRegistry&&) = delete;
+
+ private:
+  AddressRangeRegistry() = default;
+  ~AddressRangeRegistry() = default;
+
+  class PageTable;
+
+  struct Key {
+    Domain domain;
+    uintptr_t address;
+    bool operator==(const Key& other) const {
+      return domain == other.domain && address == other.address;
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      // Allocations are at least 16 bytes aligned, fold the low bits away.
+      constexpr unsigned kShift = 4U;
+      constexpr uint64_t kMultiplier = 0x9E3779B97F4A7C15ULL;
+      return static_cast<size_t>(
+          ((key.address >> kShift) ^ (uint64_t{key.domain} << 48U)) *
+          kMultiplier);
+    }
+  };
+
+  static constexpr size_t kNumStripes = 64;
+  struct Stripe {
+    mutable std::mutex mutex;
+    ska::flat_hash_map<Key, size_t, KeyHash> ranges;
+  };
+
+  Stripe& stripe(const Key& key) const {
+    constexpr unsigned kStripeShift = 58U;
+    return stripes_[KeyHash{}(key) >> kStripeShift];
+  }
+
+  mutable std::array<Stripe, kNumStripes> stripes_;
+  std::array<std::atomic<size_t>, kMaxDomains> counts_{};
+  std::array<std::atomic<PageTable*>, kMaxDomains> page_tables_{};
+  std::atomic<Domain> next_domain_{0};
+  // Released domains, without and with a page table. Page tables are never
+  // freed as readers hold no lock, they are handed over with their domain.
+  std::mutex free_domains_mutex_;
+  std::array<std::vector<Domain>, 2> free_domains_;
+};
+
+}  // namespace dipu
@@ -0,0 +1,149 @@
+// Copyright (c) 2024, DeepLink.
+#include "DIPUCompletionQueue.h"
+
+#include <array>
+#include <exception>
+#include <string>
+#include <utility>
+
+#include <c10/util/Exception.h>
+
+#include "csrc_dipu/runtime/devproxy/deviceproxy.h"
+
+namespace dipu {
+
+namespace {
+
+constexpr int kMaxDevices = 16;
+
+auto& queues() {
+  // Using * to avoid being destructed.
+  static auto* instances =
+      new std::array<std::atomic<CompletionQueue*>, kMaxDevices>{};
+  return *instances;
+}
+
+std::mutex& queuesMutex() {
+  // Using * to avoid being destructed.
+  static auto* mutex = new std::mutex();
+  return *mutex;
+}
+
+}  // namespace
+
+CompletionQueue& CompletionQueue::instance(c10::DeviceIndex device_index) {
+  TORCH_CHECK(device_index >= 0 && device_index < kMaxDevices,
+              "invalid device index for completion queue: ",
+              static_cast<int>(device_index));
+  auto& slot = queues()[device_index];
+  if (auto* queue = slot.load(std::memory_order_acquire)) {
+    return *queue;
+  }
+  std::lock_guard<std::mutex> lk(queuesMutex());
+  if (auto* queue = slot.load(std::memory_order_acquire)) {
+    return *queue;
+  }
+  // Leaked on purpose, it is stopped by stopAll() but callers may still refer
+  // to it during static destruction.
+  auto* queue = new CompletionQueue(device_index);
+  slot.store(queue, std::memory_order_release);
+  return *queue;
+}
+
+void CompletionQueue::stopAll() {
+  std::lock_guard<std::mutex> lk(queuesMutex());
+  for (auto& slot : queues()) {
+    if (auto* queue = slot.load(std::memory_order_acquire)) {
+      queue->stop();
+    }
+  }
+}
+
+CompletionQueue::CompletionQueue(c10::DeviceIndex device_index)
+    : device_index_(device_index),
+      callback_count_(
+          metrics::default_collector()
+              .make_integer_counter("completion_callback_count",
+                                    "callbacks run by the completion queue")
+              .with({{"device", std::to_string(device_index)}})),
+      thread_([this]() { run(); }) {}
+
+void CompletionQueue::add(DIPUEvent event, Callback callback) {
+  Entry entry{std::move(event), std::move(callback)};
+  {
+    std::lock_guard<std::mutex> lk(mutex_);
+    if (running_.load(std::memory_order_acquire)) {
+      pending_.push_back(std::move(entry));
+      ++added_;
+      cv_.notify_one();
+      return;
+    }
+  }
+  complete(entry);
+}
+
+void CompletionQueue::add(const DIPUStream& stream, Callback callback) {
+  TORCH_CHECK(stream.device_index() == device_index_, "Stream device ",
+              static_cast<int>(stream.device_index()),
+              " does not match completion queue device ",
+              static_cast<int>(device_index_), ".");
+  DIPUEvent event;
+  event.record(stream);
+  add(std::move(event), std::move(callback));
+}
+
+void CompletionQueue::flush() {
+  TORCH_CHECK(std::this_thread::get_id() != thread_.get_id(),
+              "CompletionQueue::flush() called from a completion callback");
+  std::unique_lock<std::mutex> lk(mutex_);
+  auto target = added_;
+  done_cv_.wait(lk, [this, target]() { return completed_ >= target; });
+}
+
+void CompletionQueue::complete(Entry& entry) {
+  entry.event.synchronize();
+  try {
+    entry.callback();
+  } catch (const std::exception& e) {
+    TORCH_WARN("completion callback failed: ", e.what());
+  }
+  if (metrics::enable()) {
+    callback_count_.inc();
+  }
+}
+
+void CompletionQueue::run() {
+  devproxy::setDevice(device_index_);
+  std::unique_lock<std::mutex> lk(mutex_);
+  while (true) {
+    cv_.wait(lk, [this]() {
+      return !pending_.empty() || !running_.load(std::memory_order_acquire);
+    });
+    // Stopped, and every callback has run.
+    if (pending_.empty()) {
+      break;
+    }
+    auto entry = std::move(pending_.front());
+    pending_.pop_front();
+    lk.unlock();
+    complete(entry);
+    // Release the event and whatever the callback holds outside the lock.
+    entry = Entry{};
+    lk.lock();
+    ++completed_;
+    done_cv_.notify_all();
+  }
+}
+
+void CompletionQueue::stop() {
+  {
+    std::lock_guard<std::mutex> lk(mutex_);
+    running_.store(false, std::memory_order_release);
+  }
+  cv_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+}  // namespace dipu
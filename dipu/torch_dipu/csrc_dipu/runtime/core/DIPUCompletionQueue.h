@@ -0,0 +1,87 @@
+// Copyright (c) 2024, DeepLink.
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include <c10/core/Device.h>
+
+#include "csrc_dipu/metrics/metrics.h"
+
+#include "DIPUEvent.h"
+#include "DIPUStream.h"
+
+namespace dipu {
+
+// A per-device thread which runs callbacks once device work has completed, so
+// that no other thread has to poll an event or block on the device for it.
+//
+// Callbacks of a device run one at a time on its queue thread, in the order
+// they were added. The thread blocks on the event of the oldest callback and
+// sleeps while there is none. A callback must not block on the queue itself
+// (e.g. call flush()).
+class CompletionQueue {
+ public:
+  using Callback = std::function<void()>;
+
+  static CompletionQueue& instance(c10::DeviceIndex device_index);
+
+  // Runs the remaining callbacks and stops the threads of all devices.
+  // Callbacks added afterwards run on the calling thread.
+  static void stopAll();
+
+  // Runs callback after event has completed. An event which was never
+  // recorded counts as completed.
+  void add(DIPUEvent event, Callback callback);
+
+  // Runs callback after all work currently submitted to stream.
+  void add(const DIPUStream& stream, Callback callback);
+
+  // Blocks until every callback added so far has run.
+  void flush();
+
+  CompletionQueue(const CompletionQueue&) = delete;
+  CompletionQueue& operator=(const CompletionQueue&) = delete;
+  CompletionQueue(CompletionQueue&&) = delete;
+  CompletionQueue& operator=(CompletionQueue&&) = delete;
+
+ private:
+  struct Entry {
+    DIPUEvent event;
+    Callback callback;
+  };
+
+  explicit CompletionQueue(c10::DeviceIndex device_index);
+  ~CompletionQueue() = default;
+
+  void run();
+  void stop();
+  void complete(Entry& entry);
+
+  c10::DeviceIndex device_index_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::condition_variable done_cv_;
+  std::deque<Entry> pending_;
+  uint64_t added_ = 0;
+  uint64_t completed_ = 0;
+  std::atomic<bool> running_{true};
+
+  metrics::LabeledIntegerCounter callback_count_;
+
+  // Declared last so that it starts after everything else is initialized.
+  std::thread thread_;
+};
+
+inline void addStreamCallback(const DIPUStream& stream,
+                              CompletionQueue::Callback callback) {
+  CompletionQueue::instance(stream.device_index())
+      .add(stream, std::move(callback));
+}
+
+}  // namespace dipu
@@ -1,27 +1,117 @@
+// Copyright (c) 2023, DeepLink.
 #include "DIPUEventPool.h"
 
-#include <deque>
-#include <functional>
-#include <iostream>
-#include <mutex>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+
+#include <c10/util/Exception.h>
+
+#include "csrc_dipu/base/environ.hpp"
+#include "csrc_dipu/metrics/metrics.h"
+
+#include "DIPUGuard.h"
 
 namespace dipu {
 
-template <typename T>
+namespace {
+
+constexpr int kMaxDevices = 16;
+constexpr size_t kCacheLineSize = 64;
+
+// A bounded multi-producer multi-consumer queue of idle events (Dmitry
+// Vyukov's algorithm). Each cell carries a sequence number telling whether it
+// is ready to be written or read in the current lap, so no operation takes a
+// lock and there is no ABA problem.
 class EventPool final {
- protected:
-  std::deque<T> event_pool_;
-  unsigned int allocate_num_ = 0;
+  struct Cell {
+    std::atomic<size_t> sequence;
+    deviceEvent_t event;
+  };
+
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  alignas(kCacheLineSize) std::atomic<size_t> enqueue_pos_{0};
+  alignas(kCacheLineSize) std::atomic<size_t> dequeue_pos_{0};
+
+  metrics::LabeledIntegerCounter created_;
+  metrics::LabeledIntegerCounter reused_;
+  metrics::LabeledIntegerCounter destroyed_;
+
+  static size_t roundCapacity(int64_t capacity) {
+    size_t rounded = 1;
+    while (rounded < static_cast<size_t>(std::max<int64_t>(capacity, 1))) {
+      rounded <<= 1U;
+    }
+    return rounded;
+  }
+
+  bool tryPop(deviceEvent_t& event) {
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = cells_[pos & mask_];
+      size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(sequence) -
+                  static_cast<std::ptrdiff_t>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          event = cell.event;
+          cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;  // empty
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool tryPush(deviceEvent_t event) {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = cells_[pos & mask_];
+      size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(sequence) -
+                  static_cast<std::ptrdiff_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          cell.event = event;
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;  // full
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
 
-  std::function<void(T&)> allocator_;
-  std::function<void(T&)> deleter_;
-  using mutex_t = std::recursive_mutex;
-  mutex_t event_mutex_;
+  static metrics::LabeledIntegerCounter makeCounter(
+      c10::DeviceIndex device_index, const char* event) {
+    return metrics::default_collector()
+        .make_integer_counter("event_pool_count",
+                              "device events handed out by the event pool")
+        .with({{"device", std::to_string(device_index)}, {"event", event}});
+  }
 
  public:
-  EventPool(const std::function<void(T&)>& allocator,
-            const std::function<void(T&)>& deleter)
-      : allocator_(allocator), deleter_(deleter) {}
+  EventPool(c10::DeviceIndex device_index, int64_t capacity)
+      : cells_(new Cell[roundCapacity(capacity)]),
+        mask_(roundCapacity(capacity) - 1),
+        created_(makeCounter(device_index, "created")),
+        reused_(makeCounter(device_index, "reused")),
+        destroyed_(makeCounter(device_index, "destroyed")) {
+    for (size_t i = 0; i <= mask_; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
 
   EventPool(const EventPool&) = delete;
   EventPool(EventPool&&) = delete;
@@ -31,72 +121,78 @@ class EventPool final {
   ~EventPool() = default;
 
   void release() {
-    std::lock_guard<mutex_t> _(event_mutex_);
-    for (auto& event : event_pool_) {
-      deleter_(event);
-      allocate_num_--;
+    deviceEvent_t event = nullptr;
+    while (tryPop(event)) {
+      devapis::destroyEvent(event);
     }
-    event_pool_.clear();
   }
 
-  void get(T& event) {
-    bool need_allocator = false;
-    {
-      std::lock_guard<mutex_t> _(event_mutex_);
-      if (event_pool_.empty()) {
-        need_allocator = true;
-      } else {
-        event = event_pool_.back();
-        event_pool_.pop_back();
+  void get(deviceEvent_t& event) {
+    if (tryPop(event)) {
+      if (metrics::enable()) {
+        reused_.inc();
       }
+      return;
     }
-    if (need_allocator) {
-      allocator_(event);
+    devapis::createEvent(&event);
+    if (metrics::enable()) {
+      created_.inc();
     }
   }
 
-  void restore(T& event) {
-    std::lock_guard<mutex_t> _(event_mutex_);
-    event_pool_.emplace_back(event);
+  void restore(deviceEvent_t event) {
+    if (tryPush(event)) {
+      return;
+    }
+    devapis::destroyEvent(event);
+    if (metrics::enable()) {
+      destroyed_.inc();
+    }
   }
 };
 
-EventPool<deviceEvent_t>* getEventPool() {
-  const int index = devproxy::current_device();
-// GlobalEventPool for different cards , construct when really needed
-#define dispatch_event_pool(device_id)                               \
-  if (index == (device_id)) {                                        \
-    static EventPool<deviceEvent_t> gDIPUEventPool(                  \
-        [](deviceEvent_t& event) { devapis::createEvent(&event); },  \
-        [](deviceEvent_t& event) { devapis::destroyEvent(event); }); \
-    return &gDIPUEventPool;                                          \
-  }
+auto& eventPools() {
+  // Using * to avoid being destructed.
+  static auto* pools = new std::array<std::atomic<EventPool*>, kMaxDevices>{};
+  return *pools;
+}
 
-  dispatch_event_pool(0);
-  dispatch_event_pool(1);
-  dispatch_event_pool(2);
-  dispatch_event_pool(3);
-  dispatch_event_pool(4);
-  dispatch_event_pool(5);
-  dispatch_event_pool(6);
-  dispatch_event_pool(7);
-  dispatch_event_pool(8);
-  dispatch_event_pool(9);
-  dispatch_event_pool(10);
-  dispatch_event_pool(11);
-  dispatch_event_pool(12);
-  dispatch_event_pool(13);
-  dispatch_event_pool(14);
-  dispatch_event_pool(15);
-  TORCH_CHECK(false, "support up to 16 cards");
+EventPool& getEventPool(int device_index) {
+  TORCH_CHECK(device_index >= 0 && device_index < kMaxDevices,
+              "support up to ", kMaxDevices, " cards");
+  auto& slot = eventPools()[device_index];
+  if (auto* pool = slot.load(std::memory_order_acquire)) {
+    return *pool;
+  }
+  auto created = std::make_unique<EventPool>(
+      static_cast<c10::DeviceIndex>(device_index),
+      environ::eventPoolCapacity());
+  EventPool* expected = nullptr;
+  if (slot.compare_exchange_strong(expected, created.get(),
+                                   std::memory_order_acq_rel)) {
+    // Leaked on purpose, events may be restored during static destruction.
+    return *created.release();
+  }
+  return *expected;
 }
 
-void getEventFromPool(deviceEvent_t& event) { getEventPool()->get(event); }
+}  // namespace
+
+void getEventFromPool(deviceEvent_t& event) {
+  getEventPool(devproxy::current_device()).get(event);
+}
 
 void restoreEventToPool(deviceEvent_t& event) {
-  getEventPool()->restore(event);
+  getEventPool(devproxy::current_device()).restore(event);
 }
 
-void releaseAllEvent() { getEventPool()->release(); }
+void releaseAllEvent() {
+  for (int i = 0; i < kMaxDevices; ++i) {
+    if (auto* pool = eventPools()[i].load(std::memory_order_acquire)) {
+      DIPUGuard guard(static_cast<c10::DeviceIndex>(i));
+      pool->release();
+    }
+  }
+}
 
 }  // namespace dipu
@@ -6,10 +6,16 @@
 
 namespace dipu {
 
+// Every device event (devproxy::createEvent/destroyEvent, and so DIPUEvent
+// and DIPUGuardImpl) comes from a per-device pool of idle events. Getting and
+// restoring an event is lock-free, the driver is only called when the pool is
+// empty or full (see DIPU_EVENT_POOL_CAPACITY). Both work on the current
+// device.
 void getEventFromPool(deviceEvent_t& event);
 
 void restoreEventToPool(deviceEvent_t& event);
 
+// Destroys the idle events of all devices.
 void releaseAllEvent();
 
 }  // namespace dipu
@@ -0,0 +1,176 @@
+// Copyright (c) 2024, DeepLink.
+#include "DIPUGraph.h"
+
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <c10/util/Exception.h>
+
+#include "DIPUEvent.h"
+#include "DIPUGuard.h"
+
+namespace dipu {
+
+namespace {
+
+struct CaptureRegistry {
+  std::mutex mutex;
+  std::vector<std::pair<deviceStream_t, DIPUGraph*>> graphs;
+};
+
+CaptureRegistry& captureRegistry() {
+  // Using * to avoid being destructed.
+  static auto* registry = new CaptureRegistry();
+  return *registry;
+}
+
+// Private pools of graphs which have been reset. The allocator of a pool lives
+// as long as the process, so the next graphs reuse these pools instead of
+// creating one pool per graph.
+struct GraphPools {
+  std::mutex mutex;
+  std::vector<MemoryPoolId> free;
+  uint64_t created = 0;
+};
+
+GraphPools& graphPools() {
+  // Using * to avoid being destructed.
+  static auto* pools = new GraphPools();
+  return *pools;
+}
+
+MemoryPoolId acquireGraphPool() {
+  auto& pools = graphPools();
+  std::lock_guard<std::mutex> lk(pools.mutex);
+  if (!pools.free.empty()) {
+    auto pool = pools.free.back();
+    pools.free.pop_back();
+    return pool;
+  }
+  return getMemoryPool("dipu_graph_" + std::to_string(pools.created++));
+}
+
+void releaseGraphPool(MemoryPoolId pool) {
+  auto& pools = graphPools();
+  std::lock_guard<std::mutex> lk(pools.mutex);
+  pools.free.push_back(pool);
+}
+
+}  // namespace
+
+DIPUGraph::~DIPUGraph() {
+  if (capturing_) {
+    captureEnd();
+  }
+  reset();
+}
+
+DIPUGraph* DIPUGraph::capturing(deviceStream_t stream) {
+  auto& registry = captureRegistry();
+  std::lock_guard<std::mutex> lk(registry.mutex);
+  for (auto& [captured, graph] : registry.graphs) {
+    if (captured == stream) {
+      return graph;
+    }
+  }
+  return nullptr;
+}
+
+void DIPUGraph::checkNotRecordingSlow(const DIPUStream& stream,
+                                      const char* what) {
+  auto* graph = capturing(stream.rawstream());
+  TORCH_CHECK(graph == nullptr || graph->isNative(), what,
+              " cannot be captured by a dipu graph without native capture "
+              "support, it would not run on replay. Move it out of the "
+              "captured region.");
+}
+
+void DIPUGraph::captureBegin(const DIPUStream& stream) {
+  TORCH_CHECK(!capturing_, "dipu graph is already capturing");
+  reset();
+  pool_ = acquireGraphPool();
+
+  deviceStream_t raw = stream.rawstream();
+  {
+    auto& registry = captureRegistry();
+    std::lock_guard<std::mutex> lk(registry.mutex);
+    for (auto& entry : registry.graphs) {
+      TORCH_CHECK(entry.first != raw, "stream ", stream.id(),
+                  " is already being captured");
+    }
+    registry.graphs.emplace_back(raw, this);
+  }
+  stream_ = stream;
+  native_ = devproxy::beginStreamCapture(raw);
+  previous_pool_ = setCurrentMemoryPool(pool_);
+  capturing_ = true;
+  capturing_count_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void DIPUGraph::captureEnd() {
+  TORCH_CHECK(capturing_, "dipu graph is not capturing");
+  setCurrentMemoryPool(previous_pool_);
+  {
+    auto& registry = captureRegistry();
+    std::lock_guard<std::mutex> lk(registry.mutex);
+    auto& graphs = registry.graphs;
+    graphs.erase(std::remove_if(graphs.begin(), graphs.end(),
+                                [this](auto& entry) {
+                                  return entry.second == this;
+                                }),
+                 graphs.end());
+  }
+  capturing_count_.fetch_sub(1, std::memory_order_relaxed);
+  capturing_ = false;
+  if (native_) {
+    native_graph_ = devproxy::endStreamCapture(stream_.rawstream());
+  }
+  captured_ = true;
+}
+
+void DIPUGraph::replay() {
+  TORCH_CHECK(captured_, "dipu graph must be captured before replay");
+  auto current = getCurrentDIPUStream(stream_.device_index());
+  DIPUEvent ready;
+  ready.record(current);
+  ready.wait(stream_);
+  {
+    DIPUStreamGuard guard(stream_.unwrap());
+    if (native_) {
+      devproxy::launchGraph(native_graph_, stream_.rawstream());
+    } else {
+      for (auto& node : nodes_) {
+        node->replay(stream_);
+      }
+    }
+  }
+  DIPUEvent done;
+  done.record(stream_);
+  done.wait(current);
+}
+
+void DIPUGraph::reset() {
+  TORCH_CHECK(!capturing_, "cannot reset a dipu graph while capturing");
+  nodes_.clear();
+  if (native_graph_ != nullptr) {
+    devproxy::destroyGraph(native_graph_);
+    native_graph_ = nullptr;
+  }
+  if (pool_ != kDefaultMemoryPool) {
+    if (captured_) {
+      releaseMemoryPool(stream_.device(), pool_);
+    }
+    releaseGraphPool(std::exchange(pool_, kDefaultMemoryPool));
+  }
+  captured_ = false;
+  native_ = false;
+}
+
+void DIPUGraph::record(std::unique_ptr<Node> node) {
+  nodes_.push_back(std::move(node));
+}
+
+}  // namespace dipu
@@ -0,0 +1,96 @@
+// Copyright (c) 2024, DeepLink.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include <c10/macros/Macros.h>
+
+#include "csrc_dipu/runtime/core/allocator/DIPUCachingAllocatorUtils.h"
+#include "csrc_dipu/runtime/devproxy/deviceproxy.h"
+
+#include "DIPUStream.h"
+
+namespace dipu {
+
+// Captures the DIOPI calls issued to a stream and replays them without going
+// through Python, the dispatcher or the op wrappers again. Meant for sequences
+// which repeat with the same shapes, e.g. inference or the optimizer step.
+//
+// Between captureBegin() and captureEnd() the DIOPI calls made on the capture
+// stream are recorded instead of being run, their tensors are kept alive by
+// the graph and memory allocated by the capturing thread comes from a private
+// pool of the graph. replay() then runs the recorded calls in order on the
+// capture stream. If the vendor implements native capture (see
+// devapis::beginStreamCapture) the calls are run into the vendor graph, and
+// replay() launches it as a whole.
+//
+// Like CUDA graphs, only device work is captured. Without native capture,
+// copies, CPU fallbacks and item() fail while recording (see
+// checkNotRecording), as they would run once now and be missing on replay.
+class DIPU_API DIPUGraph {
+ public:
+  // A recorded call, replayed on the capture stream.
+  class Node {
+   public:
+    virtual ~Node() = default;
+    virtual void replay(const DIPUStream& stream) = 0;
+  };
+
+  DIPUGraph() = default;
+  ~DIPUGraph();
+
+  void captureBegin(const DIPUStream& stream);
+  void captureEnd();
+  // Runs on the capture stream, ordered after the work already submitted to
+  // the current stream, which in turn waits for the replay.
+  void replay();
+  // Drops the recorded calls and returns the memory of the private pool, which
+  // the next graph captured may reuse.
+  void reset();
+
+  size_t numNodes() const { return nodes_.size(); }
+  bool isNative() const { return native_; }
+  MemoryPoolId pool() const { return pool_; }
+
+  void record(std::unique_ptr<Node> node);
+
+  // Cheap check for the op wrappers, true while any graph is capturing.
+  static bool anyCapturing() {
+    return capturing_count_.load(std::memory_order_relaxed) != 0;
+  }
+
+  // The graph capturing `stream`, nullptr if none.
+  static DIPUGraph* capturing(deviceStream_t stream);
+
+  // Fails if a graph records the DIOPI calls of `stream` rather than capturing
+  // them natively: `what` is no DIOPI call, so it cannot be recorded.
+  static void checkNotRecording(const DIPUStream& stream, const char* what) {
+    if (C10_UNLIKELY(anyCapturing())) {
+      checkNotRecordingSlow(stream, what);
+    }
+  }
+
+  DIPUGraph(const DIPUGraph&) = delete;
+  DIPUGraph& operator=(const DIPUGraph&) = delete;
+  DIPUGraph(DIPUGraph&&) = delete;
+  DIPUGraph& operator=(DIPUGraph&&) = delete;
+
+ private:
+  static inline std::atomic<int> capturing_count_{0};
+
+  static void checkNotRecordingSlow(const DIPUStream& stream, const char* what);
+
+  DIPUStream stream_;
+  std::vector<std::unique_ptr<Node>> nodes_;
+  MemoryPoolId pool_ = kDefaultMemoryPool;
+  MemoryPoolId previous_pool_ = kDefaultMemoryPool;
+  bool capturing_ = false;
+  bool captured_ = false;
+  bool native_ = false;
+  devproxy::deviceGraph_t native_graph_ = nullptr;
+};
+
+}  // namespace dipu
@@ -0,0 +1,159 @@
+// Copyright (c) 2024, DeepLink.
+#include "DIPUScalarReadback.h"
+
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <ATen/Dispatch.h>
+#include <c10/core/Allocator.h>
+#include <c10/util/Exception.h>
+
+#include "csrc_dipu/metrics/metrics.h"
+#include "csrc_dipu/runtime/core/allocator/DIPUCachingHostAllocator.h"
+#include "csrc_dipu/runtime/devproxy/deviceproxy.h"
+
+#include "DIPUCompletionQueue.h"
+#include "DIPUEvent.h"
+#include "DIPUGraph.h"
+#include "DIPUStream.h"
+
+namespace dipu {
+
+namespace {
+
+// A slot holds one element. 64 bytes keeps the slots aligned for vendors which
+// require it of async copies, and on separate cache lines.
+constexpr size_t kSlotSize = 64;
+constexpr size_t kSlotCount = 256;
+
+// Pre-pinned slots elements are copied into. A slot is taken by a read until
+// its value is converted.
+class ReadbackRing {
+ public:
+  ReadbackRing() {
+    void* base = nullptr;
+    devproxy::mallocHost(&base, kSlotSize * kSlotCount);
+    free_.reserve(kSlotCount);
+    for (size_t i = kSlotCount; i > 0; --i) {
+      free_.push_back(static_cast<char*>(base) + (i - 1) * kSlotSize);
+    }
+  }
+
+  // nullptr if every slot is taken.
+  char* acquire() {
+    std::lock_guard<std::mutex> lk(mutex_);
+    if (free_.empty()) {
+      return nullptr;
+    }
+    auto* slot = free_.back();
+    free_.pop_back();
+    return slot;
+  }
+
+  void release(char* slot) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    free_.push_back(slot);
+  }
+
+ private:
+  std::mutex mutex_;
+  std::vector<char*> free_;
+};
+
+ReadbackRing& readbackRing() {
+  // Using * to avoid being destructed.
+  static auto* ring = new ReadbackRing();
+  return *ring;
+}
+
+void countReadback(bool from_ring) {
+  if (!metrics::enable()) {
+    return;
+  }
+  auto make = [](const char* path) {
+    return metrics::default_collector()
+        .make_integer_counter("scalar_readback_count",
+                              "device scalars read back to the host")
+        .with({{"path", path}});
+  };
+  // Using * to avoid being destructed.
+  static auto* counters = new std::array<metrics::LabeledIntegerCounter, 2>{
+      make("ring"), make("fallback")};
+  (*counters)[from_ring ? 0 : 1].inc();
+}
+
+// The copy of one element, issued on construction.
+class PendingRead {
+ public:
+  explicit PendingRead(const at::Tensor& self)
+      : type_(self.scalar_type()), slot_(readbackRing().acquire()) {
+    if (slot_ != nullptr) {
+      countReadback(true);
+    } else {
+      fallback_ = allocator::getCachingHostAllocator()->allocate(kSlotSize);
+      slot_ = static_cast<char*>(fallback_.get());
+      countReadback(false);
+    }
+    auto stream = getCurrentDIPUStream();
+    devproxy::memCopyD2HAsync(stream.rawstream(), self.element_size(), slot_,
+                              self.data_ptr());
+    copied_.record(stream);
+  }
+
+  ~PendingRead() {
+    if (!fallback_) {
+      readbackRing().release(slot_);
+    }
+  }
+
+  DIPUEvent& copied() { return copied_; }
+
+  // Only valid once copied() has completed.
+  at::Scalar value() const {
+    at::Scalar r;
+    AT_DISPATCH_ALL_TYPES_AND3(at::kHalf, at::kBool, at::kBFloat16, type_,
+                               "readScalar", [&] {
+                                 scalar_t value;
+                                 std::memcpy(&value, slot_, sizeof(scalar_t));
+                                 r = at::Scalar(value);
+                               });
+    return r;
+  }
+
+  PendingRead(const PendingRead&) = delete;
+  PendingRead& operator=(const PendingRead&) = delete;
+  PendingRead(PendingRead&&) = delete;
+  PendingRead& operator=(PendingRead&&) = delete;
+
+ private:
+  at::ScalarType type_;
+  char* slot_;
+  c10::DataPtr fallback_;
+  DIPUEvent copied_;
+};
+
+}  // namespace
+
+at::Scalar readScalar(const at::Tensor& self) {
+  DIPUGraph::checkNotRecording(getCurrentDIPUStream(), "item()");
+  PendingRead read(self);
+  read.copied().synchronize();
+  return read.value();
+}
+
+void readScalarAsync(const at::Tensor& self, ScalarCallback callback) {
+  DIPUGraph::checkNotRecording(getCurrentDIPUStream(), "item_async()");
+  auto read = std::make_shared<PendingRead>(self);
+  DIPUEvent copied = std::move(read->copied());
+  CompletionQueue::instance(self.device().index())
+      .add(std::move(copied), [read, callback = std::move(callback)]() {
+        callback(read->value());
+      });
+}
+
+}  // namespace dipu
@@ -0,0 +1,28 @@
+// Copyright (c) 2024, DeepLink.
+#pragma once
+
+#include <functional>
+
+#include <ATen/core/TensorBody.h>
+#include <c10/core/Scalar.h>
+
+#include "csrc_dipu/runtime/device/basedef.h"
+
+namespace dipu {
+
+// Reads the single element of a device tensor back to the host, the path of
+// item() / _local_scalar_dense.
+//
+// The element is copied with memCopyD2HAsync on the current stream into a slot
+// of a ring of pre-pinned memory, and only an event recorded after the copy is
+// waited for, instead of the whole stream followed by a synchronous copy. If
+// every slot is in use, the slot comes from the caching host allocator.
+DIPU_API at::Scalar readScalar(const at::Tensor& self);
+
+using ScalarCallback = std::function<void(const at::Scalar&)>;
+
+// Like readScalar, but returns at once. callback gets the value on the
+// completion queue thread of the device (see CompletionQueue).
+DIPU_API void readScalarAsync(const at::Tensor& self, ScalarCallback callback);
+
+}  // namespace dipu
@@ -1,11 +1,13 @@
 // Copyright (c) 2023, DeepLink.
 #include "DIPUStream.h"
 
+#include <algorithm>
 #include <array>
 #include <atomic>
 #include <cstdint>
 #include <cstring>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <sys/time.h>
 #include <unistd.h>
@@ -13,6 +15,9 @@
 
 #include <c10/util/Exception.h>
 
+#include "csrc_dipu/base/environ.hpp"
+
+#include "DIPUEvent.h"
 #include "DIPUGuard.h"
 
 namespace dipu {
@@ -21,6 +26,7 @@ namespace {
 enum class StreamIdType : uint8_t {
   DEFAULT = 0,
   POOL = 1,
+  HIGH_PRIORITY_POOL = 2,
 };
 
 std::string to_string(StreamIdType s) {
@@ -29,14 +35,32 @@ std::string to_string(StreamIdType s) {
       return "DEFAULT";
     case StreamIdType::POOL:
       return "POOL";
+    case StreamIdType::HIGH_PRIORITY_POOL:
+      return "HIGH_PRIORITY_POOL";
     default:
       return std::to_string(static_cast<uint8_t>(s));
   }
 }
 
 // follow old pytorch cuda, seems new version use an opposite strategy.
-constexpr int kStreamsPerPoolBits = 3;
-constexpr int kStreamsPerPool = 1 << kStreamsPerPoolBits;
+constexpr int kStreamsPerPoolBits = 5;
+constexpr int kMaxStreamsPerPool = 1 << kStreamsPerPoolBits;
+
+// Number of streams in each pool, DIPU_STREAMS_PER_POOL clamped to
+// [1, kMaxStreamsPerPool].
+uint32_t streamsPerPool() {
+  static const auto value = static_cast<uint32_t>(
+      std::clamp<int64_t>(environ::streamsPerPool(), 1, kMaxStreamsPerPool));
+  return value;
+}
+
+// Pool index each thread sticks to, per device and priority. -1 until the
+// thread first asks that pool for a stream.
+auto StickyPoolIndices() -> std::vector<std::array<int, 2>>& {
+  auto static thread_local indices = std::vector<std::array<int, 2>>(
+      devproxy::getDeviceCount(), std::array<int, 2>{-1, -1});
+  return indices;
+}
 
 c10::StreamId makeC10StreamId(StreamIdType sType, size_t id) {
   return (static_cast<uint32_t>(static_cast<c10::StreamId>(sType)
@@ -47,19 +71,40 @@ c10::StreamId makeC10StreamId(StreamIdType sType, size_t id) {
 // manage per-device streams
 struct DIPUStreamDevice {
  private:
+  // Low priority streams are created with the default priority of the
+  // device, high priority ones with the highest.
+  struct StreamPool {
+    std::once_flag flag;
+    std::atomic<uint32_t> next_pos{};
+    std::array<deviceStream_t, kMaxStreamsPerPool> streams{};
+  };
+
   // Default streams
-  std::once_flag pool_flag;
   std::once_flag default_flag;
   devapis::deviceId_t devidx_;
   // seems pytorch 2.0 giveup default stream and enable cuda per_thread stream
   // feature at compile time. it cannot be applied to other device.
   deviceStream_t default_stream{};
-  std::atomic<uint32_t> next_pool_pos{};
-  std::array<deviceStream_t, kStreamsPerPool> pool_streams{};
+  StreamPool low_priority_pool;
+  StreamPool high_priority_pool;
+
+  StreamPool& pool(bool high_priority) {
+    return high_priority ? high_priority_pool : low_priority_pool;
+  }
 
-  inline uint32_t getNextPoolIdx() {
-    auto raw_idx = next_pool_pos++;
-    return raw_idx % kStreamsPerPool;
+  // Round robin, unless DIPU_STICKY_POOL_STREAM is set, in which case each
+  // thread is assigned a stream round robin once and keeps getting it, so
+  // that independent threads do not share a hardware queue.
+  uint32_t getNextPoolIdx(bool high_priority) {
+    auto& next_pos = pool(high_priority).next_pos;
+    if (!environ::stickyPoolStream()) {
+      return next_pos++ % streamsPerPool();
+    }
+    auto& sticky = StickyPoolIndices()[devidx_][high_priority ? 1 : 0];
+    if (sticky < 0) {
+      sticky = static_cast<int>(next_pos++ % streamsPerPool());
+    }
+    return static_cast<uint32_t>(sticky);
   }
 
   static StreamIdType getStreamIdType(c10::StreamId s) {
@@ -72,10 +117,11 @@ struct DIPUStreamDevice {
                                ((1 << kStreamsPerPoolBits) - 1));
   }
 
-  void _doInitPool() {
+  void _doInitPool(bool high_priority) {
     DIPUGuard device_guard{devidx_};
-    for (auto& stream : pool_streams) {
-      devproxy::createStream(&stream);
+    auto& streams = pool(high_priority).streams;
+    for (uint32_t i = 0; i < streamsPerPool(); ++i) {
+      devproxy::createStream(&streams[i], high_priority);
     }
   }
 
@@ -90,9 +136,11 @@ struct DIPUStreamDevice {
   explicit DIPUStreamDevice(devapis::deviceId_t device_id)
       : devidx_(device_id) {}
 
-  DIPUStream getDIPUStreamfromPool() {
-    const auto idx = getNextPoolIdx();
-    return DIPUStream(devidx_, makeC10StreamId(StreamIdType::POOL, idx));
+  DIPUStream getDIPUStreamfromPool(bool high_priority) {
+    const auto idx = getNextPoolIdx(high_priority);
+    auto type =
+        high_priority ? StreamIdType::HIGH_PRIORITY_POOL : StreamIdType::POOL;
+    return DIPUStream(devidx_, makeC10StreamId(type, idx));
   }
 
   DIPUStream getDefaultDIPUStream() const {
@@ -116,14 +164,22 @@ struct DIPUStreamDevice {
             "stream.");
         return default_stream;
       case StreamIdType::POOL:
-        return pool_streams[sidx];
+        return low_priority_pool.streams[sidx];
+      case StreamIdType::HIGH_PRIORITY_POOL:
+        return high_priority_pool.streams[sidx];
       default:
         // TODO(assert): AT_ERROR is deprecated.
         AT_ERROR("Invalid stream", stream_id, " (type=", to_string(st), ")");
     }
   }
-  void initPool() {
-    std::call_once(pool_flag, &DIPUStreamDevice::_doInitPool, this);
+
+  static bool isHighPriority(c10::StreamId stream_id) {
+    return getStreamIdType(stream_id) == StreamIdType::HIGH_PRIORITY_POOL;
+  }
+
+  void initPool(bool high_priority) {
+    std::call_once(pool(high_priority).flag, &DIPUStreamDevice::_doInitPool,
+                   this, high_priority);
   }
   void initDevice() {
     std::call_once(default_flag, &DIPUStreamDevice::_doInitDeivce, this);
@@ -182,12 +238,30 @@ deviceStream_t DIPUStream::rawstream() const {
       stream_.id());
 }
 
-DIPUStream getDIPUStreamFromPool(c10::DeviceIndex device_index) {
+int DIPUStream::priority() const {
+  return DIPUStreamDevice::isHighPriority(id()) ? -1 : 0;
+}
+
+DIPUStream getDIPUStreamFromPool(c10::DeviceIndex device_index,
+                                 bool isHighPriority) {
   device_index = setupDevice(device_index);
   // Initializes the stream pools (once)
   auto& device = *StreamDeviceList()[device_index];
-  device.initPool();
-  return device.getDIPUStreamfromPool();
+  device.initPool(isHighPriority);
+  return device.getDIPUStreamfromPool(isHighPriority);
+}
+
+void waitDefaultDIPUStream(const DIPUStream& stream) {
+  auto& device = *StreamDeviceList()[setupDevice(stream.device_index())];
+  auto defaultStream = device.getDefaultDIPUStream();
+  // An idle default stream has completed all the work submitted to it so far,
+  // so there is nothing to wait for.
+  if (defaultStream == stream || defaultStream.isStreamEmpty()) {
+    return;
+  }
+  DIPUEvent event;
+  event.record(defaultStream);
+  event.wait(stream);
 }
 
 DIPUStream getDefaultDIPUStream(c10::DeviceIndex device_index) {
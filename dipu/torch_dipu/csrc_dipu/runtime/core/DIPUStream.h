@@ -59,10 +59,18 @@ class DIPU_API DIPUStream {
 
   c10::Stream unwrap() const { return stream_; }
 
+  /// -1 for streams of the high priority pool, 0 for the others. Lower
+  /// numbers are higher priorities, as in pytorch.
+  int priority() const;
+
   deviceStream_t rawstream() const;
 };
 
-DIPU_API DIPUStream getDIPUStreamFromPool(c10::DeviceIndex device_index = -1);
+// Streams are taken from a per-device pool of DIPU_STREAMS_PER_POOL streams,
+// high priority ones from a separate pool. See DIPU_STICKY_POOL_STREAM in
+// environ.hpp for how they are handed out.
+DIPU_API DIPUStream getDIPUStreamFromPool(c10::DeviceIndex device_index = -1,
+                                          bool isHighPriority = false);
 
 DIPU_API DIPUStream getDefaultDIPUStream(c10::DeviceIndex device_index = -1);
 
@@ -70,6 +78,10 @@ DIPU_API DIPUStream getCurrentDIPUStream(c10::DeviceIndex device_index = -1);
 
 DIPU_API void setCurrentDIPUStream(DIPUStream stream);
 
+// Makes `stream` wait for the work submitted to the default stream of its
+// device so far. Nothing is recorded if the default stream is idle.
+DIPU_API void waitDefaultDIPUStream(const DIPUStream& stream);
+
 DIPU_API DIPUStream getStreamFromExternal(deviceStream_t ext_stream,
                                           c10::DeviceIndex device_index);
 
@@ -1,11 +1,18 @@
 // Copyright (c) 2023, DeepLink.
 #include "MemChecker.h"
 
+#include <algorithm>
+#include <array>
 #include <cstdlib>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <random>
 #include <sstream>
 #include <string>
 
+#include <execinfo.h>
+
 #include <c10/util/Backtrace.h>
 #include <c10/util/Exception.h>
 
@@ -13,19 +20,77 @@ namespace dipu {
 
 static const int32_t DEFAULT_MAX_BLOCK_NUM = 10000;
 static const int32_t DEFAULT_LOG_INTERVAL = 1000;
+static const int64_t DEFAULT_SAMPLE_BYTES = 2 << 20;
+static const int kMaxSampledFrames = 32;
+
+namespace {
+
+int64_t getenvOrDefault(const char* name, int64_t default_value) {
+  const char* str = std::getenv(name);
+  if (str == nullptr) {
+    return default_value;
+  }
+  return std::stoll(str);
+}
+
+// Per-thread countdown to the next sample, so that the common path of
+// MemChecker::sample() touches no shared state.
+class SampleCountdown {
+ public:
+  // Returns true if the allocation of `size` bytes should be sampled.
+  bool tick(size_t size) {
+    if (interval_ > 0) {
+      if (--allocations_left_ > 0) {
+        return false;
+      }
+      allocations_left_ = interval_;
+      return true;
+    }
+    bytes_left_ -= static_cast<int64_t>(size);
+    if (bytes_left_ > 0) {
+      return false;
+    }
+    bytes_left_ = nextByteDistance();
+    return true;
+  }
+
+ private:
+  // Exponentially distributed distances make every byte equally likely to be
+  // sampled, so allocation patterns with a fixed period are not aliased.
+  int64_t nextByteDistance() {
+    std::exponential_distribution<double> distance(
+        1.0 / static_cast<double>(MemChecker::sample_bytes()));
+    return static_cast<int64_t>(distance(rng_)) + 1;
+  }
+
+  std::minstd_rand rng_{std::random_device{}()};
+  int64_t interval_ = MemChecker::sample_interval();
+  int64_t allocations_left_ = interval_;
+  int64_t bytes_left_ = nextByteDistance();
+};
+
+}  // namespace
+
+MemChecker::MemChecker()
+    : domain_(AddressRangeRegistry::instance().newDomain()) {}
 
 MemChecker::~MemChecker() {
   if (!enable()) {
     return;
   }
 
-  if (!blocks_.empty()) {
+  auto& registry = AddressRangeRegistry::instance();
+  if (registry.count(domain_) != 0) {
     std::cout << "dipu memory checker: there maybe exist memory leak. "
-              << blocks_.size() << " blocks not released." << std::endl;
-    for (const auto& kv : blocks_) {
-      std::cout << "key: " << kv.first << ", ptr: " << kv.second.first
-                << ", trace: " << kv.second.second << std::endl;
-    }
+              << registry.count(domain_) << " blocks not released."
+              << std::endl;
+    std::lock_guard<std::mutex> lck(mtx_);
+    registry.forEach(domain_, [this](const void* ptr, size_t size) {
+      auto iter = backtraces_.find(ptr);
+      std::cout << "key: " << ptr << ", size: " << size << ", trace: "
+                << (iter == backtraces_.end() ? "" : iter->second)
+                << std::endl;
+    });
   }
   std::cout << "dipu memory checker: going to destruction. " << current_state()
             << std::endl;
@@ -71,11 +136,28 @@ int32_t MemChecker::log_interval() {
   return interval;
 }
 
+bool MemChecker::enable_sampling() {
+  static bool enable = (std::getenv("DIPU_MEM_CHECK_SAMPLE") != nullptr);
+  return enable;
+}
+
+int64_t MemChecker::sample_bytes() {
+  static int64_t bytes = std::max<int64_t>(
+      getenvOrDefault("DIPU_MEM_CHECK_SAMPLE_BYTES", DEFAULT_SAMPLE_BYTES), 1);
+  return bytes;
+}
+
+int64_t MemChecker::sample_interval() {
+  static int64_t interval =
+      getenvOrDefault("DIPU_MEM_CHECK_SAMPLE_INTERVAL", 0);
+  return interval;
+}
+
 std::string MemChecker::current_state() const {
   std::stringstream stream;
   stream
       << "current block num = "
-      << blocks_.size()
+      << AddressRangeRegistry::instance().count(domain_)
       // convert B to MB
       // NOLINTNEXTLINE(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
       << ", total_size = " << (total_size_ >> 20) << "MB"
@@ -90,25 +172,24 @@ void MemChecker::insert(const void* ptr, size_t size) {
     return;
   }
 
-  bool may_leak = false;
-  bool print_log = false;
-  std::string state;
-  {
+  if (!AddressRangeRegistry::instance().insert(domain_, ptr, size)) {
+    std::cout << "dipu memory checker: address inserted twice, ptr = " << ptr
+              << std::endl;
+    return;
+  }
+  if (enable_backtrace()) {
     std::lock_guard<std::mutex> lck(mtx_);
-    blocks_[ptr] =
-        std::make_pair(size, enable_backtrace() ? c10::get_backtrace() : "");
-    total_size_ += static_cast<int64_t>(size);
-    ++insert_cnt_;
-
-    if (blocks_.size() > max_block_num()) {
-      may_leak = true;
-    } else if (insert_cnt_ % log_interval() == 0) {
-      print_log = true;
-    }
+    backtraces_[ptr] = c10::get_backtrace();
+  }
+  total_size_ += static_cast<int64_t>(size);
+  int64_t insert_cnt = ++insert_cnt_;
 
-    if (may_leak || print_log) {
-      state = current_state();
-    }
+  bool may_leak = AddressRangeRegistry::instance().count(domain_) >
+                  static_cast<size_t>(max_block_num());
+  bool print_log = !may_leak && insert_cnt % log_interval() == 0;
+  std::string state;
+  if (may_leak || print_log) {
+    state = current_state();
   }
 
   if (may_leak) {
@@ -124,15 +205,13 @@ void MemChecker::erase(const void* ptr) {
     return;
   }
 
-  bool found = true;
-  {
-    std::lock_guard<std::mutex> lck(mtx_);
-    auto iter = blocks_.find(ptr);
-    if (iter == blocks_.end()) {
-      found = false;
-    } else {
-      total_size_ -= static_cast<int64_t>(iter->second.first);
-      blocks_.erase(iter);
+  size_t size = 0;
+  bool found = AddressRangeRegistry::instance().erase(domain_, ptr, &size);
+  if (found) {
+    total_size_ -= static_cast<int64_t>(size);
+    if (enable_backtrace()) {
+      std::lock_guard<std::mutex> lck(mtx_);
+      backtraces_.erase(ptr);
     }
   }
 
@@ -153,11 +232,7 @@ void MemChecker::check(const void* ptr) {
     return;
   }
 
-  bool found = true;
-  {
-    std::lock_guard<std::mutex> lck(mtx_);
-    found = (blocks_.find(ptr) != blocks_.end());
-  }
+  bool found = AddressRangeRegistry::instance().find(domain_, ptr);
 
   if (!found) {
     std::cout
@@ -166,4 +241,81 @@ void MemChecker::check(const void* ptr) {
   }
 }
 
+size_t MemChecker::StackHash::operator()(
+    const std::vector<void*>& frames) const {
+  size_t hash = frames.size();
+  for (void* frame : frames) {
+    // boost::hash_combine
+    // NOLINTNEXTLINE(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    hash ^= std::hash<void*>()(frame) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+  }
+  return hash;
+}
+
+bool MemChecker::sample(const void* ptr, size_t size) {
+  if (!enable_sampling() || ptr == nullptr) {
+    return false;
+  }
+  thread_local SampleCountdown countdown;
+  if (!countdown.tick(size)) {
+    return false;
+  }
+
+  std::array<void*, kMaxSampledFrames> frames{};
+  int depth = ::backtrace(frames.data(), kMaxSampledFrames);
+  // Skip the frame of sample() itself.
+  std::vector<void*> stack(frames.begin() + std::min(depth, 1),
+                           frames.begin() + depth);
+
+  std::lock_guard<std::mutex> lck(sample_mtx_);
+  auto next_id = static_cast<uint32_t>(stacks_.size());
+  auto [iter, inserted] = stack_ids_.emplace(std::move(stack), next_id);
+  if (inserted) {
+    stacks_.push_back(iter->first);
+  }
+  sampled_[ptr] = {size, iter->second};
+  return true;
+}
+
+void MemChecker::unsample(const void* ptr) {
+  std::lock_guard<std::mutex> lck(sample_mtx_);
+  sampled_.erase(ptr);
+}
+
+std::vector<MemChecker::SampledStack> MemChecker::sampled_stacks() const {
+  std::vector<std::vector<void*>> stacks;
+  std::unordered_map<uint32_t, SampledStack> grouped;
+  {
+    std::lock_guard<std::mutex> lck(sample_mtx_);
+    for (const auto& [ptr, allocation] : sampled_) {
+      auto& group = grouped[allocation.stack_id];
+      ++group.count;
+      group.bytes += allocation.size;
+    }
+    for (const auto& [stack_id, group] : grouped) {
+      stacks.push_back(stacks_[stack_id]);
+    }
+  }
+
+  // Symbolize outside of the lock, only the reported stacks.
+  std::vector<SampledStack> result;
+  result.reserve(grouped.size());
+  auto stack = stacks.begin();
+  for (auto& [stack_id, group] : grouped) {
+    int depth = static_cast<int>(stack->size());
+    std::unique_ptr<char*, decltype(&std::free)> symbols(
+        ::backtrace_symbols(stack->data(), depth), &std::free);
+    for (int i = 0; i < depth; ++i) {
+      group.frames.emplace_back(symbols ? symbols.get()[i] : "");
+    }
+    result.push_back(std::move(group));
+    ++stack;
+  }
+  std::sort(result.begin(), result.end(),
+            [](const SampledStack& a, const SampledStack& b) {
+              return a.bytes > b.bytes;
+            });
+  return result;
+}
+
 }  // namespace dipu
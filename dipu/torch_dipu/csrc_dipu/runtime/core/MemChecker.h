@@ -1,14 +1,17 @@
 // Copyright (c) 2023, DeepLink.
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <mutex>
 #include <string>
 #include <unordered_map>
-#include <utility>
+#include <vector>
 
 #include <ATen/Tensor.h>
 
+#include "csrc_dipu/runtime/core/AddressRangeRegistry.h"
+
 namespace dipu {
 
 class MemChecker final {
@@ -25,13 +28,51 @@ class MemChecker final {
   void check(const void* ptr);
   ~MemChecker();
 
+  // Sampling leak detection, cheap enough to stay on in production. It is
+  // enabled by DIPU_MEM_CHECK_SAMPLE and independent of DIPU_MEM_CHECK. On
+  // average one allocation per DIPU_MEM_CHECK_SAMPLE_BYTES bytes (default
+  // 2MB) is sampled, or one in DIPU_MEM_CHECK_SAMPLE_INTERVAL allocations if
+  // that is set. Only the raw stack of a sampled allocation is recorded, and
+  // identical stacks share one interned id.
+  static bool enable_sampling();
+  static int64_t sample_bytes();
+  static int64_t sample_interval();
+
+  // Returns true if the allocation is sampled, in which case unsample() must
+  // be called when it is freed.
+  bool sample(const void* ptr, size_t size);
+  void unsample(const void* ptr);
+
+  struct SampledStack {
+    std::vector<std::string> frames;
+    size_t count = 0;
+    size_t bytes = 0;
+  };
+  // Live sampled allocations grouped by stack, largest first.
+  std::vector<SampledStack> sampled_stacks() const;
+
  private:
+  MemChecker();
   std::string current_state() const;
 
+  AddressRangeRegistry::Domain domain_;
+  // Only used when backtrace is enabled.
   std::mutex mtx_;
-  std::unordered_map<const void*, std::pair<size_t, std::string>> blocks_;
-  int64_t total_size_ = 0;
-  int64_t insert_cnt_ = 0;
+  std::unordered_map<const void*, std::string> backtraces_;
+  std::atomic<int64_t> total_size_{0};
+  std::atomic<int64_t> insert_cnt_{0};
+
+  struct StackHash {
+    size_t operator()(const std::vector<void*>& frames) const;
+  };
+  struct SampledAllocation {
+    size_t size;
+    uint32_t stack_id;
+  };
+  mutable std::mutex sample_mtx_;
+  std::unordered_map<std::vector<void*>, uint32_t, StackHash> stack_ids_;
+  std::vector<std::vector<void*>> stacks_;
+  std::unordered_map<const void*, SampledAllocation> sampled_;
 };
 
 }  // namespace dipu
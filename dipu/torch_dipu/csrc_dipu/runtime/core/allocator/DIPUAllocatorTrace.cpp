@@ -0,0 +1,118 @@
+// Copyright (c) 2024, DeepLink.
+
+#include "DIPUAllocatorTrace.h"
+
+#include <c10/util/Exception.h>
+
+#include "csrc_dipu/base/environ.hpp"
+
+namespace dipu {
+
+namespace {
+
+constexpr size_t kBufferedEvents = 4096;
+
+}  // namespace
+
+bool AllocatorTraceRecorder::enabled() {
+  static const bool value = !environ::allocatorTraceFile().empty();
+  return value;
+}
+
+AllocatorTraceRecorder& AllocatorTraceRecorder::instance() {
+  // Using * to avoid being destructed.
+  static auto* recorder =
+      new AllocatorTraceRecorder(environ::allocatorTraceFile());
+  return *recorder;
+}
+
+AllocatorTraceRecorder::AllocatorTraceRecorder(const std::string& path)
+    : file_(std::fopen(path.c_str(), "wb")),
+      start_(std::chrono::steady_clock::now()) {
+  TORCH_CHECK(file_ != nullptr, "failed to open allocator trace file ", path);
+  std::fwrite(kAllocatorTraceMagic.data(), 1, kAllocatorTraceMagic.size(),
+              file_);
+  buffer_.reserve(kBufferedEvents);
+}
+
+void AllocatorTraceRecorder::onAllocate(const void* ptr, size_t size,
+                                        c10::DeviceIndex device,
+                                        c10::StreamId stream) {
+  std::lock_guard<std::mutex> lk(mutex_);
+  uint32_t id = next_ptr_id_++;
+  ptr_ids_[{device, ptr}] = id;
+  append(AllocatorTraceEventType::kAllocate, id, size, device, stream);
+}
+
+void AllocatorTraceRecorder::onFree(const void* ptr, c10::DeviceIndex device) {
+  std::lock_guard<std::mutex> lk(mutex_);
+  auto iter = ptr_ids_.find({device, ptr});
+  // Allocated before the recorder started.
+  if (iter == ptr_ids_.end()) {
+    return;
+  }
+  append(AllocatorTraceEventType::kFree, iter->second, 0, device, -1);
+  ptr_ids_.erase(iter);
+}
+
+void AllocatorTraceRecorder::onRecordStream(const void* ptr,
+                                            c10::DeviceIndex device,
+                                            c10::StreamId stream) {
+  std::lock_guard<std::mutex> lk(mutex_);
+  auto iter = ptr_ids_.find({device, ptr});
+  if (iter == ptr_ids_.end()) {
+    return;
+  }
+  append(AllocatorTraceEventType::kRecordStream, iter->second, 0, device,
+         stream);
+}
+
+void AllocatorTraceRecorder::flush() {
+  std::lock_guard<std::mutex> lk(mutex_);
+  flushWithoutLock();
+  std::fflush(file_);
+}
+
+void AllocatorTraceRecorder::append(AllocatorTraceEventType type,
+                                    uint32_t ptr_id, size_t size,
+                                    c10::DeviceIndex device,
+                                    c10::StreamId stream) {
+  auto elapsed = std::chrono::steady_clock::now() - start_;
+  buffer_.push_back(
+      {static_cast<uint64_t>(
+           std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+               .count()),
+       size, stream, ptr_id, static_cast<int8_t>(device), type, 0});
+  if (buffer_.size() >= kBufferedEvents) {
+    flushWithoutLock();
+  }
+}
+
+void AllocatorTraceRecorder::flushWithoutLock() {
+  if (!buffer_.empty()) {
+    std::fwrite(buffer_.data(), sizeof(AllocatorTraceEvent), buffer_.size(),
+                file_);
+    buffer_.clear();
+  }
+}
+
+std::vector<AllocatorTraceEvent> readAllocatorTrace(const std::string& path) {
+  std::FILE* file = std::fopen(path.c_str(), "rb");
+  TORCH_CHECK(file != nullptr, "failed to open allocator trace file ", path);
+  std::array<char, kAllocatorTraceMagic.size()> magic{};
+  bool valid = std::fread(magic.data(), 1, magic.size(), file) ==
+                   magic.size() &&
+               magic == kAllocatorTraceMagic;
+  std::vector<AllocatorTraceEvent> events;
+  if (valid) {
+    AllocatorTraceEvent event{};
+    while (std::fread(&event, sizeof(event), 1, file) == 1) {
+      events.push_back(event);
+    }
+  }
+  std::fclose(file);
+  TORCH_CHECK(valid, path, " is not an allocator trace file");
+  return events;
+}
+
+}  // namespace dipu
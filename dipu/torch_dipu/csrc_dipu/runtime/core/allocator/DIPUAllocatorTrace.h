@@ -0,0 +1,101 @@
+// Copyright (c) 2024, DeepLink.
+//
+// Allocation trace recorder. When DIPU_ALLOCATOR_TRACE_FILE is set, every
+// allocate, free and record_stream seen by the caching allocators is appended
+// to that file in a compact binary format, which can be replayed offline
+// against every allocator algorithm (see tests/cpp/test_allocator_replay.cpp).
+//
+// File layout: kAllocatorTraceMagic followed by AllocatorTraceEvent records.
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <c10/core/Device.h>
+#include <c10/core/Stream.h>
+#include <c10/util/flat_hash_map.h>
+
+namespace dipu {
+
+enum class AllocatorTraceEventType : uint8_t {
+  kAllocate = 0,
+  kFree = 1,
+  kRecordStream = 2,
+};
+
+struct AllocatorTraceEvent {
+  // Nanoseconds since the recorder started.
+  uint64_t timestamp_ns;
+  // Requested bytes of kAllocate, 0 otherwise.
+  uint64_t size;
+  c10::StreamId stream;
+  // Pointers are replaced by dense ids, valid from kAllocate until kFree.
+  uint32_t ptr_id;
+  // -1 for host memory.
+  int8_t device;
+  AllocatorTraceEventType type;
+  uint16_t reserved;
+};
+static_assert(sizeof(AllocatorTraceEvent) == 32,
+              "AllocatorTraceEvent is part of the trace file format");
+
+constexpr std::array<char, 8> kAllocatorTraceMagic = {'D', 'I', 'P', 'U',
+                                                      'T', 'R', 'C', '1'};
+
+class AllocatorTraceRecorder {
+ public:
+  static bool enabled();
+
+  static AllocatorTraceRecorder& instance();
+
+  void onAllocate(const void* ptr, size_t size, c10::DeviceIndex device,
+                  c10::StreamId stream);
+
+  void onFree(const void* ptr, c10::DeviceIndex device);
+
+  void onRecordStream(const void* ptr, c10::DeviceIndex device,
+                      c10::StreamId stream);
+
+  // Writes buffered events to the file.
+  void flush();
+
+  AllocatorTraceRecorder(const AllocatorTraceRecorder&) = delete;
+  AllocatorTraceRecorder& operator=(const AllocatorTraceRecorder&) = delete;
+  AllocatorTraceRecorder(AllocatorTraceRecorder&&) = delete;
+  AllocatorTraceRecorder& operator=(AllocatorTraceRecorder&&) = delete;
+
+ private:
+  explicit AllocatorTraceRecorder(const std::string& path);
+  ~AllocatorTraceRecorder() = default;
+
+  void append(AllocatorTraceEventType type, uint32_t ptr_id, size_t size,
+              c10::DeviceIndex device, c10::StreamId stream);
+  void flushWithoutLock();
+
+  std::mutex mutex_;
+  std::FILE* file_ = nullptr;
+  std::vector<AllocatorTraceEvent> buffer_;
+  // Host and device allocators may hand out equal pointers.
+  using PtrKey = std::pair<c10::DeviceIndex, const void*>;
+  struct PtrKeyHash {
+    size_t operator()(const PtrKey& key) const {
+      return std::hash<const void*>()(key.second) ^
+             static_cast<size_t>(key.first);
+    }
+  };
+  ska::flat_hash_map<PtrKey, uint32_t, PtrKeyHash> ptr_ids_;
+  uint32_t next_ptr_id_ = 0;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Reads a file written by AllocatorTraceRecorder.
+std::vector<AllocatorTraceEvent> readAllocatorTrace(const std::string& path);
+
+}  // namespace dipu
@@ -1,49 +1,82 @@
 // Copyright (c) 2023, DeepLink.
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
 #include <deque>
 #include <mutex>
-#include <queue>
+#include <thread>
 #include <tuple>
 #include <utility>
+#include <vector>
 
 #include <c10/util/Exception.h>
 #include <c10/util/flat_hash_map.h>
 
 #include "csrc_dipu/runtime/core/DIPUEvent.h"
 
+#include "DIPUAsyncResourceReaper.h"
+
 namespace dipu {
 
 template <class T>
 class AsyncResourcePool {
  public:
-  virtual void add(const T& t, std::deque<DIPUEvent>& events) = 0;
+  // nbytes is only used for statistics.
+  virtual void add(const T& t, std::deque<DIPUEvent>& events,
+                   size_t nbytes = 0) = 0;
   virtual T get() = 0;
   virtual bool ready() = 0;
   virtual bool empty() const = 0;
   virtual size_t size() const = 0;
+  // Waits a little for ready() to become true, used when spinning on ready().
+  virtual void wait_ready() { std::this_thread::yield(); }
+  // Resources which have been added but not taken by get() yet. Slow, only
+  // meant for inspection.
+  virtual std::vector<T> queued() const = 0;
 };
 
 template <class T, at::DeviceType device_type, int algorithm>
-class AsyncResourcePoolImpl : public AsyncResourcePool<T> {
-  using Res = std::tuple<T, std::deque<DIPUEvent>>;
+class AsyncResourcePoolImpl : public AsyncResourcePool<T>,
+                              public AsyncResourceReaper::Client {
+  struct Res {
+    T t;
+    std::deque<DIPUEvent> events;
+    size_t nbytes;
+    AsyncResourceReaper::clock::time_point added;
+  };
   std::deque<Res> list_;
   using mutex_t = std::mutex;
   mutable mutex_t mutex_;
+  std::condition_variable ready_cv_;
+  AsyncResourceReaperLink reaper_;
+
+  bool front_reaped() const {
+    return !list_.empty() && list_.front().events.empty();
+  }
 
  public:
-  void add(const T& t, std::deque<DIPUEvent>& events) override {
-    std::lock_guard<mutex_t> lk(mutex_);
-    if (events.empty()) {
-      list_.emplace_front(t, std::move(events));
-    } else {
-      list_.emplace_back(t, std::move(events));
+  ~AsyncResourcePoolImpl() { reaper_.detach(this); }
+
+  void add(const T& t, std::deque<DIPUEvent>& events,
+           size_t nbytes = 0) override {
+    c10::DeviceIndex device_index = -1;
+    {
+      std::lock_guard<mutex_t> lk(mutex_);
+      if (events.empty()) {
+        list_.push_front({t, std::move(events), nbytes, {}});
+        return;
+      }
+      device_index = events.front().device_index();
+      list_.push_back({t, std::move(events), nbytes,
+                       AsyncResourceReaper::clock::now()});
     }
+    reaper_.notify(this, device_index);
   }
 
   T get() override {
     std::lock_guard<mutex_t> lk(mutex_);
-    T t = std::get<0>(list_.front());
+    T t = list_.front().t;
     list_.pop_front();
     return t;
   }
@@ -59,7 +92,11 @@ class AsyncResourcePoolImpl : public AsyncResourcePool<T> {
       return false;
     }
 
-    for (auto& item : std::get<1>(list_.front())) {
+    if (reaper_.get() != nullptr) {
+      return front_reaped();
+    }
+
+    for (auto& item : list_.front().events) {
       if (!item.query()) {
         return false;
       }
@@ -68,10 +105,67 @@ class AsyncResourcePoolImpl : public AsyncResourcePool<T> {
     return true;
   }
 
+  void wait_ready() override {
+    if (reaper_.get() == nullptr) {
+      std::this_thread::yield();
+      return;
+    }
+    std::unique_lock<mutex_t> lk(mutex_);
+    ready_cv_.wait_for(lk, AsyncResourceReaper::kMaxReadyWait,
+                       [this]() { return list_.empty() || front_reaped(); });
+  }
+
+  // Resources are handed out in order, so only the completed prefix matters.
+  bool reap() override {
+    std::unique_lock<mutex_t> lk(mutex_);
+    auto reaper = reaper_.get();
+    auto now = AsyncResourceReaper::clock::now();
+    bool reaped = false;
+    for (auto& item : list_) {
+      if (item.events.empty()) {
+        continue;
+      }
+      bool completed = true;
+      for (auto& event : item.events) {
+        if (!event.query()) {
+          completed = false;
+          break;
+        }
+      }
+      if (!completed) {
+        lk.unlock();
+        if (reaped) {
+          ready_cv_.notify_all();
+        }
+        return true;
+      }
+      item.events.clear();
+      reaped = true;
+      if (reaper != nullptr) {
+        reaper->record_reclaim(item.nbytes, now - item.added);
+      }
+    }
+    lk.unlock();
+    if (reaped) {
+      ready_cv_.notify_all();
+    }
+    return false;
+  }
+
   size_t size() const override {
     std::lock_guard<mutex_t> lk(mutex_);
     return list_.size();
   }
+
+  std::vector<T> queued() const override {
+    std::lock_guard<mutex_t> lk(mutex_);
+    std::vector<T> result;
+    result.reserve(list_.size());
+    for (const auto& item : list_) {
+      result.push_back(item.t);
+    }
+    return result;
+  }
 };
 
 #define OneStreamOneQueueAlgo 1
@@ -79,12 +173,15 @@ class AsyncResourcePoolImpl : public AsyncResourcePool<T> {
 // This implementation provides a separate queue for each stream
 template <class T, at::DeviceType device_type>
 class AsyncResourcePoolImpl<T, device_type, OneStreamOneQueueAlgo>
-    : public AsyncResourcePool<T> {
+    : public AsyncResourcePool<T>,
+      public AsyncResourceReaper::Client {
  private:
   // Resources that have events to wait for
   struct Resource final {
     const T t;
     int event_count;
+    size_t nbytes = 0;
+    AsyncResourceReaper::clock::time_point added;
 
     Resource(const T& t, int event_count) : t(t), event_count(event_count) {}
 
@@ -94,34 +191,52 @@ class AsyncResourcePoolImpl<T, device_type, OneStreamOneQueueAlgo>
     Resource(Resource&&) = delete;
     Resource& operator=(Resource&&) = delete;
   };
-  ska::flat_hash_map<c10::StreamId, std::queue<std::pair<Resource*, DIPUEvent>>>
+  // Deques rather than queues so that queued() can walk them.
+  ska::flat_hash_map<c10::StreamId, std::deque<std::pair<Resource*, DIPUEvent>>>
       queues_with_events;
   Resource* ready_resource = nullptr;
 
   // Resources that have no events to wait for.
   // In other words, they are already ready.
   // Place them in a special queue for higher performance.
-  std::queue<T> queue_without_events;
+  // The reaper also moves reclaimed resources here.
+  std::deque<T> queue_without_events;
 
   size_t total_size = 0;
 
   using mutex_t = std::mutex;
   mutable mutex_t mutex;
+  std::condition_variable ready_cv;
+  AsyncResourceReaperLink reaper;
+
+  bool has_ready_resource() const {
+    return !queue_without_events.empty() || ready_resource;
+  }
 
  public:
-  void add(const T& t, std::deque<DIPUEvent>& events) override {
-    std::lock_guard<mutex_t> lk(mutex);
-    if (events.empty()) {
-      queue_without_events.push(t);
-    } else {
+  ~AsyncResourcePoolImpl() { reaper.detach(this); }
+
+  void add(const T& t, std::deque<DIPUEvent>& events,
+           size_t nbytes = 0) override {
+    c10::DeviceIndex device_index = -1;
+    {
+      std::lock_guard<mutex_t> lk(mutex);
+      ++total_size;
+      if (events.empty()) {
+        queue_without_events.push_back(t);
+        return;
+      }
       auto resource = new Resource(t, events.size());
+      resource->nbytes = nbytes;
+      resource->added = AsyncResourceReaper::clock::now();
+      device_index = events.front().device_index();
       for (DIPUEvent& event : events) {
-        queues_with_events[event.last_recorded_stream_id()].emplace(
+        queues_with_events[event.last_recorded_stream_id()].emplace_back(
             resource, std::move(event));
       }
       events.clear();
     }
-    ++total_size;
+    reaper.notify(this, device_index);
   }
 
   T get() override {
@@ -129,7 +244,7 @@ class AsyncResourcePoolImpl<T, device_type, OneStreamOneQueueAlgo>
 
     if (!queue_without_events.empty()) {
       T t = queue_without_events.front();
-      queue_without_events.pop();
+      queue_without_events.pop_front();
       --total_size;
       return t;
     }
@@ -153,12 +268,13 @@ class AsyncResourcePoolImpl<T, device_type, OneStreamOneQueueAlgo>
   bool ready() override {
     std::lock_guard<mutex_t> lk(mutex);
 
-    if (!queue_without_events.empty()) {
+    if (has_ready_resource()) {
       return true;
     }
 
-    if (ready_resource) {
-      return true;
+    // The reaper queries the events, the allocation path never does.
+    if (reaper.get() != nullptr) {
+      return false;
     }
 
     for (auto it = queues_with_events.begin();
@@ -170,7 +286,7 @@ class AsyncResourcePoolImpl<T, device_type, OneStreamOneQueueAlgo>
         if (0 == resource->event_count) {
           ready_resource = resource;
         }
-        queue.pop();
+        queue.pop_front();
       }
 
       if (queue.empty()) {
@@ -187,10 +303,75 @@ class AsyncResourcePoolImpl<T, device_type, OneStreamOneQueueAlgo>
     return false;
   }
 
+  void wait_ready() override {
+    if (reaper.get() == nullptr) {
+      std::this_thread::yield();
+      return;
+    }
+    std::unique_lock<mutex_t> lk(mutex);
+    ready_cv.wait_for(lk, AsyncResourceReaper::kMaxReadyWait, [this]() {
+      return 0 == total_size || has_ready_resource();
+    });
+  }
+
+  bool reap() override {
+    std::unique_lock<mutex_t> lk(mutex);
+    auto* reaper_ptr = reaper.get();
+    auto now = AsyncResourceReaper::clock::now();
+    bool reaped = false;
+    for (auto it = queues_with_events.begin();
+         it != queues_with_events.end();) {
+      auto& queue = it->second;
+      while (!queue.empty() && queue.front().second.query()) {
+        auto* resource = queue.front().first;
+        queue.pop_front();
+        if (0 == --resource->event_count) {
+          if (reaper_ptr != nullptr) {
+            reaper_ptr->record_reclaim(resource->nbytes,
+                                       now - resource->added);
+          }
+          queue_without_events.push_back(resource->t);
+          delete resource;
+          reaped = true;
+        }
+      }
+      if (queue.empty()) {
+        it = queues_with_events.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    bool pending = !queues_with_events.empty();
+    lk.unlock();
+    if (reaped) {
+      ready_cv.notify_all();
+    }
+    return pending;
+  }
+
   size_t size() const override {
     std::lock_guard<mutex_t> lk(mutex);
     return total_size;
   }
+
+  std::vector<T> queued() const override {
+    std::lock_guard<mutex_t> lk(mutex);
+    std::vector<T> result(queue_without_events.begin(),
+                          queue_without_events.end());
+    if (ready_resource) {
+      result.push_back(ready_resource->t);
+    }
+    // A resource waits in the queue of every stream it was used on.
+    ska::flat_hash_set<const Resource*> seen;
+    for (const auto& [stream_id, queue] : queues_with_events) {
+      for (const auto& [resource, event] : queue) {
+        if (seen.insert(resource).second) {
+          result.push_back(resource->t);
+        }
+      }
+    }
+    return result;
+  }
 };
 
 }  // namespace dipu
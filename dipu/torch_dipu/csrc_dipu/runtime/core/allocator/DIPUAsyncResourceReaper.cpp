@@ -0,0 +1,179 @@
+// Copyright (c) 2024, DeepLink.
+
+#include "DIPUAsyncResourceReaper.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <c10/util/Exception.h>
+
+#include "csrc_dipu/base/environ.hpp"
+#include "csrc_dipu/runtime/devproxy/deviceproxy.h"
+
+namespace dipu {
+
+namespace {
+
+constexpr int kMaxDevices = 16;
+
+auto& reapers() {
+  // Using * to avoid being destructed.
+  static auto* instances =
+      new std::array<std::atomic<AsyncResourceReaper*>, kMaxDevices>{};
+  return *instances;
+}
+
+std::mutex& reapersMutex() {
+  // Using * to avoid being destructed.
+  static auto* mutex = new std::mutex();
+  return *mutex;
+}
+
+}  // namespace
+
+bool AsyncResourceReaper::enabled() {
+  return environ::asyncResourceReaper();
+}
+
+std::chrono::microseconds AsyncResourceReaper::interval() {
+  static const auto value = std::chrono::microseconds(
+      std::max<int64_t>(environ::asyncResourceReaperIntervalUs(), 1));
+  return value;
+}
+
+AsyncResourceReaper& AsyncResourceReaper::instance(
+    c10::DeviceIndex device_index) {
+  TORCH_CHECK(device_index >= 0 && device_index < kMaxDevices,
+              "invalid device index for async resource reaper: ",
+              static_cast<int>(device_index));
+  auto& slot = reapers()[device_index];
+  if (auto* reaper = slot.load(std::memory_order_acquire)) {
+    return *reaper;
+  }
+  std::lock_guard<std::mutex> lk(reapersMutex());
+  if (auto* reaper = slot.load(std::memory_order_acquire)) {
+    return *reaper;
+  }
+  // Leaked on purpose, it is stopped by stopAll() but pools may still refer to
+  // it during static destruction.
+  auto* reaper = new AsyncResourceReaper(device_index);
+  slot.store(reaper, std::memory_order_release);
+  return *reaper;
+}
+
+void AsyncResourceReaper::stopAll() {
+  std::lock_guard<std::mutex> lk(reapersMutex());
+  for (auto& slot : reapers()) {
+    if (auto* reaper = slot.load(std::memory_order_acquire)) {
+      reaper->stop();
+    }
+  }
+}
+
+AsyncResourceReaper::AsyncResourceReaper(c10::DeviceIndex device_index)
+    : device_index_(device_index),
+      reclaimed_bytes_(
+          metrics::default_collector()
+              .make_integer_counter("allocator_reaper_reclaimed_bytes",
+                                    "bytes reclaimed by the event reaper")
+              .with({{"device", std::to_string(device_index)}})),
+      reclaimed_count_(
+          metrics::default_collector()
+              .make_integer_counter("allocator_reaper_reclaimed_count",
+                                    "resources reclaimed by the event reaper")
+              .with({{"device", std::to_string(device_index)}})),
+      reclaim_lag_us_(
+          metrics::default_collector()
+              .make_integer_histogram(
+                  "allocator_reaper_lag_us",
+                  "time from a resource being freed until it is reclaimed",
+                  std::vector<metrics::ExportedInteger>{
+                      10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000})
+              .with({{"device", std::to_string(device_index)}})),
+      thread_([this]() { run(); }) {}
+
+void AsyncResourceReaper::attach(Client* client) {
+  std::lock_guard<std::mutex> lk(mutex_);
+  clients_.push_back(client);
+}
+
+void AsyncResourceReaper::detach(Client* client) {
+  std::unique_lock<std::mutex> lk(mutex_);
+  clients_.erase(std::remove(clients_.begin(), clients_.end(), client),
+                 clients_.end());
+  // A pass which started before may still reap it.
+  reaped_cv_.wait(lk, [this]() { return !reaping_; });
+}
+
+void AsyncResourceReaper::notify() {
+  // Cheap check on the hot path. See run() for why no wake-up gets lost.
+  if (!idle_.load()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lk(mutex_);
+    notified_ = true;
+  }
+  cv_.notify_one();
+}
+
+void AsyncResourceReaper::record_reclaim(size_t nbytes, clock::duration lag) {
+  if (!metrics::enable()) {
+    return;
+  }
+  reclaimed_bytes_.add(static_cast<metrics::ExportedInteger>(nbytes));
+  reclaimed_count_.inc();
+  reclaim_lag_us_.put(static_cast<metrics::ExportedInteger>(
+      std::chrono::duration_cast<std::chrono::microseconds>(lag).count()));
+}
+
+bool AsyncResourceReaper::reap_all(std::unique_lock<std::mutex>& lk) {
+  auto clients = clients_;
+  reaping_ = true;
+  lk.unlock();
+  bool pending = false;
+  for (auto* client : clients) {
+    pending = client->reap() || pending;
+  }
+  lk.lock();
+  reaping_ = false;
+  reaped_cv_.notify_all();
+  return pending;
+}
+
+void AsyncResourceReaper::run() {
+  devproxy::setDevice(device_index_);
+  std::unique_lock<std::mutex> lk(mutex_);
+  while (running()) {
+    if (reap_all(lk)) {
+      cv_.wait_for(lk, interval(), [this]() { return !running(); });
+      continue;
+    }
+    // Announce idleness before the final pass: a pool either adds its resource
+    // before that pass and gets reaped by it, or sees idle_ and notifies us.
+    idle_.store(true);
+    if (reap_all(lk)) {
+      idle_.store(false);
+      continue;
+    }
+    cv_.wait(lk, [this]() { return notified_ || !running(); });
+    notified_ = false;
+    idle_.store(false);
+  }
+}
+
+void AsyncResourceReaper::stop() {
+  {
+    std::lock_guard<std::mutex> lk(mutex_);
+    running_.store(false, std::memory_order_release);
+  }
+  cv_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+}  // namespace dipu
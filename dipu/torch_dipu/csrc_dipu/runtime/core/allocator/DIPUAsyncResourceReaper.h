@@ -0,0 +1,142 @@
+// Copyright (c) 2024, DeepLink.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <c10/core/Device.h>
+
+#include "csrc_dipu/metrics/metrics.h"
+
+namespace dipu {
+
+// A per-device background thread which queries the events of pending resources
+// in AsyncResourcePool and marks them as ready. With it the allocation path
+// never queries events, it only picks up what the reaper has reclaimed: the
+// allocators still move ready blocks back into their caches themselves, under
+// their own locks.
+//
+// Enabled by DIPU_ASYNC_POOL_REAPER. While there is pending work, the reaper
+// queries the events of every pool each interval(), which is the latency target
+// of reclaiming a resource; otherwise it sleeps until a pool adds a new
+// resource. It never blocks on an event, so a long kernel on one stream does
+// not hold back resources of other streams or pools.
+class AsyncResourceReaper {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  class Client {
+   public:
+    // Marks resources whose events have completed as ready. Returns whether
+    // resources with pending events remain.
+    virtual bool reap() = 0;
+
+   protected:
+    ~Client() = default;
+  };
+
+  static bool enabled();
+
+  // How often pending events are queried, DIPU_ASYNC_POOL_REAPER_INTERVAL_US.
+  static std::chrono::microseconds interval();
+
+  // Upper bound for AsyncResourcePool::wait_ready(), which is woken up by the
+  // reaper as soon as it reclaims something.
+  static constexpr std::chrono::milliseconds kMaxReadyWait{1};
+
+  static AsyncResourceReaper& instance(c10::DeviceIndex device_index);
+
+  // Stops the reaper threads of all devices. Pools fall back to querying
+  // events themselves afterwards.
+  static void stopAll();
+
+  bool running() const { return running_.load(std::memory_order_acquire); }
+
+  void attach(Client* client);
+
+  // Blocks until the client is no longer being reaped.
+  void detach(Client* client);
+
+  // Tells the reaper that a client has new pending resources.
+  void notify();
+
+  // Called by clients inside reap() for every resource which becomes ready.
+  void record_reclaim(size_t nbytes, clock::duration lag);
+
+  AsyncResourceReaper(const AsyncResourceReaper&) = delete;
+  AsyncResourceReaper& operator=(const AsyncResourceReaper&) = delete;
+  AsyncResourceReaper(AsyncResourceReaper&&) = delete;
+  AsyncResourceReaper& operator=(AsyncResourceReaper&&) = delete;
+
+ private:
+  explicit AsyncResourceReaper(c10::DeviceIndex device_index);
+  ~AsyncResourceReaper() = default;
+
+  void run();
+  void stop();
+  // Reaps every client without holding mutex_, which lk holds on entry and on
+  // return. Returns whether resources with pending events remain.
+  bool reap_all(std::unique_lock<std::mutex>& lk);
+
+  c10::DeviceIndex device_index_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<Client*> clients_;
+  // Set while reap_all() runs, detach() waits for it on reaped_cv_.
+  bool reaping_ = false;
+  std::condition_variable reaped_cv_;
+  bool notified_ = false;
+  std::atomic<bool> idle_{false};
+  std::atomic<bool> running_{true};
+
+  metrics::LabeledIntegerCounter reclaimed_bytes_;
+  metrics::LabeledIntegerCounter reclaimed_count_;
+  metrics::LabeledIntegerHistogram reclaim_lag_us_;
+
+  // Declared last so that it starts after everything else is initialized.
+  std::thread thread_;
+};
+
+// Lazily attaches an AsyncResourcePool to the reaper of the device where its
+// first pending event lives.
+class AsyncResourceReaperLink {
+  std::once_flag once_;
+  std::atomic<AsyncResourceReaper*> reaper_{nullptr};
+
+ public:
+  // The reaper which currently reclaims for the pool, or nullptr if the pool
+  // has to query its events itself.
+  AsyncResourceReaper* get() const {
+    auto* reaper = reaper_.load(std::memory_order_acquire);
+    return reaper != nullptr && reaper->running() ? reaper : nullptr;
+  }
+
+  // Must not be called with the lock of the pool held.
+  void notify(AsyncResourceReaper::Client* client,
+              c10::DeviceIndex device_index) {
+    if (!AsyncResourceReaper::enabled()) {
+      return;
+    }
+    std::call_once(once_, [&]() {
+      auto& reaper = AsyncResourceReaper::instance(device_index);
+      reaper.attach(client);
+      reaper_.store(&reaper, std::memory_order_release);
+    });
+    if (auto* reaper = get()) {
+      reaper->notify();
+    }
+  }
+
+  void detach(AsyncResourceReaper::Client* client) {
+    if (auto* reaper = reaper_.load(std::memory_order_acquire)) {
+      reaper->detach(client);
+    }
+  }
+};
+
+}  // namespace dipu
@@ -1,8 +1,16 @@
 // Copyright (c) 2023, DeepLink.
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <stack>
+#include <string>
 #include <thread>
 #include <utility>
 #include <vector>
@@ -10,7 +18,6 @@
 #include "csrc_dipu/utils/env.hpp"
 
 #include "DIPUCachingAllocator.h"
-#include "DIPUSpinMutex.h"
 
 namespace dipu {
 
@@ -18,6 +25,30 @@ namespace dipu {
 const size_t kMaxExtendSize = get_env_or_default("DIPU_MAX_EXTEND_SIZE", 1024)
                               << 20U;
 
+// Number of independently locked shards. Each stream is mapped to one shard,
+// so allocations on different streams never contend on the same lock.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+const size_t kNumStreamShards = std::max<size_t>(
+    get_env_or_default<size_t>("DIPU_BF_STREAM_SHARDS", 16), 1);
+
+// Freed chunks not larger than this (in KB) may be kept in a thread-local cache
+// and handed back to the same thread without taking any lock. 0 disables it.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+const size_t kMaxThreadCachedChunkSize =
+    get_env_or_default<size_t>("DIPU_BF_THREAD_CACHE_MAX_SIZE", 1024) << 10U;
+
+// Whether a free chunk cached by the shard of another stream may be reused
+// before allocating more device memory or flushing the cache.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+const bool kBorrowAcrossStreams =
+    get_env_or_default("DIPU_BF_STREAM_BORROW", true);
+
+// Number of iterations (see markIterationBoundary) used to size the arenas
+// which are reserved afterwards and kept until empty_cache. 0 disables it.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+const size_t kIterationWarmup =
+    get_env_or_default<size_t>("DIPU_BF_ITERATION_WARMUP", 0);
+
 class BFCachingAllocatorImpl {
  public:
   using allocate_fn_t = std::function<void*(size_t)>;
@@ -36,14 +67,19 @@ class BFCachingAllocatorImpl {
   static constexpr size_t kMaxInternalFragmentation = 8U << 20U;  // 8MB
   static constexpr size_t kMinExtendSize = 8U << 20U;             // 8MB
 
-  size_t cachedBytes = 0;
+  std::atomic<size_t> cachedBytes{0};
+  std::atomic<size_t> deviceAllocations{0};
   size_t allocatedBytes = 0;
+  // The segment reserved by reserveArena(). It survives the flush done before
+  // growing, only emptyCache() releases it.
+  void* arenaPtr_ = nullptr;
 
   void* allocateOnDevice(size_t nbytes) {
     void* ptr = nullptr;
     try {
       ptr = allocate_fn(nbytes);
       cachedBytes += nbytes;
+      ++deviceAllocations;
     } catch (...) {
     }
 
@@ -136,13 +172,9 @@ class BFCachingAllocatorImpl {
   using StreamSetHandle = std::unique_ptr<StreamSet>;
   std::vector<StreamSetHandle> streamSets_;
 
-  using mutex_t = SpinMutex;
+  using mutex_t = std::mutex;
   mutable mutex_t mut_;
 
-  static size_t roundBytes(size_t nbytes) {
-    return ((nbytes - 1) | (kMinAllocationSize - 1)) + 1;
-  }
-
   int newChunk(void* ptr, size_t size, size_t stream) {
     int id = 0;
     if (!recycleIds_.empty()) {
@@ -239,11 +271,15 @@ class BFCachingAllocatorImpl {
     return id;
   }
 
-  void shrink(StreamSetHandle& set) {
+  void shrink(StreamSetHandle& set, bool keepArena) {
     for (int binHead : set->binHeads_) {
       int k = chunks_[binHead].nextChunkInList;
       while (k) {
-        if (chunks_[k].isMonoBlock()) {
+        if (chunks_[k].isMonoBlock() &&
+            !(keepArena && chunks_[k].ptr == arenaPtr_)) {
+          if (chunks_[k].ptr == arenaPtr_) {
+            arenaPtr_ = nullptr;
+          }
           releaseOnDevice(chunks_[k].ptr, chunks_[k].size);
           removeChunkFromBin(k);
           recycleIds_.push(k);
@@ -292,7 +328,7 @@ class BFCachingAllocatorImpl {
   }
 
   int extend(size_t nbytes, StreamSetHandle& set) {
-    emptyCacheWithoutLock();
+    emptyCacheWithoutLock(true);
     auto& extSize = set->currExtendSize_;
     bool increased = false;
     while (extSize < nbytes && extSize < kMaxExtendSize) {
@@ -333,10 +369,10 @@ class BFCachingAllocatorImpl {
     return streamSets_[stream];
   }
 
-  void emptyCacheWithoutLock() {
+  void emptyCacheWithoutLock(bool keepArena = false) {
     for (auto& set : streamSets_) {
       if (set != nullptr) {
-        shrink(set);
+        shrink(set, keepArena);
       }
     }
   }
@@ -349,24 +385,51 @@ class BFCachingAllocatorImpl {
 
   ~BFCachingAllocatorImpl() { emptyCache(); }
 
+  static size_t roundBytes(size_t nbytes) {
+    return ((nbytes - 1) | (kMinAllocationSize - 1)) + 1;
+  }
+
   void emptyCache() {
     std::lock_guard<mutex_t> lk(mut_);
     emptyCacheWithoutLock();
   }
 
-  std::tuple<void*, int, size_t> allocateRaw(size_t size) {
+  // Allocates one segment of `nbytes` up front which is split for later
+  // allocations. Returns false if the device has not enough memory.
+  bool reserveArena(size_t nbytes) {
+    std::lock_guard<mutex_t> lk(mut_);
+    if (arenaPtr_ != nullptr) {
+      return true;
+    }
+    auto& set = checkStream(0);
+    void* ptr = allocateOnDevice(nbytes);
+    if (ptr == nullptr) {
+      return false;
+    }
+    insertChunkIntoBin(newChunk(ptr, nbytes, set->id));
+    arenaPtr_ = ptr;
+    return true;
+  }
+
+  size_t deviceAllocationCount() const { return deviceAllocations; }
+
+  // With `allowExtend` false only cached chunks are used and nothing is
+  // released or allocated on the device.
+  std::tuple<void*, int, size_t> allocateRaw(size_t size,
+                                             bool allowExtend = true) {
     if (!size) {
       return std::make_tuple(nullptr, 0, 0);
     }
 
     size_t nbytes = roundBytes(size);
 
-    allocatedBytes += nbytes;
-
     std::lock_guard<mutex_t> lk(mut_);
+    allocatedBytes += nbytes;
+    // Every shard serves exactly one group of streams, so a single StreamSet
+    // per shard is enough.
     auto& set = checkStream(0);
     int id = findChunk(nbytes, set);
-    if (!id) {
+    if (!id && allowExtend) {
       id = extend(nbytes, set);
     }
 
@@ -378,8 +441,8 @@ class BFCachingAllocatorImpl {
       chunks_[id].allocated = true;
       return std::make_tuple(chunks_[id].ptr, id, nbytes);
     }
+    allocatedBytes -= nbytes;
     return std::make_tuple(nullptr, 0, 0);
-    ;
   }
 
   void releaseRaw(void* ptr, int id) {
@@ -402,47 +465,445 @@ class BFCachingAllocatorImpl {
   }
 
   size_t memory_reserved() const { return cachedBytes; }
+
+  // Appends the segments of this shard. Allocated chunks in `pending` are
+  // reported as freed but not yet reusable.
+  void snapshot(std::vector<MemorySegmentInfo>& segments,
+                c10::DeviceIndex device, c10::StreamId stream,
+                const ska::flat_hash_set<int>& pending) const {
+    using State = MemoryBlockInfo::State;
+    std::lock_guard<mutex_t> lk(mut_);
+    std::vector<bool> recycled(chunks_.size());
+    for (auto ids = recycleIds_; !ids.empty(); ids.pop()) {
+      recycled[ids.top()] = true;
+    }
+    for (int id = 1; id < static_cast<int>(chunks_.size()); ++id) {
+      // Bin heads have no memory, and only the first chunk of a segment has
+      // no predecessor in memory.
+      if (recycled[id] || chunks_[id].ptr == nullptr ||
+          chunks_[id].prevChunkInMem != 0) {
+        continue;
+      }
+      auto& segment = segments.emplace_back();
+      segment.device = device;
+      segment.address = reinterpret_cast<size_t>(chunks_[id].ptr);
+      segment.stream = stream;
+      for (int k = id; k != 0; k = chunks_[k].nextChunkInMem) {
+        const auto& chunk = chunks_[k];
+        State state = !chunk.allocated   ? State::kFree
+                      : pending.count(k) ? State::kPendingFree
+                                         : State::kAllocated;
+        segment.blocks.push_back({reinterpret_cast<size_t>(chunk.ptr),
+                                  chunk.size, chunk.size, state});
+        segment.total_size += chunk.size;
+      }
+    }
+  }
 };
 
 static void deleteBFContext(void* ptr);
 
+class BFCachingAllocator;
+
+// A tiny per-thread cache of small chunks freed by that thread. The common
+// "free a tensor, allocate one of the same size" cycle is then served without
+// touching any shard lock or the async resource pool.
+//
+// Each slot is guarded by its `state`: whoever moves it into `kBusy` owns the
+// payload. This lets other threads drain the cache (e.g. in empty_cache)
+// without racing with the owning thread.
+class BFThreadChunkCache {
+ public:
+  struct Chunk {
+    const BFCachingAllocator* owner = nullptr;
+    void* ptr = nullptr;
+    int id = 0;
+    size_t shard = 0;
+    size_t nbytes = 0;
+    // The only stream the chunk was used on, or -1 if it is safe to hand it
+    // out on any stream (see DataPtrContextBase).
+    c10::StreamId stream = -1;
+  };
+
+  static BFThreadChunkCache& local() {
+    thread_local BFThreadChunkCache cache;
+    return cache;
+  }
+
+  bool put(const Chunk& chunk) {
+    for (auto& slot : slots_) {
+      int expected = kEmpty;
+      if (slot.state.load(std::memory_order_relaxed) == kEmpty &&
+          slot.state.compare_exchange_strong(expected, kBusy,
+                                             std::memory_order_acquire)) {
+        slot.chunk = chunk;
+        slot.state.store(kFull, std::memory_order_release);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool take(const BFCachingAllocator* owner, size_t nbytes,
+            c10::StreamId stream, Chunk& chunk) {
+    for (auto& slot : slots_) {
+      int expected = kFull;
+      if (slot.state.load(std::memory_order_relaxed) != kFull ||
+          !slot.state.compare_exchange_strong(expected, kBusy,
+                                              std::memory_order_acquire)) {
+        continue;
+      }
+      const auto& cached = slot.chunk;
+      if (cached.owner == owner && cached.nbytes == nbytes &&
+          (cached.stream == -1 || cached.stream == stream)) {
+        chunk = cached;
+        slot.state.store(kEmpty, std::memory_order_release);
+        return true;
+      }
+      slot.state.store(kFull, std::memory_order_release);
+    }
+    return false;
+  }
+
+  // Give back the chunks of `owner` cached by any thread. A nullptr `owner`
+  // matches every allocator.
+  static void drainAll(const BFCachingAllocator* owner) {
+    std::lock_guard<std::mutex> lk(registryMutex());
+    for (auto* cache : registry()) {
+      cache->drain(owner);
+    }
+  }
+
+  // Calls fn for every chunk of `owner` cached by any thread, without taking
+  // them out of the caches.
+  template <typename Fn>
+  static void visitAll(const BFCachingAllocator* owner, const Fn& fn) {
+    std::lock_guard<std::mutex> lk(registryMutex());
+    for (auto* cache : registry()) {
+      for (auto& slot : cache->slots_) {
+        int expected = kFull;
+        if (!slot.state.compare_exchange_strong(expected, kBusy,
+                                                std::memory_order_acquire)) {
+          continue;
+        }
+        if (slot.chunk.owner == owner) {
+          fn(slot.chunk);
+        }
+        slot.state.store(kFull, std::memory_order_release);
+      }
+    }
+  }
+
+  BFThreadChunkCache(const BFThreadChunkCache&) = delete;
+  BFThreadChunkCache& operator=(const BFThreadChunkCache&) = delete;
+  BFThreadChunkCache(BFThreadChunkCache&&) = delete;
+  BFThreadChunkCache& operator=(BFThreadChunkCache&&) = delete;
+
+ private:
+  static constexpr size_t kNumSlots = 8;
+  enum State : int { kEmpty, kBusy, kFull };
+
+  struct Slot {
+    std::atomic<int> state{kEmpty};
+    Chunk chunk;
+  };
+  std::array<Slot, kNumSlots> slots_;
+
+  BFThreadChunkCache() {
+    std::lock_guard<std::mutex> lk(registryMutex());
+    registry().push_back(this);
+  }
+
+  ~BFThreadChunkCache() {
+    std::lock_guard<std::mutex> lk(registryMutex());
+    auto& caches = registry();
+    caches.erase(std::remove(caches.begin(), caches.end(), this),
+                 caches.end());
+    drain(nullptr);
+  }
+
+  void drain(const BFCachingAllocator* owner);
+
+  static std::mutex& registryMutex() {
+    // Using * to avoid being destructed.
+    static auto* mutex = new std::mutex();
+    return *mutex;
+  }
+
+  static std::vector<BFThreadChunkCache*>& registry() {
+    // Using * to avoid being destructed.
+    static auto* caches = new std::vector<BFThreadChunkCache*>();
+    return *caches;
+  }
+};
+
 class BFCachingAllocator : public CacheAllocator {
-  mutable std::unique_ptr<BFCachingAllocatorImpl> impl;
+  // One BFCachingAllocatorImpl per stream shard, each with its own lock.
+  mutable std::vector<std::unique_ptr<BFCachingAllocatorImpl>> shards_;
+  // The stream which allocated from each shard most recently, reported in
+  // snapshots.
+  mutable std::unique_ptr<std::atomic<c10::StreamId>[]> shard_streams_;
   using mutex_t = std::mutex;
   mutable mutex_t resource_pool_mutex_;
 
+  struct BorrowMetrics {
+    metrics::LabeledIntegerCounter count;
+    metrics::LabeledIntegerCounter bytes;
+  };
+  mutable std::once_flag borrow_metrics_flag_;
+  mutable std::unique_ptr<BorrowMetrics> borrow_metrics_;
+
+  // Iteration-aware pre-reservation, see mark_iteration_boundary().
+  static constexpr size_t kArenaAlignment = 2U << 20U;
+  mutable std::mutex iteration_mutex_;
+  mutable std::atomic<bool> warming_up_{false};
+  mutable std::atomic<size_t> iteration_peak_{0};
+  // Bytes allocated from each shard and their growth within one warm-up
+  // iteration, which sizes the arena of the shard.
+  struct ShardUsage {
+    std::atomic<size_t> allocated{0};
+    std::atomic<size_t> peak{0};
+    size_t base = 0;
+    size_t transient_peak = 0;
+  };
+  mutable std::unique_ptr<ShardUsage[]> shard_usage_;
+  mutable IterationMemoryReport iteration_report_;
+  mutable size_t iteration_base_ = 0;
+  mutable size_t device_allocations_at_warmup_end_ = 0;
+
+  friend class BFThreadChunkCache;
+
  private:
+  // The async resource pool only stores a size_t next to each pointer, so the
+  // shard and the chunk id are packed into it.
+  static constexpr unsigned kShardShift = 32U;
+
+  static size_t packChunkHandle(size_t shard, int id) {
+    return (shard << kShardShift) | static_cast<uint32_t>(id);
+  }
+
+  static std::pair<size_t, int> unpackChunkHandle(size_t handle) {
+    return {handle >> kShardShift,
+            static_cast<int>(static_cast<uint32_t>(handle))};
+  }
+
+  void releaseChunkHandle(void* ptr, size_t handle) const {
+    auto [shard, id] = unpackChunkHandle(handle);
+    DIPU_DEBUG_ALLOCATOR(8, "BFCachingAllocator: "
+                                << __FUNCTION__ << " ,ptr:" << ptr
+                                << " ,shard:" << shard << " ,id:" << id
+                                << " ,allocator:" << this
+                                << ", device:" << device());
+    shards_[shard]->releaseRaw(ptr, id);
+  }
+
+  // A chunk bound to a stream was cached without an event. It goes through
+  // the async resource pool like any other freed chunk, so every chunk in a
+  // shard may be handed out on any stream.
+  void releaseCachedChunk(const BFThreadChunkCache::Chunk& chunk) const {
+    if (chunk.stream < 0) {
+      shards_[chunk.shard]->releaseRaw(chunk.ptr, chunk.id);
+      return;
+    }
+    std::deque<DIPUEvent> events(1);
+    events.back().record(DIPUStream(device().index(), chunk.stream));
+    async_mem_pool()->add(
+        std::make_tuple(chunk.ptr, packChunkHandle(chunk.shard, chunk.id)),
+        events, chunk.nbytes);
+  }
+
+  size_t reserved_bytes() const {
+    size_t reserved = 0;
+    for (auto& shard : shards_) {
+      reserved += shard->memory_reserved();
+    }
+    return reserved;
+  }
+
+  size_t device_allocation_count() const {
+    size_t count = 0;
+    for (auto& shard : shards_) {
+      count += shard->deviceAllocationCount();
+    }
+    return count;
+  }
+
+  void record_warmup_allocation(size_t shard) const {
+    update_peak(iteration_peak_, memory_allocated());
+    auto& usage = shard_usage_[shard];
+    update_peak(usage.peak, usage.allocated.load());
+  }
+
+  // Replaces the segments grown during warm-up by one arena per shard which
+  // fits the largest per-iteration growth of that shard, so that every stream
+  // allocating in steady state finds its memory in its own shard.
+  void reserve_arena() const {
+    auto& report = iteration_report_;
+    report.arena_bytes = 0;
+    flush_shards();
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      size_t nbytes = (shard_usage_[i].transient_peak + kArenaAlignment - 1) /
+                      kArenaAlignment * kArenaAlignment;
+      if (nbytes == 0) {
+        continue;
+      }
+      if (shards_[i]->reserveArena(nbytes)) {
+        report.arena_bytes += nbytes;
+      } else {
+        DIPU_DEBUG_ALLOCATOR(2, "BFCachingAllocator: failed to reserve arena "
+                                    << nbytes << " bytes in shard " << i);
+      }
+    }
+    set_memory_reserved(reserved_bytes());
+    device_allocations_at_warmup_end_ = device_allocation_count();
+    DIPU_DEBUG_ALLOCATOR(4, "BFCachingAllocator: reserved arenas of "
+                                << report.arena_bytes
+                                << " bytes, warm-up peak:" << report.peak_bytes
+                                << ", allocator:" << this);
+  }
+
+  // empty_cache() releases the arenas. Warm-up starts over at the next
+  // iteration boundary, so that the report does not claim memory which is
+  // gone and the arenas are sized again.
+  void drop_arena() const {
+    if (kIterationWarmup == 0) {
+      return;
+    }
+    std::lock_guard<std::mutex> lk(iteration_mutex_);
+    if (iteration_report_.iterations <= kIterationWarmup) {
+      return;
+    }
+    iteration_report_ = IterationMemoryReport{};
+    warming_up_ = false;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      shard_usage_[i].transient_peak = 0;
+    }
+  }
+
+  void flush_shards() const {
+    BFThreadChunkCache::drainAll(this);
+    empty_resource_pool();
+    for (auto& shard : shards_) {
+      shard->emptyCache();
+    }
+    set_memory_reserved(reserved_bytes());
+  }
+
+  c10::StreamId current_stream_id() const {
+    if (device().type() != dipu::DIPU_DEVICE_TYPE) {
+      return -1;
+    }
+    return getCurrentDIPUStream(device().index()).id();
+  }
+
+  // Stream ids keep the stream index in their low bits and the stream type
+  // above it, so a plain modulo would map stream i of every pool to the same
+  // shard. The id is mixed (murmur3 fmix64) before picking the shard.
+  size_t shard_of(c10::StreamId stream) const {
+    if (stream < 0) {
+      return 0;
+    }
+    auto h = static_cast<uint64_t>(stream);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return static_cast<size_t>(h % shards_.size());
+  }
+
+  BorrowMetrics& borrow_metrics() const {
+    std::call_once(borrow_metrics_flag_, [this]() {
+      auto& collector = metrics::default_collector();
+      metrics::Collector::labelset labels{
+          {"type", "caching"}, {"device", std::to_string(device().index())}};
+      borrow_metrics_ = std::make_unique<BorrowMetrics>(BorrowMetrics{
+          collector
+              .make_integer_counter("allocator_stream_borrow_count",
+                                    "chunks reused from another stream")
+              .with(labels),
+          collector
+              .make_integer_counter("allocator_stream_borrow_bytes",
+                                    "bytes reused from another stream")
+              .with(labels)});
+    });
+    return *borrow_metrics_;
+  }
+
+  // Takes a free chunk cached by the shard of another stream. Chunks only
+  // reach a shard once the events recorded on their streams have completed,
+  // or if they were used on the default stream alone, which every other stream
+  // waits for when allocating. So no extra wait is needed here.
+  std::tuple<void*, int, size_t> borrow_chunk(size_t size,
+                                              size_t& shard) const {
+    if (!kBorrowAcrossStreams || device().type() != dipu::DIPU_DEVICE_TYPE) {
+      return {nullptr, 0, 0};
+    }
+    for (size_t i = 1; i < shards_.size(); ++i) {
+      size_t other = (shard + i) % shards_.size();
+      if (shards_[other]->memory_reserved() == 0) {
+        continue;
+      }
+      auto block = shards_[other]->allocateRaw(size, false);
+      if (std::get<0>(block) == nullptr) {
+        continue;
+      }
+      DIPU_DEBUG_ALLOCATOR(4, "BFCachingAllocator: borrow "
+                                  << std::get<2>(block) << " nbytes from shard "
+                                  << other << " for shard " << shard
+                                  << ", allocator:" << this);
+      if (metrics::enable()) {
+        auto& counters = borrow_metrics();
+        counters.count.inc();
+        counters.bytes.add(
+            static_cast<metrics::ExportedInteger>(std::get<2>(block)));
+      }
+      shard = other;
+      return block;
+    }
+    return {nullptr, 0, 0};
+  }
+
+  // Own cached chunks first, then the ones idling in other streams' shards,
+  // and only then grow the own shard.
+  std::tuple<void*, int, size_t> allocate_in_shards(size_t size,
+                                                    size_t& shard) const {
+    auto block = shards_[shard]->allocateRaw(size, false);
+    if (std::get<0>(block) == nullptr && size > 0) {
+      size_t borrowed = shard;
+      block = borrow_chunk(size, borrowed);
+      if (std::get<0>(block) != nullptr) {
+        shard = borrowed;
+        return block;
+      }
+      block = shards_[shard]->allocateRaw(size);
+    }
+    return block;
+  }
+
+  // Draining the pool is opportunistic here: if another thread is already
+  // doing it, there is no need to wait for that thread.
   void restore() const {
-    std::lock_guard<mutex_t> lk(resource_pool_mutex_);
+    std::unique_lock<mutex_t> lk(resource_pool_mutex_, std::try_to_lock);
+    if (!lk.owns_lock()) {
+      return;
+    }
     while (async_mem_pool()->ready()) {
       const auto block = async_mem_pool()->get();
-      void* ptr = std::get<0>(block);
-      int id = static_cast<int>(std::get<1>(block));
-      DIPU_DEBUG_ALLOCATOR(
-          8, "BFCachingAllocator: "
-                 << __FUNCTION__ << " ,ptr:" << ptr << " ,id:" << id
-                 << " ,allocator:" << this << ", device:" << device()
-                 << ", async_pool.size:" << async_mem_pool()->size());
-      impl->releaseRaw(ptr, id);
+      releaseChunkHandle(std::get<0>(block), std::get<1>(block));
     }
-    set_memory_reserved(impl->memory_reserved());
+    set_memory_reserved(reserved_bytes());
   }
 
   void empty_resource_pool() const {
     std::lock_guard<mutex_t> lk(resource_pool_mutex_);
     while (!async_mem_pool()->empty()) {
       if (!async_mem_pool()->ready()) {
-        std::this_thread::yield();
+        async_mem_pool()->wait_ready();
         continue;
       }
       const auto block = async_mem_pool()->get();
-      void* ptr = std::get<0>(block);
-      int id = static_cast<int>(std::get<1>(block));
-      DIPU_DEBUG_ALLOCATOR(
-          8, "BFCachingAllocator: " << __FUNCTION__ << " ,ptr:" << ptr
-                                    << " ,id:" << id << " ,allocator:" << this
-                                    << ", device:" << device());
-      impl->releaseRaw(ptr, id);
+      releaseChunkHandle(std::get<0>(block), std::get<1>(block));
     }
   }
 
@@ -462,22 +923,15 @@ class BFCachingAllocator : public CacheAllocator {
         return false;
       }
       const auto block = async_mem_pool()->get();
-      void* ptr = std::get<0>(block);
-      int id = static_cast<int>(std::get<1>(block));
-      DIPU_DEBUG_ALLOCATOR(
-          8, "BFCachingAllocator: " << __FUNCTION__ << " ,ptr:" << ptr
-                                    << " ,id:" << id << " ,allocator:" << this
-                                    << ", device:" << device());
-      impl->releaseRaw(ptr, id);
+      releaseChunkHandle(std::get<0>(block), std::get<1>(block));
     }
     return true;
   }
 
-  void check_impl() const {
-    if (impl) {
+  void init_shards() const {
+    if (!shards_.empty()) {
       return;
     }
-    impl = std::make_unique<BFCachingAllocatorImpl>();
 
     auto alloc_fn =
         // NOLINTNEXTLINE(cppcoreguidelines-pro-type-const-cast)
@@ -489,11 +943,21 @@ class BFCachingAllocator : public CacheAllocator {
         [pointer = const_cast<BFCachingAllocator*>(this)](void* PH1) {
           pointer->free_raw(PH1);
         };
-    impl->set_mem_allocate_fn(alloc_fn, dealloc_fn);
+    shards_.reserve(kNumStreamShards);
+    shard_streams_ =
+        std::make_unique<std::atomic<c10::StreamId>[]>(kNumStreamShards);
+    shard_usage_ = std::make_unique<ShardUsage[]>(kNumStreamShards);
+    for (size_t i = 0; i < kNumStreamShards; ++i) {
+      shard_streams_[i] = -1;
+      auto& shard =
+          shards_.emplace_back(std::make_unique<BFCachingAllocatorImpl>());
+      shard->set_mem_allocate_fn(alloc_fn, dealloc_fn);
+    }
   }
 
-  void* makeContext(void* ptr, size_t size, size_t nbytes, int id) const {
-    auto ctx = new Context(ptr, size, nbytes, id, this);
+  void* makeContext(void* ptr, size_t size, size_t nbytes, int id,
+                    size_t shard, c10::StreamId stream) const {
+    auto ctx = new Context(ptr, size, nbytes, id, shard, stream, this);
     return ctx;
   }
 
@@ -501,9 +965,15 @@ class BFCachingAllocator : public CacheAllocator {
   struct Context : public DataPtrContextBase {
     int id_ = 0;
     size_t nbytes_ = 0;
-    Context(void* ptr, size_t size, size_t nbytes, int id,
-            const BFCachingAllocator* allocator)
-        : DataPtrContextBase(allocator, ptr, size), id_(id), nbytes_(nbytes) {}
+    size_t shard_ = 0;
+    c10::StreamId stream_ = -1;
+    Context(void* ptr, size_t size, size_t nbytes, int id, size_t shard,
+            c10::StreamId stream, const BFCachingAllocator* allocator)
+        : DataPtrContextBase(allocator, ptr, size),
+          id_(id),
+          nbytes_(nbytes),
+          shard_(shard),
+          stream_(stream) {}
 
     ~Context() {
       auto allocator_ = static_cast<const BFCachingAllocator*>(allocator());
@@ -511,9 +981,15 @@ class BFCachingAllocator : public CacheAllocator {
                                   << ptr() << ", " << size() << " nbytes, id:"
                                   << id_ << ", allocator:" << allocator_
                                   << ", device:" << allocator_->device());
-      if (allocator_->impl) {
+      recordFree();
+      if (!allocator_->shards_.empty()) {
         if (ptr()) {
           allocator_->metrics_producer.deallocate(ptr());
+          allocator_->decrease_memory_allocated(nbytes_);
+          allocator_->shard_usage_[shard_].allocated -= nbytes_;
+          if (allocator_->cache_in_thread(*this)) {
+            return;
+          }
           std::deque<DIPUEvent> events;
           for (auto const& stream : streams()) {
             events.emplace_back();
@@ -521,10 +997,9 @@ class BFCachingAllocator : public CacheAllocator {
                                         << stream.rawstream());
             events.back().record(stream);
           }
-          allocator_->async_mem_pool()->add(std::make_tuple(ptr(), id_),
-                                            events);
-          allocator_->set_memory_allocated(allocator_->memory_allocated() -
-                                           nbytes_);
+          allocator_->async_mem_pool()->add(
+              std::make_tuple(ptr(), packChunkHandle(shard_, id_)), events,
+              nbytes_);
         }
         allocator_->restore();
       } else {
@@ -537,39 +1012,81 @@ class BFCachingAllocator : public CacheAllocator {
 
   friend class Context;
 
-  c10::DataPtr allocate(size_t size) const override {
-    restore();
-    if (async_mem_pool()->size() > kMaxAsyncResourcePoolLength) {
-      try_empty_resource_pool();
+  // A chunk is kept in the thread cache only if reusing it needs no event:
+  // either it was never used outside the default stream, or it was used on
+  // exactly one stream and will be handed out on that stream again.
+  bool cache_in_thread(Context& ctx) const {
+    if (ctx.nbytes_ > kMaxThreadCachedChunkSize) {
+      return false;
     }
+    auto& streams = ctx.streams();
+    c10::StreamId stream = -1;
+    if (streams.size() == 1 && streams.begin()->id() == ctx.stream_) {
+      stream = ctx.stream_;
+    } else if (!streams.empty()) {
+      return false;
+    }
+    return BFThreadChunkCache::local().put(
+        {this, ctx.ptr(), ctx.id_, ctx.shard_, ctx.nbytes_, stream});
+  }
+
+  c10::DataPtr allocate(size_t size) const override {
     size = getMemoryAlignmentStrategy()->roundBytes(size);
-    std::tuple<void*, int, size_t> block = impl->allocateRaw(size);
-    void* ptr = std::get<0>(block);
-    if (ptr == nullptr && size > 0) {
-      empty_resource_pool();
-      block = impl->allocateRaw(size);
-      ptr = std::get<0>(block);
+    const c10::StreamId stream = current_stream_id();
+    size_t shard = shard_of(stream);
+
+    std::tuple<void*, int, size_t> block{nullptr, 0, 0};
+    BFThreadChunkCache::Chunk cached;
+    if (size > 0 && size <= kMaxThreadCachedChunkSize &&
+        BFThreadChunkCache::local().take(
+            this, BFCachingAllocatorImpl::roundBytes(size), stream, cached)) {
+      shard = cached.shard;
+      block = std::make_tuple(cached.ptr, cached.id, cached.nbytes);
+    } else {
+      restore();
+      if (async_mem_pool()->size() > kMaxAsyncResourcePoolLength) {
+        try_empty_resource_pool();
+      }
+      if (shard_streams_[shard].load(std::memory_order_relaxed) != stream) {
+        shard_streams_[shard].store(stream, std::memory_order_relaxed);
+      }
+      block = allocate_in_shards(size, shard);
+      void* ptr = std::get<0>(block);
       if (ptr == nullptr && size > 0) {
-        empty_cache();
-        block = impl->allocateRaw(size);
+        // Before draining the thread cache, the reclaimed chunks may go there.
+        reclaim_stream_ordered_blocks();
+        BFThreadChunkCache::drainAll(this);
+        empty_resource_pool();
+        block = allocate_in_shards(size, shard);
         ptr = std::get<0>(block);
-        TORCH_CHECK(ptr != nullptr, "no memory available")
+        if (ptr == nullptr && size > 0) {
+          empty_cache();
+          block = shards_[shard]->allocateRaw(size);
+          ptr = std::get<0>(block);
+          TORCH_CHECK(ptr != nullptr, "no memory available")
+        }
       }
     }
 
+    void* ptr = std::get<0>(block);
     int id = std::get<1>(block);
     size_t nbytes = std::get<2>(block);
 
-    set_memory_allocated(memory_allocated() + nbytes);
-    set_memory_reserved(impl->memory_reserved());
+    increase_memory_allocated(nbytes);
+    shard_usage_[shard].allocated += nbytes;
+    set_memory_reserved(reserved_bytes());
     metrics_producer.allocate(ptr, size);
+    if (warming_up_.load(std::memory_order_relaxed)) {
+      record_warmup_allocation(shard);
+    }
 
-    c10::DataPtr data_ptr(ptr, makeContext(ptr, size, nbytes, id),
+    c10::DataPtr data_ptr(ptr,
+                          makeContext(ptr, size, nbytes, id, shard, stream),
                           deleteBFContext, device());
     DIPU_DEBUG_ALLOCATOR(
         4, "BFCachingAllocator: malloc "
                << nbytes << ",requires " << size << " nbytes, ptr:" << ptr
-               << ",device:" << device()
+               << ",shard:" << shard << ",device:" << device()
                << ",async_mempool.size:" << async_mem_pool()->size());
     c10::reportMemoryUsageToProfiler(
         ptr, static_cast<int64_t>(nbytes), memory_allocated(),
@@ -581,13 +1098,86 @@ class BFCachingAllocator : public CacheAllocator {
   void empty_cache() const override {
     DIPU_DEBUG_ALLOCATOR(8, "BFCachingAllocator: empty_cache, allocator:"
                                 << this << ", device:" << device());
-    empty_resource_pool();
-    impl->emptyCache();
-    set_memory_reserved(impl->memory_reserved());
+    flush_shards();
+    drop_arena();
+  }
+
+  // The first DIPU_BF_ITERATION_WARMUP iterations record the peak allocations
+  // of every stream shard. At the end of warm-up each shard reserves an arena
+  // as large as its largest per-iteration growth, so that steady-state
+  // iterations do not allocate device memory. The arenas are contiguous
+  // segments split best-fit like any other, hence no size-class layout.
+  void mark_iteration_boundary() const override {
+    if (kIterationWarmup == 0) {
+      return;
+    }
+    std::lock_guard<std::mutex> lk(iteration_mutex_);
+    auto& report = iteration_report_;
+    if (report.iterations > 0 && report.iterations <= kIterationWarmup) {
+      size_t peak = iteration_peak_.load();
+      report.peak_bytes = std::max(report.peak_bytes, peak);
+      report.transient_peak_bytes = std::max(
+          report.transient_peak_bytes,
+          peak > iteration_base_ ? peak - iteration_base_ : 0);
+      for (size_t i = 0; i < shards_.size(); ++i) {
+        auto& usage = shard_usage_[i];
+        size_t shard_peak = usage.peak.load();
+        usage.transient_peak =
+            std::max(usage.transient_peak,
+                     shard_peak > usage.base ? shard_peak - usage.base : 0);
+      }
+    }
+    ++report.iterations;
+    if (report.iterations == kIterationWarmup + 1) {
+      warming_up_ = false;
+      reserve_arena();
+    } else {
+      warming_up_ = report.iterations <= kIterationWarmup;
+    }
+    iteration_base_ = memory_allocated();
+    iteration_peak_ = iteration_base_;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      auto& usage = shard_usage_[i];
+      usage.base = usage.allocated.load();
+      usage.peak = usage.base;
+    }
+  }
+
+  IterationMemoryReport iteration_report() const override {
+    std::lock_guard<std::mutex> lk(iteration_mutex_);
+    IterationMemoryReport report = iteration_report_;
+    report.warmup_iterations = kIterationWarmup;
+    report.reserved_bytes = memory_reserved();
+    if (report.iterations > kIterationWarmup) {
+      report.device_allocations_after_warmup =
+          device_allocation_count() - device_allocations_at_warmup_end_;
+    }
+    return report;
+  }
+
+  // Chunks waiting in the async resource pool or in a thread cache are
+  // reported as pending free: the user has freed them, but the shards still
+  // count them as allocated.
+  std::vector<MemorySegmentInfo> snapshot() const override {
+    std::vector<ska::flat_hash_set<int>> pending(shards_.size());
+    for (const auto& block : async_mem_pool()->queued()) {
+      auto [shard, id] = unpackChunkHandle(std::get<1>(block));
+      pending[shard].insert(id);
+    }
+    BFThreadChunkCache::visitAll(
+        this, [&pending](const BFThreadChunkCache::Chunk& chunk) {
+          pending[chunk.shard].insert(chunk.id);
+        });
+    std::vector<MemorySegmentInfo> segments;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      shards_[i]->snapshot(segments, device().index(), shard_streams_[i].load(),
+                           pending[i]);
+    }
+    return segments;
   }
 
   void release_all_memory() const override {
-    if (!impl) {
+    if (shards_.empty()) {
       return;
     }
     DIPU_DEBUG_ALLOCATOR(8, "BFCachingAllocator: release_all_memory, allocator:"
@@ -595,7 +1185,7 @@ class BFCachingAllocator : public CacheAllocator {
     empty_cache();
   }
 
-  BFCachingAllocator() { check_impl(); }
+  BFCachingAllocator() { init_shards(); }
 
   ~BFCachingAllocator() override {
     DIPU_DEBUG_ALLOCATOR(8, "~BFCachingAllocator allocator:" << this);
@@ -603,6 +1193,22 @@ class BFCachingAllocator : public CacheAllocator {
   }
 };
 
+void BFThreadChunkCache::drain(const BFCachingAllocator* owner) {
+  for (auto& slot : slots_) {
+    int expected = kFull;
+    if (!slot.state.compare_exchange_strong(expected, kBusy,
+                                            std::memory_order_acquire)) {
+      continue;
+    }
+    if (owner == nullptr || slot.chunk.owner == owner) {
+      slot.chunk.owner->releaseCachedChunk(slot.chunk);
+      slot.state.store(kEmpty, std::memory_order_release);
+    } else {
+      slot.state.store(kFull, std::memory_order_release);
+    }
+  }
+}
+
 static void deleteBFContext(void* ptr) {
   auto ctx = static_cast<BFCachingAllocator::Context*>(ptr);
   c10::reportMemoryUsageToProfiler(
@@ -1,23 +1,250 @@
 // Copyright (c) 2023, DeepLink.
 
+#include <algorithm>
 #include <cstdint>
 #include <deque>
 #include <list>
 #include <map>
 #include <mutex>
-#include <set>
 #include <unordered_map>
+#include <vector>
+
+#include "csrc_dipu/base/environ.hpp"
 
 #include "DIPUCachingAllocator.h"
 
 namespace dipu {
 
+// Rounded up to whole slots, so that a segment holds at least one slot of
+// the largest size class.
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+const size_t kSlabMaxBlockSize =
+    (static_cast<size_t>(std::max<int64_t>(environ::bsSlabMaxSize(), 0)) +
+     kDefaultMermoryAlignment - 1) /
+    kDefaultMermoryAlignment * kDefaultMermoryAlignment;
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+const size_t kSlabSegmentSize = std::max<size_t>(
+    static_cast<size_t>(std::max<int64_t>(environ::bsSlabSegmentSize(), 0)),
+    kSlabMaxBlockSize);
+
 static void deleteBSContext(void* ptr);
 
+// Size-class allocator for small blocks. Every size class owns segments which
+// are split into equally sized slots, and free slots are tracked by one bit
+// each. All metadata lives in flat vectors, so once a segment exists neither
+// allocation nor free touches the host heap.
+//
+// A slot is identified by a handle: the segment index in the upper half and
+// the slot index in the lower half, tagged with kHandleFlag so that it can be
+// told apart from a plain block size.
+//
+// Not thread safe, guarded by the lock of BSCachingAllocator.
+class BSSlabPool {
+  static constexpr size_t kGranularity = kDefaultMermoryAlignment;
+  static constexpr size_t kBitsPerWord = 64;
+  static constexpr uint64_t kHandleFlag = uint64_t{1} << 63U;
+  static constexpr uint64_t kSlotMask = 0xFFFFFFFFU;
+
+  struct Segment {
+    char* base = nullptr;
+    size_t slot_size = 0;
+    uint32_t size_class = 0;
+    uint32_t num_slots = 0;
+    uint32_t free_slots = 0;
+    // No free slot is recorded in the bitmap words before this one.
+    uint32_t first_free_word = 0;
+    // Whether the segment is in available_[size_class].
+    bool listed = false;
+  };
+
+  size_t words_per_segment_ = 0;
+  std::vector<Segment> segments_;
+  // Free-slot bitmaps of all segments, words_per_segment_ words each.
+  std::vector<uint64_t> bitmaps_;
+  // Per size class, the segments which may have a free slot.
+  std::vector<std::vector<uint32_t>> available_;
+  // Indices of released segments which can be reused.
+  std::vector<uint32_t> unused_segments_;
+
+  static size_t size_class(size_t nbytes) {
+    return (nbytes - 1) / kGranularity;
+  }
+
+  static size_t slot_size(size_t nbytes) {
+    return (size_class(nbytes) + 1) * kGranularity;
+  }
+
+  uint64_t* bitmap(size_t index) {
+    return bitmaps_.data() + index * words_per_segment_;
+  }
+
+ public:
+  BSSlabPool()
+      : words_per_segment_(
+            (kSlabSegmentSize / kGranularity + kBitsPerWord - 1) /
+            kBitsPerWord),
+        available_((kSlabMaxBlockSize + kGranularity - 1) / kGranularity) {}
+
+  static bool serves(size_t nbytes) {
+    return nbytes > 0 && nbytes <= kSlabMaxBlockSize;
+  }
+
+  static bool is_handle(size_t value) { return (value & kHandleFlag) != 0; }
+
+  // Bytes of a new segment for blocks of nbytes, at least one slot.
+  static size_t segment_size(size_t nbytes) {
+    size_t slot = slot_size(nbytes);
+    return std::max(kSlabSegmentSize / slot, size_t{1}) * slot;
+  }
+
+  static uint32_t num_slots(size_t nbytes) {
+    return static_cast<uint32_t>(segment_size(nbytes) / slot_size(nbytes));
+  }
+
+  // Takes a free slot for blocks of nbytes, or returns nullptr if all segments
+  // of this size class are full.
+  void* allocate(size_t nbytes, size_t& handle) {
+    auto& available = available_[size_class(nbytes)];
+    while (!available.empty()) {
+      uint32_t index = available.back();
+      auto& segment = segments_[index];
+      if (segment.free_slots == 0) {
+        segment.listed = false;
+        available.pop_back();
+        continue;
+      }
+      uint64_t* words = bitmap(index);
+      uint32_t word = segment.first_free_word;
+      while (words[word] == 0) {
+        ++word;
+      }
+      uint32_t bit = __builtin_ctzll(words[word]);
+      words[word] &= words[word] - 1;
+      segment.first_free_word = word;
+      --segment.free_slots;
+      uint64_t slot = word * kBitsPerWord + bit;
+      handle = kHandleFlag | (uint64_t{index} << 32U) | slot;
+      return segment.base + slot * segment.slot_size;
+    }
+    return nullptr;
+  }
+
+  void free(size_t handle) {
+    auto index = static_cast<uint32_t>((handle & ~kHandleFlag) >> 32U);
+    auto slot = static_cast<uint32_t>(handle & kSlotMask);
+    auto& segment = segments_[index];
+    uint32_t word = slot / kBitsPerWord;
+    bitmap(index)[word] |= uint64_t{1} << (slot % kBitsPerWord);
+    segment.first_free_word = std::min(segment.first_free_word, word);
+    ++segment.free_slots;
+    if (!segment.listed) {
+      segment.listed = true;
+      available_[segment.size_class].push_back(index);
+    }
+  }
+
+  // Adds a segment of segment_size(nbytes) bytes at base, all slots free.
+  void add_segment(size_t nbytes, void* base) {
+    uint32_t index = 0;
+    if (unused_segments_.empty()) {
+      index = static_cast<uint32_t>(segments_.size());
+      segments_.emplace_back();
+      bitmaps_.resize(bitmaps_.size() + words_per_segment_);
+    } else {
+      index = unused_segments_.back();
+      unused_segments_.pop_back();
+    }
+    auto& segment = segments_[index];
+    segment.base = static_cast<char*>(base);
+    segment.slot_size = slot_size(nbytes);
+    segment.size_class = static_cast<uint32_t>(size_class(nbytes));
+    segment.num_slots = num_slots(nbytes);
+    segment.free_slots = segment.num_slots;
+    segment.first_free_word = 0;
+    segment.listed = true;
+    uint64_t* words = bitmap(index);
+    std::fill(words, words + words_per_segment_, 0);
+    for (uint32_t slot = 0; slot < segment.num_slots; slot += kBitsPerWord) {
+      uint32_t count =
+          std::min<uint32_t>(segment.num_slots - slot, kBitsPerWord);
+      words[slot / kBitsPerWord] =
+          count == kBitsPerWord ? ~uint64_t{0} : (uint64_t{1} << count) - 1;
+    }
+    available_[segment.size_class].push_back(index);
+  }
+
+  // Appends one segment per slab segment. Runs of free slots are merged into
+  // one block, live slots whose pointer is in `pending` are reported as freed
+  // but not yet reusable.
+  void snapshot(std::vector<MemorySegmentInfo>& segments,
+                c10::DeviceIndex device,
+                const ska::flat_hash_set<void*>& pending) const {
+    using State = MemoryBlockInfo::State;
+    for (uint32_t index = 0; index < segments_.size(); ++index) {
+      const auto& slab = segments_[index];
+      if (slab.base == nullptr) {
+        continue;
+      }
+      const uint64_t* words = bitmaps_.data() + index * words_per_segment_;
+      auto& segment = segments.emplace_back();
+      segment.device = device;
+      segment.address = reinterpret_cast<size_t>(slab.base);
+      segment.total_size = static_cast<size_t>(slab.num_slots) * slab.slot_size;
+      segment.is_large = false;
+      for (uint32_t slot = 0; slot < slab.num_slots; ++slot) {
+        char* ptr = slab.base + slot * slab.slot_size;
+        bool is_free =
+            (words[slot / kBitsPerWord] >> (slot % kBitsPerWord)) & 1U;
+        State state = is_free              ? State::kFree
+                      : pending.count(ptr) ? State::kPendingFree
+                                           : State::kAllocated;
+        auto& blocks = segment.blocks;
+        if (state == State::kFree && !blocks.empty() &&
+            blocks.back().state == State::kFree) {
+          blocks.back().size += slab.slot_size;
+          blocks.back().requested_size += slab.slot_size;
+          continue;
+        }
+        blocks.push_back({reinterpret_cast<size_t>(ptr), slab.slot_size,
+                          slab.slot_size, state});
+      }
+    }
+  }
+
+  // Calls release(base, nbytes) for every segment without live slots and
+  // forgets about it.
+  template <typename ReleaseFn>
+  void release_free_segments(const ReleaseFn& release) {
+    for (auto& available : available_) {
+      available.clear();
+    }
+    for (uint32_t index = 0; index < segments_.size(); ++index) {
+      auto& segment = segments_[index];
+      if (segment.base == nullptr) {
+        continue;
+      }
+      if (segment.free_slots == segment.num_slots) {
+        release(segment.base,
+                static_cast<size_t>(segment.num_slots) * segment.slot_size);
+        segment = Segment{};
+        unused_segments_.push_back(index);
+        continue;
+      }
+      segment.listed = segment.free_slots > 0;
+      if (segment.listed) {
+        available_[segment.size_class].push_back(index);
+      }
+    }
+  }
+};
+
 class BSCachingAllocator : public CacheAllocator {
   struct Impl {
     std::unordered_map<size_t, std::list<void*>> idel_blocks_;
-    std::set<void*> allocated_;
+    // Size of every block obtained from the raw allocator.
+    std::map<void*, size_t> allocated_;
+    BSSlabPool slab_;
     size_t total_alocated_bytes_ = 0;
     size_t total_idel_bytes_ = 0;
   };
@@ -81,6 +308,9 @@ class BSCachingAllocator : public CacheAllocator {
     std::lock_guard<mutex_t> lk(mutex_);
     flush_mem_pool();
     size_t nbytes = getAllocateSize(size);
+    if (BSSlabPool::serves(nbytes)) {
+      return allocate_slab(size, nbytes);
+    }
     void* ptr = nullptr;
     auto& idel_blocks = impl->idel_blocks_[nbytes];
     if (idel_blocks.empty() ||
@@ -105,7 +335,7 @@ class BSCachingAllocator : public CacheAllocator {
         data_ptr.release_context();
         set_memory_reserved(memory_reserved() + nbytes);
 
-        impl->allocated_.insert(ptr);
+        impl->allocated_.emplace(ptr, nbytes);
         impl->total_alocated_bytes_ += nbytes;
         DIPU_DEBUG_ALLOCATOR(4, "BSCachingAllocator::allocate "
                                     << nbytes << ", requires:" << size
@@ -114,12 +344,58 @@ class BSCachingAllocator : public CacheAllocator {
         break;
       } catch (...) {
         TORCH_CHECK(i == 0, "no memory available");
+        reclaim_stream_ordered_blocks();
         empty_cache();
       }
     }
+    return make_data_ptr(ptr, size, nbytes, 0);
+  }
+
+  c10::DataPtr allocate_slab(size_t size, size_t nbytes) const {
+    auto& slab = impl->slab_;
+    if (async_mem_pool()->size() > kMaxAsyncResourcePoolLength) {
+      empty_resource_pool();
+    }
+    size_t handle = 0;
+    void* ptr = slab.allocate(nbytes, handle);
+    if (ptr == nullptr && !async_mem_pool()->empty()) {
+      empty_resource_pool();
+      ptr = slab.allocate(nbytes, handle);
+    }
+    // A segment without slots would never satisfy the loop below.
+    TORCH_CHECK(ptr != nullptr || BSSlabPool::num_slots(nbytes) > 0,
+                "slab segment for blocks of ", nbytes, " bytes has no slot");
+    for (size_t i = 0; ptr == nullptr; i++) {
+      size_t segment_size = BSSlabPool::segment_size(nbytes);
+      try {
+        auto data_ptr = raw_allocator()->allocate(segment_size);
+        device() = data_ptr.device();
+        slab.add_segment(nbytes, data_ptr.get());
+        data_ptr.release_context();
+        set_memory_reserved(memory_reserved() + segment_size);
+        impl->total_alocated_bytes_ += segment_size;
+        DIPU_DEBUG_ALLOCATOR(4, "BSCachingAllocator::allocate slab segment "
+                                    << segment_size << " bytes for blocks of "
+                                    << nbytes << ",allocator:" << this);
+      } catch (...) {
+        TORCH_CHECK(i == 0, "no memory available");
+        reclaim_stream_ordered_blocks();
+        empty_cache();
+      }
+      ptr = slab.allocate(nbytes, handle);
+    }
+    DIPU_DEBUG_ALLOCATOR(4, "BSCachingAllocator::allocate slab slot "
+                                << nbytes << ", requires:" << size
+                                << " bytes, ptr:" << ptr
+                                << ",allocator:" << this);
+    return make_data_ptr(ptr, size, nbytes, handle);
+  }
+
+  c10::DataPtr make_data_ptr(void* ptr, size_t size, size_t nbytes,
+                             size_t slab_handle) const {
     set_memory_allocated(memory_allocated() + nbytes);
-    c10::DataPtr data_ptr(ptr, makeContext(ptr, size, nbytes), deleteBSContext,
-                          device());
+    c10::DataPtr data_ptr(ptr, makeContext(ptr, size, nbytes, slab_handle),
+                          deleteBSContext, device());
     c10::reportMemoryUsageToProfiler(
         ptr, static_cast<int64_t>(nbytes), memory_allocated(),
         memory_reserved(),
@@ -127,9 +403,16 @@ class BSCachingAllocator : public CacheAllocator {
     return data_ptr;
   }
 
+  // size is either the requested size of a block or the handle of a slab slot.
   void restore(size_t size, void* ptr) const {
-    size_t nbytes = getAllocateSize(size);
     std::lock_guard<mutex_t> lk(mutex_);
+    if (BSSlabPool::is_handle(size)) {
+      DIPU_DEBUG_ALLOCATOR(8, "BSCachingAllocator::restore slab slot, ptr:"
+                                  << ptr << ",allocator:" << this);
+      impl->slab_.free(size);
+      return;
+    }
+    size_t nbytes = getAllocateSize(size);
     DIPU_DEBUG_ALLOCATOR(8, "BSCachingAllocator::restore "
                                 << nbytes << " bytes, ptr:" << ptr
                                 << ",allocator:" << this);
@@ -145,7 +428,7 @@ class BSCachingAllocator : public CacheAllocator {
       if (async_mem_pool()->ready()) {
         flush_mem_pool();
       } else {
-        std::this_thread::yield();
+        async_mem_pool()->wait_ready();
       }
     }
   }
@@ -168,6 +451,11 @@ class BSCachingAllocator : public CacheAllocator {
         raw_allocator()->raw_deallocate(ptr);
       }
     }
+    impl->slab_.release_free_segments([this](void* base, size_t size) {
+      impl->total_alocated_bytes_ -= size;
+      set_memory_reserved(memory_reserved() - size);
+      raw_allocator()->raw_deallocate(base);
+    });
   }
 
   void empty_cache() const override { empty_cache_impl(); }
@@ -180,6 +468,34 @@ class BSCachingAllocator : public CacheAllocator {
 
   void release_all_memory() const override { release_all_memory_impl(); }
 
+  // Every block which is not a slab slot is a segment of its own.
+  std::vector<MemorySegmentInfo> snapshot() const override {
+    using State = MemoryBlockInfo::State;
+    std::lock_guard<mutex_t> lk(mutex_);
+    ska::flat_hash_set<void*> pending;
+    for (const auto& block : async_mem_pool()->queued()) {
+      pending.insert(std::get<0>(block));
+    }
+    ska::flat_hash_set<void*> idle;
+    for (const auto& [size, blocks] : impl->idel_blocks_) {
+      idle.insert(blocks.begin(), blocks.end());
+    }
+    std::vector<MemorySegmentInfo> segments;
+    for (const auto& [ptr, nbytes] : impl->allocated_) {
+      State state = idle.count(ptr)      ? State::kFree
+                    : pending.count(ptr) ? State::kPendingFree
+                                         : State::kAllocated;
+      auto& segment = segments.emplace_back();
+      segment.device = device().index();
+      segment.address = reinterpret_cast<size_t>(ptr);
+      segment.total_size = nbytes;
+      segment.blocks.push_back(
+          {reinterpret_cast<size_t>(ptr), nbytes, nbytes, state});
+    }
+    impl->slab_.snapshot(segments, device().index(), pending);
+    return segments;
+  }
+
   void flush_mem_pool() const {
     std::lock_guard<mutex_t> lk(mutex_);
     DIPU_DEBUG_ALLOCATOR(
@@ -191,15 +507,18 @@ class BSCachingAllocator : public CacheAllocator {
   }
 
   struct Context : public DataPtrContextBase {
-    Context(void* ptr, size_t size, size_t real_size,
+    Context(void* ptr, size_t size, size_t real_size, size_t slab_handle,
             const BSCachingAllocator* allocator)
-        : DataPtrContextBase(allocator, ptr, size), real_size_(real_size) {}
+        : DataPtrContextBase(allocator, ptr, size),
+          real_size_(real_size),
+          slab_handle_(slab_handle) {}
 
     ~Context() {
       auto allocator_ = static_cast<const BSCachingAllocator*>(allocator());
       DIPU_DEBUG_ALLOCATOR(8, __FUNCTION__ << " allocator:" << allocator_
                                            << ", ptr:" << ptr()
                                            << ", size_:" << size());
+      recordFree();
       if (allocator_->impl) {
         std::deque<DIPUEvent> events;
         for (const auto& item : streams()) {
@@ -207,18 +526,22 @@ class BSCachingAllocator : public CacheAllocator {
           events.back().record(item);
         }
 
-        allocator_->async_mem_pool()->add(std::make_tuple(ptr(), size()),
-                                          events);
+        // Slab slots are given back by handle, see restore().
+        allocator_->async_mem_pool()->add(
+            std::make_tuple(ptr(), slab_handle_ != 0 ? slab_handle_ : size()),
+            events, real_size_);
         allocator_->set_memory_allocated(allocator_->memory_allocated() -
                                          real_size_);
         allocator_->flush_mem_pool();
       }
     }
     size_t real_size_ = 0;
+    size_t slab_handle_ = 0;
   };
 
-  void* makeContext(void* ptr, size_t size, size_t real_size) const {
-    auto ctx = new Context(ptr, size, real_size, this);
+  void* makeContext(void* ptr, size_t size, size_t real_size,
+                    size_t slab_handle) const {
+    auto ctx = new Context(ptr, size, real_size, slab_handle, this);
     return ctx;
   }
 };
@@ -3,17 +3,22 @@
 #include "DIPUCachingAllocator.h"
 
 #include <map>
+#include <mutex>
 #include <set>
+#include <string>
 #include <tuple>
+#include <utility>
 #include <vector>
 
 #include <c10/core/Device.h>
 #include <c10/core/DeviceType.h>
 #include <c10/util/Exception.h>
+#include <c10/util/flat_hash_map.h>
 
 #include "csrc_dipu/base/basedef.h"
 #include "csrc_dipu/base/environ.hpp"
 #include "csrc_dipu/runtime/core/DIPUEvent.h"
+#include "csrc_dipu/runtime/core/DIPUGuard.h"
 #include "csrc_dipu/runtime/devproxy/deviceproxy.h"
 #include "csrc_dipu/utils/env.hpp"
 
@@ -99,6 +104,50 @@ void setAllocator(const std::string& name, c10::DeviceType device_type,
 
 namespace {
 
+auto& standaloneAllocatorFactories() {
+  // Using * to avoid being destructed.
+  static auto* factories = new std::map<
+      std::string, allocator_details::StandaloneCacheAllocatorFactory>();
+  return *factories;
+}
+
+}  // namespace
+
+void allocator_details::registerStandaloneCacheAllocator(
+    const std::string& name, const StandaloneCacheAllocatorFactory& factory) {
+  std::lock_guard<std::mutex> lock(dipu_register_allocator_mutex);
+  // The same algorithm is registered for both device and host, any of them
+  // works as a standalone allocator.
+  standaloneAllocatorFactories().emplace(name, factory);
+}
+
+StandaloneCacheAllocator createStandaloneCacheAllocator(
+    const std::string& name, c10::Allocator* raw_allocator) {
+  StandaloneCacheAllocator result;
+  {
+    std::lock_guard<std::mutex> lock(dipu_register_allocator_mutex);
+    auto iter = standaloneAllocatorFactories().find(name);
+    if (iter == standaloneAllocatorFactories().end()) {
+      return result;
+    }
+    result = iter->second();
+  }
+  result.allocator->set_raw_allocator(raw_allocator);
+  result.allocator->set_async_mem_pool(result.async_mem_pool.get());
+  return result;
+}
+
+std::vector<std::string> standaloneCacheAllocatorNames() {
+  std::lock_guard<std::mutex> lock(dipu_register_allocator_mutex);
+  std::vector<std::string> names;
+  for (auto& item : standaloneAllocatorFactories()) {
+    names.push_back(item.first);
+  }
+  return names;
+}
+
+namespace {
+
 int getDeviceIndex(const c10::Device& device, int host_index) {
   if (device.is_cpu()) {
     return host_index;
@@ -135,6 +184,81 @@ c10::Allocator* createAllocator(const c10::Device& device) {
 
 }  // namespace
 
+namespace {
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+thread_local MemoryPoolId current_memory_pool = kDefaultMemoryPool;
+
+// Each private pool of the dipu caching allocators is a standalone allocator
+// of the configured algorithm, created on first use.
+class PrivatePoolAllocators {
+  std::mutex mutex_;
+  DIPURawDeviceAllocator raw_allocator_;
+  std::map<std::pair<int, MemoryPoolId>, StandaloneCacheAllocator> pools_;
+
+ public:
+  static PrivatePoolAllocators& instance() {
+    // Using * to avoid being destructed.
+    static auto* pools = new PrivatePoolAllocators();
+    return *pools;
+  }
+
+  CacheAllocator* get(int device_index, MemoryPoolId pool, bool create) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = pools_.find({device_index, pool});
+    if (iter != pools_.end()) {
+      return iter->second.allocator.get();
+    }
+    if (!create) {
+      return nullptr;
+    }
+    // The raw allocator allocates on the current device.
+    DIPUGuard guard(static_cast<c10::DeviceIndex>(device_index));
+    auto standalone = createStandaloneCacheAllocator(
+        environ::deviceMemCachingAlgorithm(), &raw_allocator_);
+    TORCH_CHECK(standalone.allocator, "memory pools are not supported by ",
+                environ::deviceMemCachingAlgorithm());
+    auto* allocator = standalone.allocator.get();
+    pools_.emplace(std::make_pair(device_index, pool), std::move(standalone));
+    {
+      std::lock_guard<std::mutex> lk(dipu_register_allocator_mutex);
+      used_allocator.insert(allocator);
+    }
+    return allocator;
+  }
+};
+
+c10::Allocator* getPrivatePoolAllocator(int device_index, MemoryPoolId pool) {
+  // Scopes usually allocate many times from the same pool.
+  thread_local std::tuple<int, MemoryPoolId, c10::Allocator*> last{-1, 0,
+                                                                    nullptr};
+  auto& [last_device, last_pool, last_allocator] = last;
+  if (last_device != device_index || last_pool != pool) {
+    last_allocator =
+        PrivatePoolAllocators::instance().get(device_index, pool, true);
+    last_device = device_index;
+    last_pool = pool;
+  }
+  return last_allocator;
+}
+
+}  // namespace
+
+MemoryPoolId getMemoryPool(const std::string& name) {
+  static std::mutex mutex;
+  // Using * to avoid being destructed.
+  static auto* ids = new std::map<std::string, MemoryPoolId>();
+  std::lock_guard<std::mutex> lock(mutex);
+  return ids->emplace(name, static_cast<MemoryPoolId>(ids->size() + 1))
+      .first->second;
+}
+
+MemoryPoolId currentMemoryPool() { return current_memory_pool; }
+
+MemoryPoolId setCurrentMemoryPool(MemoryPoolId pool) {
+  return std::exchange(current_memory_pool, pool);
+}
+
 bool isTorchAllocator() {
   static bool is_torch_allocator =
       (environ::deviceMemCachingAlgorithm() == environ::kTorchAllocatorName);
@@ -155,6 +279,9 @@ c10::Allocator* getAllocator(const c10::Device& device) {
   static const int host_index = device_count;
   static std::vector<c10::Allocator*> allocator_lookup_table(device_count + 1);
   int device_index = getDeviceIndex(device, host_index);
+  if (!device.is_cpu() && current_memory_pool != kDefaultMemoryPool) {
+    return getPrivatePoolAllocator(device_index, current_memory_pool);
+  }
   auto& allocator = allocator_lookup_table[device_index];
   if (allocator == nullptr) {
     allocator = createAllocator(device);
@@ -166,6 +293,141 @@ c10::Allocator* getAllocator(c10::DeviceType device_type) {
   return getAllocator(c10::Device(device_type));
 }
 
+namespace {
+
+// Memory of the dipu caching allocators handed out by mallocAsync(). Blocks
+// given back by freeAsync() are kept per allocator and stream, and are only
+// returned to their allocator by emptyCachedMem() or when any allocation of
+// the allocator runs out of memory (see reclaim_stream_ordered_blocks). They
+// then wait for the stream they were freed on like any block recorded on that
+// stream.
+class StreamOrderedBlocks {
+  struct Block {
+    c10::DataPtr data_ptr;
+    size_t size = 0;
+    c10::Allocator* allocator = nullptr;
+  };
+  using FreeListKey = std::pair<c10::Allocator*, c10::StreamId>;
+
+  std::mutex mutex_;
+  ska::flat_hash_map<void*, Block> live_;
+  std::map<FreeListKey, std::multimap<size_t, Block>> free_;
+
+  // A cached block is handed out for at most twice its size.
+  static constexpr size_t kMaxOversize = 2;
+
+  bool take(c10::Allocator* allocator, size_t size, const DIPUStream& stream,
+            void*& ptr) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    auto list = free_.find({allocator, stream.id()});
+    if (list == free_.end()) {
+      return false;
+    }
+    auto iter = list->second.lower_bound(size);
+    if (iter == list->second.end() || iter->first > size * kMaxOversize) {
+      return false;
+    }
+    ptr = iter->second.data_ptr.get();
+    live_.emplace(ptr, std::move(iter->second));
+    list->second.erase(iter);
+    return true;
+  }
+
+  // Blocks are dropped outside the lock, their deleters may take allocator
+  // locks.
+  std::vector<Block> extract(const c10::Allocator* allocator) {
+    std::vector<Block> blocks;
+    std::lock_guard<std::mutex> lk(mutex_);
+    for (auto list = free_.begin(); list != free_.end();) {
+      if (allocator != nullptr && list->first.first != allocator) {
+        ++list;
+        continue;
+      }
+      for (auto& [size, block] : list->second) {
+        blocks.push_back(std::move(block));
+      }
+      list = free_.erase(list);
+    }
+    return blocks;
+  }
+
+ public:
+  static StreamOrderedBlocks& instance() {
+    // Using * to avoid being destructed.
+    static auto* blocks = new StreamOrderedBlocks();
+    return *blocks;
+  }
+
+  // Must be called with `stream` as the current stream.
+  void* allocate(c10::Allocator* allocator, size_t size,
+                 const DIPUStream& stream) {
+    size = getMemoryAlignmentStrategy()->roundBytes(size);
+    void* ptr = nullptr;
+    if (take(allocator, size, stream, ptr)) {
+      return ptr;
+    }
+    c10::DataPtr data_ptr = allocator->allocate(size);
+    ptr = data_ptr.get();
+    std::lock_guard<std::mutex> lk(mutex_);
+    live_.emplace(ptr, Block{std::move(data_ptr), size, allocator});
+    return ptr;
+  }
+
+  void free(void* ptr, const DIPUStream& stream) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    auto iter = live_.find(ptr);
+    TORCH_CHECK(iter != live_.end(), "pointer ", ptr,
+                " was not allocated by mallocAsync");
+    auto block = std::move(iter->second);
+    live_.erase(iter);
+    // Whoever gets the block from the allocator later waits for `stream`.
+    // Work on the default stream is ordered before any later allocation
+    // anyway, see DataPtrContextBase.
+    if (stream != getDefaultDIPUStream(stream.device_index())) {
+      using pointer = CacheAllocator::DataPtrContextBase*;
+      if (auto ctx = static_cast<pointer>(block.data_ptr.get_context())) {
+        ctx->streams().insert(stream);
+      }
+    }
+    auto& list = free_[{block.allocator, stream.id()}];
+    list.emplace(block.size, std::move(block));
+  }
+
+  // Returns the cached blocks of `allocator`, or of all allocators if it is
+  // nullptr.
+  void release(const c10::Allocator* allocator) { extract(allocator); }
+};
+
+}  // namespace
+
+void CacheAllocator::reclaim_stream_ordered_blocks() const {
+  StreamOrderedBlocks::instance().release(this);
+}
+
+void* mallocAsync(size_t size, const DIPUStream& stream) {
+  if (size == 0) {
+    return nullptr;
+  }
+  // The allocators allocate on the current device and stream.
+  DIPUStreamGuard guard(stream.unwrap());
+  if (isTorchAllocator()) {
+    return allocator::raw_alloc_with_stream(size, stream.rawstream());
+  }
+  return StreamOrderedBlocks::instance().allocate(
+      getAllocator(stream.device()), size, stream);
+}
+
+void freeAsync(void* ptr, const DIPUStream& stream) {
+  if (ptr == nullptr) {
+    return;
+  }
+  if (isTorchAllocator()) {
+    allocator::raw_delete_with_stream(ptr, stream);
+    return;
+  }
+  StreamOrderedBlocks::instance().free(ptr, stream);
+}
+
 void emptyCachedMem() {
   if (isTorchAllocator()) {
     allocator::emptyCache();
@@ -183,6 +445,7 @@ void emptyCachedMem() {
       cached_allocator->empty_cache();
     }
   };
+  StreamOrderedBlocks::instance().release(nullptr);
   for (auto& allocator : used_allocator) {
     empty_allocator_cache(allocator);
   }
@@ -204,6 +467,7 @@ void releaseAllDeviceMem() {
       cached_allocator->release_all_memory();
     }
   };
+  StreamOrderedBlocks::instance().release(nullptr);
   for (auto& allocator : used_allocator) {
     release_allocator_memory(allocator);
   }
@@ -295,6 +559,104 @@ void resetPeakStats(const c10::Device& device) {
   }
 }
 
+MemoryPoolStats memoryPoolStats(const c10::Device& device, MemoryPoolId pool) {
+  TORCH_CHECK(!device.is_cpu(), "memory pools are only for device memory");
+  int device_index = getDeviceIndex(device, 0);
+  if (isTorchAllocator()) {
+    return allocator::getPoolStats(device_index, pool);
+  }
+  MemoryPoolStats stats;
+  if (auto* cached_allocator =
+          PrivatePoolAllocators::instance().get(device_index, pool, false)) {
+    stats.allocated_bytes = cached_allocator->memory_allocated();
+    stats.reserved_bytes = cached_allocator->memory_reserved();
+    stats.max_allocated_bytes = cached_allocator->max_memory_allocated();
+    stats.max_reserved_bytes = cached_allocator->max_memory_reserved();
+  }
+  return stats;
+}
+
+void releaseMemoryPool(const c10::Device& device, MemoryPoolId pool) {
+  TORCH_CHECK(!device.is_cpu(), "memory pools are only for device memory");
+  int device_index = getDeviceIndex(device, 0);
+  if (isTorchAllocator()) {
+    allocator::releasePool(device_index, pool);
+    return;
+  }
+  if (auto* cached_allocator =
+          PrivatePoolAllocators::instance().get(device_index, pool, false)) {
+    StreamOrderedBlocks::instance().release(cached_allocator);
+    cached_allocator->release_all_memory();
+  }
+}
+
+void markIterationBoundary(const c10::Device& device) {
+  if (isTorchAllocator()) {
+    return;
+  }
+  auto cached_allocator = dynamic_cast<CacheAllocator*>(getAllocator(device));
+  if (cached_allocator != nullptr) {
+    cached_allocator->mark_iteration_boundary();
+  }
+}
+
+IterationMemoryReport iterationMemoryReport(const c10::Device& device) {
+  if (!isTorchAllocator()) {
+    auto cached_allocator =
+        dynamic_cast<CacheAllocator*>(getAllocator(device));
+    if (cached_allocator != nullptr) {
+      return cached_allocator->iteration_report();
+    }
+  }
+  IterationMemoryReport report;
+  report.reserved_bytes = memoryReserved(device);
+  return report;
+}
+
+namespace {
+
+std::vector<MemorySegmentInfo> torchAllocatorSnapshot(
+    const c10::Device& device) {
+  using State = MemoryBlockInfo::State;
+  std::vector<MemorySegmentInfo> segments;
+  for (const auto& info : allocator::snapshot().segments) {
+    if (info.device != device.index()) {
+      continue;
+    }
+    auto& segment = segments.emplace_back();
+    segment.device = static_cast<c10::DeviceIndex>(info.device);
+    segment.address = static_cast<size_t>(info.address);
+    segment.total_size = static_cast<size_t>(info.total_size);
+    // Streams not known to DIPU are identified by their raw pointer.
+    segment.stream = reinterpret_cast<c10::StreamId>(info.stream);
+    segment.is_large = info.is_large;
+    size_t address = segment.address;
+    for (const auto& block : info.blocks) {
+      State state = block.allocated ? State::kAllocated
+                    : block.active  ? State::kPendingFree
+                                    : State::kFree;
+      segment.blocks.push_back({address, static_cast<size_t>(block.size),
+                                static_cast<size_t>(block.requested_size),
+                                state});
+      address += static_cast<size_t>(block.size);
+    }
+  }
+  return segments;
+}
+
+}  // namespace
+
+std::vector<MemorySegmentInfo> memorySnapshot(const c10::Device& device) {
+  if (!device.is_cpu() && isTorchAllocator()) {
+    return torchAllocatorSnapshot(device);
+  }
+  auto cached_allocator = dynamic_cast<CacheAllocator*>(getAllocator(device));
+  if (cached_allocator != nullptr) {
+    return cached_allocator->snapshot();
+  }
+  return {};
+}
+
 void recordStream(const c10::DataPtr& ptr, const DIPUStream& stream) {
   if (isTorchAllocator()) {
     allocator::recordStream(ptr, stream);
@@ -304,6 +666,10 @@ void recordStream(const c10::DataPtr& ptr, const DIPUStream& stream) {
   using pointer = CacheAllocator::DataPtrContextBase*;
   if (auto ctx = static_cast<pointer>(ptr.get_context())) {
     ctx->streams().insert(stream);
+    if (AllocatorTraceRecorder::enabled()) {
+      AllocatorTraceRecorder::instance().onRecordStream(
+          ctx->ptr(), ctx->allocator()->device().index(), stream.id());
+    }
   }
 }
 
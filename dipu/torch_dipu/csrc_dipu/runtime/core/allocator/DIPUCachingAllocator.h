@@ -1,13 +1,22 @@
 // Copyright (c) 2023, DeepLink.
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include <c10/core/Allocator.h>
 #include <c10/core/Device.h>
-#include <c10/util/flat_hash_map.h>
+#include <c10/util/SmallVector.h>
 
 #include "csrc_dipu/runtime/core/DIPUEvent.h"
 
+#include "DIPUAllocatorTrace.h"
 #include "DIPUAsyncResourcePool.h"
+#include "DIPUCachingAllocatorUtils.h"
 #include "DIPURawAllocator.h"
 #include "allocator_metrics.h"
 
@@ -57,24 +66,37 @@ using AsyncMemPool = AsyncResourcePool<std::tuple<void*, size_t>>;
 
 class MemStats {
  private:
-  mutable size_t reserved_in_bytes_ = 0;
-  mutable size_t allocated_in_bytes_ = 0;
-  mutable size_t max_reserved_in_bytes_ = 0;
-  mutable size_t max_allocated_in_bytes_ = 0;
+  // Atomic so that allocators which no longer serialize every call behind a
+  // single lock (e.g. the sharded BF allocator) can still keep exact stats.
+  mutable std::atomic<size_t> reserved_in_bytes_{0};
+  mutable std::atomic<size_t> allocated_in_bytes_{0};
+  mutable std::atomic<size_t> max_reserved_in_bytes_{0};
+  mutable std::atomic<size_t> max_allocated_in_bytes_{0};
 
  protected:
+  static void update_peak(std::atomic<size_t>& peak, size_t value) {
+    size_t prev = peak.load(std::memory_order_relaxed);
+    while (prev < value && !peak.compare_exchange_weak(
+                               prev, value, std::memory_order_relaxed)) {
+    }
+  }
+
   void set_memory_reserved(size_t reserved_in_bytes) const {
     reserved_in_bytes_ = reserved_in_bytes;
-    max_reserved_in_bytes_ = max_reserved_in_bytes_ > reserved_in_bytes
-                                 ? max_reserved_in_bytes_
-                                 : reserved_in_bytes;
+    update_peak(max_reserved_in_bytes_, reserved_in_bytes);
   }
 
   void set_memory_allocated(size_t allocated_in_bytes) const {
     allocated_in_bytes_ = allocated_in_bytes;
-    max_allocated_in_bytes_ = max_allocated_in_bytes_ > allocated_in_bytes
-                                  ? max_allocated_in_bytes_
-                                  : allocated_in_bytes;
+    update_peak(max_allocated_in_bytes_, allocated_in_bytes);
+  }
+
+  void increase_memory_allocated(size_t nbytes) const {
+    update_peak(max_allocated_in_bytes_, allocated_in_bytes_ += nbytes);
+  }
+
+  void decrease_memory_allocated(size_t nbytes) const {
+    allocated_in_bytes_ -= nbytes;
   }
 
  public:
@@ -83,11 +105,11 @@ class MemStats {
   ~MemStats() {
     if (allocated_in_bytes_ != 0) {
       DIPU_DEBUG_ALLOCATOR(
-          8, "~MemStats: allocated_in_bytes_:" << allocated_in_bytes_);
+          8, "~MemStats: allocated_in_bytes_:" << allocated_in_bytes_.load());
     }
     if (reserved_in_bytes_ != 0) {
       DIPU_DEBUG_ALLOCATOR(
-          2, "~MemStats: reserved_in_bytes_:" << reserved_in_bytes_);
+          2, "~MemStats: reserved_in_bytes_:" << reserved_in_bytes_.load());
     }
   }
 
@@ -100,6 +122,28 @@ class MemStats {
   size_t max_memory_reserved() const { return max_reserved_in_bytes_; }
 };
 
+// The streams a block is used on besides the default stream. Almost always
+// none or one, so they are kept inline instead of in a hash set.
+class BlockStreams {
+  c10::SmallVector<DIPUStream, 2> streams_;
+
+ public:
+  void insert(const DIPUStream& stream) {
+    if (std::find(streams_.begin(), streams_.end(), stream) ==
+        streams_.end()) {
+      streams_.push_back(stream);
+    }
+  }
+
+  bool empty() const { return streams_.empty(); }
+
+  size_t size() const { return streams_.size(); }
+
+  auto begin() const { return streams_.begin(); }
+
+  auto end() const { return streams_.end(); }
+};
+
 class DIPU_API CacheAllocator : public c10::Allocator, public MemStats {
   c10::Allocator* raw_allocator_ = nullptr;
   AsyncMemPool* async_mem_pool_ = nullptr;
@@ -116,6 +160,10 @@ class DIPU_API CacheAllocator : public c10::Allocator, public MemStats {
 
   void free_raw(void* ptr) { return raw_allocator()->raw_deallocate(ptr); }
 
+  // Takes back the blocks freeAsync() keeps for mallocAsync() outside of the
+  // allocator. Called before an allocation fails for lack of memory.
+  void reclaim_stream_ordered_blocks() const;
+
  public:
   CacheAllocator() = default;
 
@@ -135,19 +183,54 @@ class DIPU_API CacheAllocator : public c10::Allocator, public MemStats {
 
   virtual void release_all_memory() const = 0;
 
+  // See markIterationBoundary().
+  virtual void mark_iteration_boundary() const {}
+
+  virtual IterationMemoryReport iteration_report() const {
+    IterationMemoryReport report;
+    report.reserved_bytes = memory_reserved();
+    return report;
+  }
+
+  // See memorySnapshot().
+  virtual std::vector<MemorySegmentInfo> snapshot() const { return {}; }
+
   c10::Device& device() const { return device_; }
 
   class DataPtrContextBase {
-    ska::flat_hash_set<DIPUStream> streams_;
+    BlockStreams streams_;
     mutable const CacheAllocator* allocator_ = nullptr;
     void* ptr_ = nullptr;
     size_t size_ = 0;
+    bool sampled_ = false;
+    bool freed_ = false;
+
+   protected:
+    // Forgets the block in MemChecker and the allocation trace. Derived
+    // contexts call it before giving the block back to the allocator, which
+    // may hand the same pointer out to another thread right away.
+    void recordFree() {
+      if (freed_) {
+        return;
+      }
+      freed_ = true;
+      MemChecker::instance().erase(ptr_);
+      if (sampled_) {
+        MemChecker::instance().unsample(ptr_);
+      }
+      if (AllocatorTraceRecorder::enabled() && ptr_ != nullptr) {
+        AllocatorTraceRecorder::instance().onFree(
+            ptr_, allocator_->device().index());
+      }
+    }
 
    public:
     DataPtrContextBase(const CacheAllocator* allocator, void* ptr, size_t size)
         : allocator_(allocator), ptr_(ptr), size_(size) {
+      c10::StreamId trace_stream = -1;
       if (allocator_->device().type() == dipu::DIPU_DEVICE_TYPE) {
         auto currentStream = getCurrentDIPUStream();
+        trace_stream = currentStream.id();
         auto defaultStream = getDefaultDIPUStream();
         // If current stream is the default stream, we don't need to synchronize
         // But before releasing the memory we must synchronize the default
@@ -160,18 +243,21 @@ class DIPU_API CacheAllocator : public c10::Allocator, public MemStats {
           // completed. After adding non-default stream and other default stream
           // operations here, the upper layer does not need to manually add a
           // wait for the default stream when allocating memory on the
-          // non-default stream.
-          DIPUEvent event;
-          event.record(defaultStream);
-          event.wait(currentStream);
+          // non-default stream. It is skipped if the default stream is idle.
+          waitDefaultDIPUStream(currentStream);
         }
       }
       MemChecker::instance().insert(ptr, size);
+      sampled_ = MemChecker::instance().sample(ptr, size);
+      if (AllocatorTraceRecorder::enabled() && ptr != nullptr) {
+        AllocatorTraceRecorder::instance().onAllocate(
+            ptr, size, allocator_->device().index(), trace_stream);
+      }
     }
 
-    ~DataPtrContextBase() { MemChecker::instance().erase(ptr_); }
+    ~DataPtrContextBase() { recordFree(); }
 
-    ska::flat_hash_set<DIPUStream>& streams() { return streams_; }
+    BlockStreams& streams() { return streams_; }
 
     const CacheAllocator* allocator() { return allocator_; }
 
@@ -189,8 +275,43 @@ c10::Allocator* getAllocator(c10::DeviceType device_type);
 
 bool isTorchAllocator();
 
+// A caching allocator which is not bound to any device and owns its async
+// resource pool. Used by tools (e.g. the allocation trace replay) to run an
+// algorithm on top of an arbitrary raw allocator.
+struct StandaloneCacheAllocator {
+  // Declared first so that it is destructed after the allocator.
+  std::unique_ptr<AsyncMemPool> async_mem_pool;
+  std::unique_ptr<CacheAllocator> allocator;
+};
+
+// Returns an empty StandaloneCacheAllocator if no algorithm is registered as
+// `name`.
+DIPU_API StandaloneCacheAllocator createStandaloneCacheAllocator(
+    const std::string& name, c10::Allocator* raw_allocator);
+
+DIPU_API std::vector<std::string> standaloneCacheAllocatorNames();
+
 namespace allocator_details {  // For internal implementation only
 
+using StandaloneCacheAllocatorFactory =
+    std::function<StandaloneCacheAllocator()>;
+
+void registerStandaloneCacheAllocator(
+    const std::string& name, const StandaloneCacheAllocatorFactory& factory);
+
+struct StandaloneAllocatorRegisterer {
+  StandaloneAllocatorRegisterer(
+      const std::string& name, const StandaloneCacheAllocatorFactory& factory) {
+    registerStandaloneCacheAllocator(name, factory);
+  }
+};
+
+template <class AllocatorImpl, class AsyncMemPoolImpl>
+StandaloneCacheAllocator make_standalone_allocator() {
+  return {std::make_unique<AsyncMemPoolImpl>(),
+          std::make_unique<AllocatorImpl>()};
+}
+
 struct AllocatorRegisterer {
   explicit AllocatorRegisterer(
       const std::string& name, c10::DeviceType device_type,
@@ -270,6 +391,10 @@ c10::Allocator* get_allocator(int device_id, c10::Allocator* raw_allocator) {
             std::placeholders::_1, &raw_allocator);                           \
     static const allocator_details::AllocatorRegisterer g_allocator(          \
         #name, at::DeviceType::device_type, allocator_get_fn, priority);      \
+    static const allocator_details::StandaloneAllocatorRegisterer             \
+        g_standalone_allocator(                                               \
+            #name, allocator_details::make_standalone_allocator<              \
+                       CachingAllocator, AsyncMemPool>);                      \
   }
 }  // namespace allocator_details
 
@@ -1,13 +1,104 @@
 // Copyright (c) 2023, DeepLink.
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
 #include <c10/core/Allocator.h>
 #include <c10/core/Device.h>
+#include <c10/core/Stream.h>
 
 #include "csrc_dipu/runtime/core/DIPUStream.h"
 
 namespace dipu {
 
+// Memory usage of the iterations marked by markIterationBoundary().
+struct IterationMemoryReport {
+  size_t iterations = 0;
+  size_t warmup_iterations = 0;
+  // Largest amount of allocated memory seen during warm-up.
+  size_t peak_bytes = 0;
+  // Largest growth of allocated memory within one warm-up iteration.
+  size_t transient_peak_bytes = 0;
+  // Total size of the arenas reserved after warm-up, 0 if there are none.
+  size_t arena_bytes = 0;
+  size_t reserved_bytes = 0;
+  // Device memory allocations since the end of warm-up.
+  size_t device_allocations_after_warmup = 0;
+};
+
+// One block of a segment, see memorySnapshot().
+struct MemoryBlockInfo {
+  enum class State : uint8_t {
+    kAllocated,
+    // Freed by the user, but not reusable before the streams which used it
+    // are done with it.
+    kPendingFree,
+    kFree,
+  };
+  size_t address = 0;
+  size_t size = 0;
+  // Size asked for by the user, or `size` if the allocator does not keep it.
+  size_t requested_size = 0;
+  State state = State::kFree;
+};
+
+// A contiguous piece of memory which the allocator got from the device.
+struct MemorySegmentInfo {
+  c10::DeviceIndex device = 0;
+  size_t address = 0;
+  size_t total_size = 0;
+  // The stream owning the segment, -1 if the allocator does not track it.
+  c10::StreamId stream = -1;
+  // false for segments split into equally sized small blocks.
+  bool is_large = true;
+  std::vector<MemoryBlockInfo> blocks;
+};
+
+// Private memory pools. Device memory allocated by a thread inside a
+// MemoryPoolScope comes from the pool's own cache, which is never shared with
+// allocations outside of the pool. Keeps e.g. evaluation or large temporary
+// workspaces from fragmenting the cache of training.
+using MemoryPoolId = uint32_t;
+constexpr MemoryPoolId kDefaultMemoryPool = 0;
+
+// Returns the id of the pool named `name`, creating it on first use.
+MemoryPoolId getMemoryPool(const std::string& name);
+
+MemoryPoolId currentMemoryPool();
+
+// Sets the pool of the calling thread and returns the previous one.
+MemoryPoolId setCurrentMemoryPool(MemoryPoolId pool);
+
+class MemoryPoolScope {
+  MemoryPoolId previous_;
+
+ public:
+  explicit MemoryPoolScope(MemoryPoolId pool)
+      : previous_(setCurrentMemoryPool(pool)) {}
+  ~MemoryPoolScope() { setCurrentMemoryPool(previous_); }
+  MemoryPoolScope(const MemoryPoolScope&) = delete;
+  MemoryPoolScope& operator=(const MemoryPoolScope&) = delete;
+  MemoryPoolScope(MemoryPoolScope&&) = delete;
+  MemoryPoolScope& operator=(MemoryPoolScope&&) = delete;
+};
+
+struct MemoryPoolStats {
+  size_t allocated_bytes = 0;
+  size_t reserved_bytes = 0;
+  size_t max_allocated_bytes = 0;
+  size_t max_reserved_bytes = 0;
+};
+
+MemoryPoolStats memoryPoolStats(const c10::Device& device, MemoryPoolId pool);
+
+// Returns all memory cached by the pool on `device` to the device. Memory
+// still used by tensors stays in the pool, release it again once they are
+// freed.
+void releaseMemoryPool(const c10::Device& device, MemoryPoolId pool);
+
 size_t memoryReserved(const c10::Device& device);
 
 size_t memoryAllocated(const c10::Device& device);
@@ -18,6 +109,27 @@ size_t maxMemoryAllocated(const c10::Device& device);
 
 void resetPeakStats(const c10::Device& device);
 
+// Tells the allocator of `device` that a training iteration ends here. Opt-in
+// allocators use the first iterations to size pre-reserved arenas. Ignored by
+// the TORCH allocator, whose report only has reserved_bytes.
+void markIterationBoundary(const c10::Device& device);
+
+IterationMemoryReport iterationMemoryReport(const c10::Device& device);
+
+// Every segment cached by the allocator of `device` and its blocks. Empty for
+// allocators which do not support it.
+std::vector<MemorySegmentInfo> memorySnapshot(const c10::Device& device);
+
+// Stream-ordered allocation. The memory may be used by work submitted to
+// `stream` after mallocAsync(), and must not be used by work submitted to
+// `stream` after freeAsync(); other streams have to be ordered against these
+// points by the caller. Memory freed on a stream is reused by later
+// allocations on that stream without waiting on any event, so neither call
+// records or waits on events on the fast path.
+void* mallocAsync(size_t size, const DIPUStream& stream);
+
+void freeAsync(void* ptr, const DIPUStream& stream);
+
 void emptyCachedMem();
 
 void initCachedAllocator();
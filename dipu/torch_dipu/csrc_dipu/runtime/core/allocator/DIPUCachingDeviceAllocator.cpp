@@ -144,15 +144,51 @@ using Comparison = bool (*)(const Block*, const Block*);
 static bool BlockComparatorSize(const Block* a, const Block* b);
 static bool BlockComparatorAddress(const Block* a, const Block* b);
 
+struct PrivatePool;
+
 struct BlockPool {
-  explicit BlockPool(bool small)
+  explicit BlockPool(bool small, PrivatePool* private_pool = nullptr)
       : blocks(BlockComparatorSize),
         unmapped(BlockComparatorAddress),
-        is_small(small) {}
+        is_small(small),
+        owner_private_pool(private_pool) {}
   std::set<Block*, Comparison> blocks;
   std::set<Block*, Comparison> unmapped;
   // NOLINTNEXTLINE(cppcoreguidelines-avoid-const-or-ref-data-members)
   const bool is_small;
+  PrivatePool* owner_private_pool;
+};
+
+// Blocks of a dipu::MemoryPoolScope, kept apart from the default pools.
+struct PrivatePool {
+  PrivatePool()
+      : large_blocks(/*small=*/false, this),
+        small_blocks(/*small=*/true, this) {}
+  PrivatePool(const PrivatePool&) = delete;
+  PrivatePool(PrivatePool&&) = delete;
+  PrivatePool& operator=(const PrivatePool&) = delete;
+  PrivatePool& operator=(PrivatePool&&) = delete;
+  ~PrivatePool() = default;
+
+  BlockPool large_blocks;
+  BlockPool small_blocks;
+  MemoryPoolStats stats;
+
+  static void update_allocated(const BlockPool& pool, int64_t amount) {
+    if (auto* self = pool.owner_private_pool) {
+      self->stats.allocated_bytes += amount;
+      self->stats.max_allocated_bytes = std::max(
+          self->stats.max_allocated_bytes, self->stats.allocated_bytes);
+    }
+  }
+
+  static void update_reserved(const BlockPool& pool, int64_t amount) {
+    if (auto* self = pool.owner_private_pool) {
+      self->stats.reserved_bytes += amount;
+      self->stats.max_reserved_bytes = std::max(self->stats.max_reserved_bytes,
+                                                self->stats.reserved_bytes);
+    }
+  }
 };
 
 struct Block {
@@ -511,6 +547,9 @@ class DeviceCachingAllocator {
   // unallocated cached blocks 1 MB or smaller
   BlockPool small_blocks;
 
+  // pools of dipu::MemoryPoolScope, created on first use
+  ska::flat_hash_map<MemoryPoolId, std::unique_ptr<PrivatePool>> private_pools;
+
   // allocated or in use by a stream. Holds all active allocations,
   // whether they came from graph_pools or one of the BlockPools above.
   ska::flat_hash_set<Block*> active_blocks;
@@ -778,6 +817,7 @@ class DeviceCachingAllocator {
 
     bool inserted = active_blocks.insert(block).second;
     TORCH_INTERNAL_ASSERT_DEBUG_ONLY(inserted);
+    PrivatePool::update_allocated(*pool, static_cast<int64_t>(block->size));
 
     for_each_selected_stat_type(params.stat_types, [&](size_t stat_type) {
       update_stat(stats.allocation[stat_type], 1);
@@ -820,6 +860,8 @@ class DeviceCachingAllocator {
       update_stat(stats.allocated_bytes[stat_type],
                   -static_cast<std::int64_t>(block->size));
     });
+    PrivatePool::update_allocated(*block->pool,
+                                  -static_cast<std::int64_t>(block->size));
     if (record_history) {
       record_trace(TraceEntry::FREE_REQUESTED,
                    reinterpret_cast<int64_t>(block->ptr), block->requested_size,
@@ -953,6 +995,31 @@ class DeviceCachingAllocator {
     reset_peak_stat(stats.oversize_segments);
   }
 
+  MemoryPoolStats getPoolStats(MemoryPoolId id) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    auto it = private_pools.find(id);
+    return it == private_pools.end() ? MemoryPoolStats{} : it->second->stats;
+  }
+
+  /** Returns the cached blocks of a private pool to the device, the pool is
+   * forgotten once it holds no memory at all. **/
+  void releasePool(MemoryPoolId id) {
+    auto context = maybeGatherContext(RecordContext::ALL);
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    auto it = private_pools.find(id);
+    if (it == private_pools.end()) {
+      return;
+    }
+    synchronize_and_free_events(context);
+    PrivatePool& pool = *it->second;
+    release_blocks(pool.large_blocks);
+    release_blocks(pool.small_blocks);
+    if (pool.stats.reserved_bytes == 0 && pool.large_blocks.unmapped.empty() &&
+        pool.small_blocks.unmapped.empty()) {
+      private_pools.erase(it);
+    }
+  }
+
   /** Dump a complete snapshot of the memory held by the allocator. Potentially
    * VERY expensive. **/
   std::vector<SegmentInfo> snapshot() {
@@ -1075,6 +1142,12 @@ class DeviceCachingAllocator {
                   small_blocks.blocks.end());
     blocks.insert(blocks.end(), large_blocks.blocks.begin(),
                   large_blocks.blocks.end());
+    for (const auto& item : private_pools) {
+      for (const BlockPool* pool :
+           {&item.second->small_blocks, &item.second->large_blocks}) {
+        blocks.insert(blocks.end(), pool->blocks.begin(), pool->blocks.end());
+      }
+    }
     blocks.insert(blocks.end(), active_blocks.begin(), active_blocks.end());
     return blocks;
   }
@@ -1165,6 +1238,8 @@ class DeviceCachingAllocator {
     for_each_selected_stat_type(stat_types, [&](size_t stat_type) {
       update_stat(stats.reserved_bytes[stat_type], mapped_range.size);
     });
+    PrivatePool::update_reserved(pool,
+                                 static_cast<int64_t>(mapped_range.size));
     if (record_history) {
       record_trace(TraceEntry::SEGMENT_MAP, int64_t(mapped_range.ptr),
                    mapped_range.size, to_map->stream, ctx);
@@ -1303,6 +1378,14 @@ class DeviceCachingAllocator {
   }
 
   BlockPool& get_pool(size_t size, deviceStream_t stream) {
+    if (auto id = currentMemoryPool(); id != kDefaultMemoryPool) {
+      auto& private_pool = private_pools[id];
+      if (!private_pool) {
+        private_pool = std::make_unique<PrivatePool>();
+      }
+      return size <= kSmallSize ? private_pool->small_blocks
+                                : private_pool->large_blocks;
+    }
     if (size <= kSmallSize) {
       return small_blocks;
     }
@@ -1512,6 +1595,7 @@ class DeviceCachingAllocator {
       update_stat(stats.segment[stat_type], 1);
       update_stat(stats.reserved_bytes[stat_type], size);
     });
+    PrivatePool::update_reserved(*p.pool, static_cast<int64_t>(size));
     if (size >= CachingAllocatorConfig::max_split_size()) {
       update_stat(stats.oversize_segments, 1);
     }
@@ -1588,6 +1672,10 @@ class DeviceCachingAllocator {
     // Free all non-split cached blocks to system allocator
     release_blocks(large_blocks);
     release_blocks(small_blocks);
+    for (auto& item : private_pools) {
+      release_blocks(item.second->large_blocks);
+      release_blocks(item.second->small_blocks);
+    }
     return true;
   }
 
@@ -1617,6 +1705,8 @@ class DeviceCachingAllocator {
       update_stat(stats.reserved_bytes[stat_type],
                   -static_cast<std::int64_t>(block->size));
     });
+    PrivatePool::update_reserved(*pool,
+                                 -static_cast<std::int64_t>(block->size));
 
     if (block->size >= CachingAllocatorConfig::max_split_size())
       update_stat(stats.oversize_segments, -1);
@@ -1672,6 +1762,8 @@ class DeviceCachingAllocator {
     for_each_selected_stat_type(stat_types, [&](size_t stat_type) {
       update_stat(stats.reserved_bytes[stat_type], -unmapped.size);
     });
+    PrivatePool::update_reserved(*block->pool,
+                                 -static_cast<int64_t>(unmapped.size));
     if (record_history) {
       record_trace(TraceEntry::SEGMENT_UNMAP, int64_t(unmapped.ptr),
                    unmapped.size, block->stream, nullptr);
@@ -1861,6 +1953,16 @@ class NativeCachingAllocator : public DeviceAllocator {
     add_allocated_block(block);
     *devPtr = block->ptr;
     metrics_producer[device]->allocate(block->ptr, block->size);
+    if (AllocatorTraceRecorder::enabled()) {
+      auto index = static_cast<c10::DeviceIndex>(device);
+      auto current = dipu::getCurrentDIPUStream(index);
+      // Streams not known to DIPU are identified by their raw pointer.
+      auto stream_id = current.rawstream() == stream
+                           ? current.id()
+                           : reinterpret_cast<c10::StreamId>(stream);
+      AllocatorTraceRecorder::instance().onAllocate(block->ptr, size, index,
+                                                    stream_id);
+    }
   }
 
   void free(void* ptr) {
@@ -1872,6 +1974,10 @@ class NativeCachingAllocator : public DeviceAllocator {
       TORCH_CHECK(false, "invalid device pointer: ", ptr);
     }
     metrics_producer[block->device]->deallocate(block->ptr);
+    if (AllocatorTraceRecorder::enabled()) {
+      AllocatorTraceRecorder::instance().onFree(
+          block->ptr, static_cast<c10::DeviceIndex>(block->device));
+    }
     device_allocator[block->device]->free(block);
   }
 
@@ -1941,6 +2047,11 @@ class NativeCachingAllocator : public DeviceAllocator {
     Block* block = get_allocated_block(ptr.get());
     // block must not be null reaching here
     TORCH_INTERNAL_ASSERT(block != nullptr, "No allocated block can be found");
+    if (AllocatorTraceRecorder::enabled()) {
+      AllocatorTraceRecorder::instance().onRecordStream(
+          block->ptr, static_cast<c10::DeviceIndex>(block->device),
+          stream.id());
+    }
     device_allocator[block->device]->recordStream(block, stream);
   }
 
@@ -2001,6 +2112,16 @@ class NativeCachingAllocator : public DeviceAllocator {
     device_allocator[device]->resetPeakStats();
   }
 
+  MemoryPoolStats getPoolStats(int device, MemoryPoolId pool) override {
+    assertValidDevice(device);
+    return device_allocator[device]->getPoolStats(pool);
+  }
+
+  void releasePool(int device, MemoryPoolId pool) override {
+    assertValidDevice(device);
+    device_allocator[device]->releasePool(pool);
+  }
+
   void* raw_alloc(size_t nbytes) override {
     if (nbytes == 0) {
       return nullptr;
@@ -2025,6 +2146,18 @@ class NativeCachingAllocator : public DeviceAllocator {
 
   void raw_delete(void* ptr) override { this->free(ptr); }
 
+  void raw_delete_with_stream(void* ptr, const DIPUStream& stream) override {
+    if (!ptr) {
+      return;
+    }
+    Block* block = get_allocated_block(ptr);
+    TORCH_CHECK(block != nullptr, "invalid device pointer: ", ptr);
+    // A no-op for the allocation stream, so that blocks freed on their own
+    // stream are reused without any event.
+    device_allocator[block->device]->recordStream(block, stream);
+    this->free(ptr);
+  }
+
   std::string name() override { return "torch"; }
 };
 
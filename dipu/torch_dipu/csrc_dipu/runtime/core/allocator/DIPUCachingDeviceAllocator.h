@@ -15,6 +15,8 @@
 
 #include "csrc_dipu/runtime/core/DIPUStream.h"
 
+#include "DIPUCachingAllocatorUtils.h"
+
 namespace dipu::allocator {
 
 // ----------------------------------------------------------------------------
@@ -189,6 +191,9 @@ class DeviceAllocator : public c10::Allocator {
   virtual void* raw_alloc(size_t nbytes) = 0;
   virtual void* raw_alloc_with_stream(size_t nbytes, deviceStream_t stream) = 0;
   virtual void raw_delete(void* ptr) = 0;
+  // Frees ptr in the order of `stream`: it is reused on its allocation stream
+  // only after the work submitted to `stream` so far.
+  virtual void raw_delete_with_stream(void* ptr, const DIPUStream& stream) = 0;
   virtual void init(int device_count) = 0;
   virtual bool initialized() = 0;
   virtual void setMemoryFraction(double fraction, int device) = 0;
@@ -199,6 +204,8 @@ class DeviceAllocator : public c10::Allocator {
   virtual DeviceStats getDeviceStats(int device) = 0;
   virtual void resetAccumulatedStats(int device) = 0;
   virtual void resetPeakStats(int device) = 0;
+  virtual MemoryPoolStats getPoolStats(int device, MemoryPoolId pool) = 0;
+  virtual void releasePool(int device, MemoryPoolId pool) = 0;
   virtual SnapshotInfo snapshot() = 0;
   virtual bool isHistoryEnabled() {
     TORCH_CHECK(
@@ -236,6 +243,10 @@ inline void raw_delete(void* ptr) {
   return getTorchAllocator()->raw_delete(ptr);
 }
 
+inline void raw_delete_with_stream(void* ptr, const DIPUStream& stream) {
+  return getTorchAllocator()->raw_delete_with_stream(ptr, stream);
+}
+
 inline void init(int device_count) {
   return getTorchAllocator()->init(device_count);
 }
@@ -266,6 +277,14 @@ inline void resetPeakStats(int device) {
   return getTorchAllocator()->resetPeakStats(device);
 }
 
+inline MemoryPoolStats getPoolStats(int device, MemoryPoolId pool) {
+  return getTorchAllocator()->getPoolStats(device, pool);
+}
+
+inline void releasePool(int device, MemoryPoolId pool) {
+  return getTorchAllocator()->releasePool(device, pool);
+}
+
 inline SnapshotInfo snapshot() { return getTorchAllocator()->snapshot(); }
 
 inline void recordHistory(bool enabled, CreateContextFn context_recorder,
@@ -1,28 +1,74 @@
 // Copyright (c) 2024, DeepLink.
 #include "DIPUCachingHostAllocator.h"
 
+#include <algorithm>
+#include <array>
 #include <cstdint>
 #include <deque>
+#include <limits>
 #include <memory>
 #include <mutex>
 #include <set>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
+#include <vector>
 
+#include <c10/util/Exception.h>
+#include <c10/util/llvmMathExtras.h>
+
+#include "csrc_dipu/base/environ.hpp"
+#include "csrc_dipu/metrics/metrics.h"
+#include "csrc_dipu/runtime/core/AddressRangeRegistry.h"
 #include "csrc_dipu/runtime/core/DIPUEvent.h"
 #include "csrc_dipu/runtime/devproxy/deviceproxy.h"
 
+#include "DIPURawAllocator.h"
+#include "HostExpandableSegment.h"
+
 // ----------------------------------------------------------------------------
 // Code from pytorch2.1.0 aten/src/ATen/cuda/CachingHostAllocator.cpp
 // Our changes:
 //    1. use dipu runtime api to replace CUDA API.
 //    2. remove EventPool class, DIPU already supports it.
+//    3. finer size classes and a free list per NUMA node, see
+//       Note [DIPUCachingHostAllocator NUMA arenas].
 // ----------------------------------------------------------------------------
 namespace dipu::allocator {
 namespace {
 
 constexpr int32_t kAlignPack(64);
+constexpr size_t kMaxNumaNodes = 8;
+constexpr size_t kMinBlockSize = 512;
+constexpr size_t kSegmentPageSize = size_t{2} << 20U;
+
+// NUMA node of the CPU the calling thread runs on.
+size_t currentNumaNode() {
+  unsigned cpu = 0;
+  unsigned node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+    return 0;
+  }
+  return node % kMaxNumaNodes;
+}
+
+// Rounds up to a size class. Each power of two is divided into
+// DIPU_HOST_SIZE_CLASS_STEPS classes, so at most 1/steps of a block is
+// wasted instead of up to half of it.
+size_t roundSize(size_t size) {
+  constexpr int64_t kMaxSteps = 64;
+  static const size_t steps = c10::llvm::PowerOf2Ceil(
+      std::clamp<int64_t>(environ::hostSizeClassSteps(), 1, kMaxSteps));
+  if (size <= kMinBlockSize) {
+    return kMinBlockSize;
+  }
+  size_t step = std::max<size_t>(c10::llvm::PowerOf2Floor(size) / steps,
+                                 kMinBlockSize);
+  return (size + step - 1) / step * step;
+}
 
 struct BlockSize {
   size_t size_{0};
@@ -32,6 +78,12 @@ struct BlockSize {
 struct Block {
   size_t size_{0};
   void* ptr_{nullptr};
+  size_t requested_{0};
+  // NUMA node of the thread which allocated the memory. Pinning touches the
+  // pages, so they are placed on that node.
+  size_t node_{0};
+  // Carved from the reservation of a node, never freed.
+  bool reserved_{false};
 
   std::mutex mutex_;
   bool allocated_{false};
@@ -96,8 +148,37 @@ struct BlockComparator {
  * for compatibility reasons, and we can explore enforcing these in subsequent
  * versions.
  */
+
+/**
+ * Note [DIPUCachingHostAllocator NUMA arenas]
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ * Free blocks are kept in one arena per NUMA node, so that a thread reuses
+ * pinned memory of its own node and DMA does not cross the interconnect. A
+ * block returns to the arena of the node its memory is on. A thread only takes
+ * a block of another node if it cannot allocate, which is counted in
+ * pinned_host_cross_node_count. Threads follow their device when
+ * DIPU_CPU_AFFINITY binds them to the cores of the device.
+ *
+ * With DIPU_HOST_PINNED_RESERVE_MB, each arena reserves that much pinned
+ * memory on first use and carves new blocks out of it before calling
+ * mallocHost. Reserved memory is kept until exit.
+ *
+ * With DIPU_HOST_EXPANDABLE_SEGMENTS, the reservation of each arena is a
+ * HostExpandableSegment instead: address space for all of the physical memory
+ * is reserved once, and pages are committed and pinned (one
+ * devproxy::hostRegister per growth) as blocks are carved at its end. A growing
+ * workload then fills one contiguous pinned range instead of pinning a new
+ * block for every new size. empty_cache drops the free blocks at the end of
+ * the segment and unpins the growths they free completely.
+ */
 class DIPUCachingHostAllocator {
  public:
+  DIPUCachingHostAllocator() {
+    for (size_t node = 0; node < kMaxNumaNodes; ++node) {
+      arenas_[node] = std::make_unique<Arena>(node);
+    }
+  }
+
   std::pair<void*, void*> allocate(size_t size) {
     if (size == 0) {
       return {nullptr, nullptr};
@@ -105,31 +186,34 @@ class DIPUCachingHostAllocator {
 
     process_events();
 
-    // First, try to allocate from the free list
-    {
-      std::lock_guard<std::mutex> g(free_list_mutex_);
-      auto it = free_list_.lower_bound(BlockSize{size, nullptr});
-      if (it != free_list_.end()) {
-        auto block = *it;
-        block->allocated_ = true;
-        free_list_.erase(it);
-        return {block->ptr_, reinterpret_cast<void*>(block)};
+    size_t thread_node = currentNumaNode();
+    size_t rounded = roundSize(size);
+    auto& arena = *arenas_[environ::hostNumaArenas() ? thread_node : 0];
+
+    // First, try to allocate from the free list, not taking blocks much
+    // larger than needed.
+    Block* block = take_free_block(arena, rounded, 2 * rounded);
+    if (block == nullptr) {
+      block = carve_reserved_block(arena, rounded, thread_node);
+    }
+    if (block == nullptr) {
+      try {
+        block = malloc_block(rounded, thread_node);
+      } catch (const c10::Error&) {
+        block = take_any_free_block(rounded);
+        if (block == nullptr) {
+          throw;
+        }
       }
     }
 
-    // Round up the allocation to the nearest power of two to improve reuse.
-    void* ptr = nullptr;
-    size_t allocation_size = c10::llvm::PowerOf2Ceil(size);
-    devproxy::mallocHost(&ptr, allocation_size);
-    auto block = new Block();
-    block->size_ = allocation_size;
-    block->ptr_ = ptr;
-    block->allocated_ = true;
-
-    {
-      std::lock_guard<std::mutex> g(blocks_mutex_);
-      blocks_.insert(block);
-      ptr_to_block_.insert({block->ptr_, block});
+    block->requested_ = size;
+    if (metrics::enable()) {
+      arenas_[block->node_]->wasted_bytes.add(
+          static_cast<int64_t>(block->size_ - size));
+      if (block->node_ != thread_node) {
+        arenas_[thread_node]->cross_node_count.inc();
+      }
     }
     return {block->ptr_, reinterpret_cast<void*>(block)};
   }
@@ -142,6 +226,10 @@ class DIPUCachingHostAllocator {
     // Note: we can assume that free is correctly paired with alloc,
     // and thus we do not need to look up the ctx in blocks_.
     auto* block = reinterpret_cast<Block*>(ctx);
+    if (metrics::enable()) {
+      arenas_[block->node_]->wasted_bytes.sub(
+          static_cast<int64_t>(block->size_ - block->requested_));
+    }
 
     c10::optional<std::vector<DIPUEvent>> events;
     {
@@ -163,8 +251,7 @@ class DIPUCachingHostAllocator {
     }
 
     if (!events) {
-      std::lock_guard<std::mutex> g(free_list_mutex_);
-      free_list_.insert(block);
+      release_block(block);
     } else {
       std::lock_guard<std::mutex> g(events_mutex_);
       for (auto&& event : *events) {
@@ -208,33 +295,236 @@ class DIPUCachingHostAllocator {
   }
 
   void empty_cache() {
-    // Flush any available blocks into the free_list.
+    // Flush any available blocks into the free lists.
     process_events();
 
-    // Remove all elements from the free list, remove them from the blocks
+    // Remove all elements from the free lists, remove them from the blocks
     // list, and free the associated pinned memory allocation. This requires
-    // concurrently holding both the free list mutex and the blocks mutex, and
+    // concurrently holding the mutex of an arena and the blocks mutex, and
     // is the only function that concurrently holds multiple mutexes.
-    std::lock(free_list_mutex_, blocks_mutex_);
-    std::lock_guard<std::mutex> gf(free_list_mutex_, std::adopt_lock);
-    std::lock_guard<std::mutex> gb(blocks_mutex_, std::adopt_lock);
+    for (auto& arena : arenas_) {
+      std::lock(arena->mutex, blocks_mutex_);
+      std::lock_guard<std::mutex> gf(arena->mutex, std::adopt_lock);
+      std::lock_guard<std::mutex> gb(blocks_mutex_, std::adopt_lock);
+
+      for (auto it = arena->free_list.begin(); it != arena->free_list.end();) {
+        auto* block = *it;
+        // Reserved blocks stay cached.
+        if (block->reserved_) {
+          ++it;
+          continue;
+        }
+        it = arena->free_list.erase(it);
+        blocks_.erase(block);
+        ptr_to_block_.erase(block->ptr_);
+        AddressRangeRegistry::instance().erase(pinnedHostMemoryDomain(),
+                                               block->ptr_);
+        devproxy::freeHost(block->ptr_);
+        delete block;
+      }
+      if (arena->segment) {
+        shrink_segment(*arena);
+      }
+    }
+  }
+
+  bool is_pinned_ptr(const void* ptr) {
+    return AddressRangeRegistry::instance().contains(pinnedHostMemoryDomain(),
+                                                     ptr);
+  }
 
-    std::vector<Block*> blocks_to_remove(free_list_.begin(), free_list_.end());
-    free_list_.clear();
-    for (auto* block : blocks_to_remove) {
+ private:
+  struct Arena {
+    alignas(kAlignPack) std::mutex mutex;
+    // Note: an alternative datastructure can yield significant wins here in
+    // microbenchmarks.
+    std::set<Block*, BlockComparator> free_list;
+
+    // Pinned memory new blocks are carved from before calling mallocHost:
+    // [reserve_ptr, reserve_end) is left of a fixed reservation or of the
+    // mapped part of an expandable segment. Carved blocks are kept in address
+    // order.
+    std::once_flag reserve_flag;
+    char* reserve_ptr = nullptr;
+    char* reserve_end = nullptr;
+    std::unique_ptr<HostExpandableSegment> segment;
+    std::vector<Block*> carved;
+    // The ranges grow_segment mapped, in address order, each pinned and
+    // unmapped as a whole.
+    std::vector<SegmentRange> grown;
+
+    metrics::LabeledIntegerGauge wasted_bytes;
+    metrics::LabeledIntegerCounter cross_node_count;
+
+    explicit Arena(size_t node)
+        : wasted_bytes(metrics::default_collector()
+                           .make_integer_gauge(
+                               "pinned_host_wasted_bytes",
+                               "bytes of pinned blocks beyond the request")
+                           .with({{"node", std::to_string(node)}})),
+          cross_node_count(
+              metrics::default_collector()
+                  .make_integer_counter(
+                      "pinned_host_cross_node_count",
+                      "pinned blocks handed out to threads of another node")
+                  .with({{"node", std::to_string(node)}})) {}
+  };
+
+  Arena& arena_of(const Block* block) {
+    return *arenas_[environ::hostNumaArenas() ? block->node_ : 0];
+  }
+
+  Block* take_free_block(Arena& arena, size_t size, size_t max_size) {
+    std::lock_guard<std::mutex> g(arena.mutex);
+    auto it = arena.free_list.lower_bound(BlockSize{size, nullptr});
+    if (it == arena.free_list.end() || (*it)->size_ > max_size) {
+      return nullptr;
+    }
+    auto* block = *it;
+    block->allocated_ = true;
+    arena.free_list.erase(it);
+    return block;
+  }
+
+  // Last resort when no more memory can be pinned.
+  Block* take_any_free_block(size_t size) {
+    constexpr size_t kAnySize = std::numeric_limits<size_t>::max();
+    for (auto& arena : arenas_) {
+      if (auto* block = take_free_block(*arena, size, kAnySize)) {
+        return block;
+      }
+    }
+    return nullptr;
+  }
+
+  static void init_reserve(Arena& arena) {
+    constexpr size_t kMegaByte = size_t{1} << 20U;
+    auto bytes = static_cast<size_t>(
+        std::max<int64_t>(environ::hostPinnedReserveMB(), 0) * kMegaByte);
+    if (environ::hostExpandableSegments()) {
+      if (devproxy::isHostRegisterSupported()) {
+        // Address space for all of the physical memory, committed and pinned
+        // as the arena grows.
+        auto physical = static_cast<size_t>(sysconf(_SC_PHYS_PAGES)) *
+                        static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        arena.segment = std::make_unique<HostExpandableSegment>(
+            physical, kSegmentPageSize, true);
+        arena.reserve_ptr = arena.reserve_end = arena.segment->ptr();
+        if (bytes > 0) {
+          TORCH_CHECK(grow_segment(arena, bytes),
+                      "failed to reserve pinned host memory");
+        }
+        return;
+      }
+      TORCH_WARN_ONCE(
+          "DIPU_HOST_EXPANDABLE_SEGMENTS is set, but the vendor does not "
+          "implement hostRegister. Hence ignoring the setting.");
+    }
+    if (bytes == 0) {
+      return;
+    }
+    void* ptr = nullptr;
+    devproxy::mallocHost(&ptr, bytes);
+    AddressRangeRegistry::instance().insert(pinnedHostMemoryDomain(), ptr,
+                                            bytes);
+    arena.reserve_ptr = static_cast<char*>(ptr);
+    arena.reserve_end = arena.reserve_ptr + bytes;
+  }
+
+  // Maps pages at the end of the segment until `bytes` more are usable.
+  static bool grow_segment(Arena& arena, size_t bytes) {
+    auto mapped = arena.segment->map(SegmentRange(arena.reserve_end, bytes));
+    if (mapped.size == 0) {
+      return false;
+    }
+    AddressRangeRegistry::instance().insert(pinnedHostMemoryDomain(),
+                                            mapped.ptr, mapped.size);
+    arena.grown.push_back(mapped);
+    arena.reserve_end = mapped.ptr + mapped.size;
+    return true;
+  }
+
+  // Drops the free blocks at the end of the segment and unmaps their pages.
+  // Called with the mutex of the arena and blocks_mutex_ held.
+  void shrink_segment(Arena& arena) {
+    while (!arena.carved.empty()) {
+      auto* block = arena.carved.back();
+      auto it = arena.free_list.find(block);
+      if (it == arena.free_list.end()) {
+        break;
+      }
+      arena.free_list.erase(it);
       blocks_.erase(block);
       ptr_to_block_.erase(block->ptr_);
-      devproxy::freeHost(block->ptr_);
+      arena.reserve_ptr = static_cast<char*>(block->ptr_);
+      arena.carved.pop_back();
       delete block;
     }
+    // Only growths which are free as a whole can be unpinned.
+    while (!arena.grown.empty() &&
+           arena.grown.back().ptr >= arena.reserve_ptr) {
+      auto range = arena.grown.back();
+      arena.segment->unmap(range);
+      AddressRangeRegistry::instance().erase(pinnedHostMemoryDomain(),
+                                             range.ptr);
+      arena.reserve_end = range.ptr;
+      arena.grown.pop_back();
+    }
   }
 
-  bool is_pinned_ptr(const void* ptr) {
-    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-const-cast)
-    return ptr_to_block_.find(const_cast<void*>(ptr)) != ptr_to_block_.end();
+  Block* carve_reserved_block(Arena& arena, size_t size, size_t node) {
+    std::call_once(arena.reserve_flag, [&arena] { init_reserve(arena); });
+
+    Block* block = nullptr;
+    {
+      // Growing the segment maps and pins pages under the lock of the arena,
+      // which is still much cheaper than pinning a new block every time.
+      std::lock_guard<std::mutex> g(arena.mutex);
+      auto left = static_cast<size_t>(arena.reserve_end - arena.reserve_ptr);
+      if (left < size &&
+          (!arena.segment || !grow_segment(arena, size - left))) {
+        return nullptr;
+      }
+      block = make_block(arena.reserve_ptr, size, node);
+      block->reserved_ = true;
+      arena.reserve_ptr += size;
+      arena.carved.push_back(block);
+    }
+    track_block(block);
+    return block;
+  }
+
+  Block* malloc_block(size_t size, size_t node) {
+    void* ptr = nullptr;
+    devproxy::mallocHost(&ptr, size);
+    AddressRangeRegistry::instance().insert(pinnedHostMemoryDomain(), ptr,
+                                            size);
+    auto* block = make_block(ptr, size, node);
+    track_block(block);
+    return block;
+  }
+
+  static Block* make_block(void* ptr, size_t size, size_t node) {
+    auto* block = new Block();
+    block->size_ = size;
+    block->ptr_ = ptr;
+    block->node_ = node;
+    block->allocated_ = true;
+    return block;
+  }
+
+  void track_block(Block* block) {
+    std::lock_guard<std::mutex> g(blocks_mutex_);
+    blocks_.insert(block);
+    ptr_to_block_.insert({block->ptr_, block});
+  }
+
+  void release_block(Block* block) {
+    auto& arena = arena_of(block);
+    std::lock_guard<std::mutex> g(arena.mutex);
+    arena.free_list.insert(block);
   }
 
- private:
   void process_events() {
     while (true) {
       // Avoid calling destroyEvent while holding a mutex, so move
@@ -278,8 +568,7 @@ class DIPUCachingHostAllocator {
       }
 
       if (available) {
-        std::lock_guard<std::mutex> g(free_list_mutex_);
-        free_list_.insert(block);
+        release_block(block);
       }
     }
   }
@@ -288,11 +577,8 @@ class DIPUCachingHostAllocator {
   std::unordered_set<Block*> blocks_;
   std::unordered_map<void*, Block*> ptr_to_block_;
   // Note: sharding this mutex seems to be profitable in heavily multi-threaded
-  // scenarios.
-  alignas(kAlignPack) std::mutex free_list_mutex_;
-  // Note: an alternative datastructure can yield significant wins here in
-  // microbenchmarks.
-  std::set<Block*, BlockComparator> free_list_;
+  // scenarios, the free lists are sharded by NUMA node.
+  std::array<std::unique_ptr<Arena>, kMaxNumaNodes> arenas_;
 
   alignas(kAlignPack) std::mutex events_mutex_;
   std::deque<std::pair<DIPUEvent, Block*>> events_;
@@ -2,9 +2,6 @@
 
 #include "DIPURawAllocator.h"
 
-#include <map>
-#include <mutex>
-#include <unordered_set>
 #include <utility>
 
 #include "csrc_dipu/base/basedef.h"
@@ -12,7 +9,6 @@
 #include "csrc_dipu/runtime/devproxy/deviceproxy.h"
 
 #include "DIPUCachingAllocator.h"
-#include "DIPUCachingHostAllocator.h"
 
 namespace dipu {
 
@@ -56,6 +52,12 @@ c10::DataPtr DIPURawDeviceAllocator::allocate(
           c10::Device(dipu::DIPU_DEVICE_TYPE, device_index)};
 }
 
+AddressRangeRegistry::Domain pinnedHostMemoryDomain() {
+  static const auto domain =
+      AddressRangeRegistry::instance().newDomain(/*track_pages=*/true);
+  return domain;
+}
+
 class DIPURawHostAllocatorImpl final {
  public:
   static std::pair<void*, void*> allocate(size_t size) {
@@ -67,10 +69,8 @@ class DIPURawHostAllocatorImpl final {
     devproxy::mallocHost(&data, size);
     DIPU_DEBUG_ALLOCATOR(
         1, "devproxy::mallocHost: malloc " << size << " nbytes, ptr:" << data);
-    {
-      std::lock_guard<std::mutex> lck(mtx_);
-      blocks_[data] = size;
-    }
+    AddressRangeRegistry::instance().insert(pinnedHostMemoryDomain(), data,
+                                            size);
     return {data, data};
   }
 
@@ -79,49 +79,13 @@ class DIPURawHostAllocatorImpl final {
       return;
     }
 
-    {
-      std::lock_guard<std::mutex> lck(mtx_);
-      blocks_.erase(ctx);
-    }
+    AddressRangeRegistry::instance().erase(pinnedHostMemoryDomain(), ctx);
     devproxy::freeHost(ctx);
     DIPU_DEBUG_ALLOCATOR(2, "devproxy::freeHost: free " << ctx);
     ctx = nullptr;
   }
-
-  static bool isPinnedPtr(const void* p) {
-    bool is_pinned = false;
-    {
-      std::lock_guard<std::mutex> lck(mtx_);
-      for (auto iter = blocks_.crbegin(); iter != blocks_.crend(); iter++) {
-        const void* ptr = iter->first;
-        const size_t size = iter->second;
-        const char* cptr = static_cast<const char*>(ptr);
-        const char* cp = static_cast<const char*>(p);
-        const char* max_ptr = cptr + size;
-        if (cp >= cptr && cp < max_ptr) {
-          is_pinned = true;
-          break;
-        }
-        if (cp >= max_ptr) {
-          break;
-        }
-      }
-    }
-    return is_pinned;
-  }
-
- private:
-  // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
-  static std::mutex mtx_;
-  // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
-  static std::map<void*, size_t> blocks_;
 };
 
-// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
-std::map<void*, size_t> DIPURawHostAllocatorImpl::blocks_;
-// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
-std::mutex DIPURawHostAllocatorImpl::mtx_;
-
 namespace {
 
 // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
@@ -141,12 +105,11 @@ c10::DataPtr DIPURawHostAllocator::allocate(size_t size) const {
           at::DeviceType::CPU};
 }
 
+// Both host allocators register their memory in pinnedHostMemoryDomain(), so
+// this is a lock-free lookup whichever allocator is used.
 bool isPinnedPtr(const void* ptr) {
-  if (isTorchAllocator()) {
-    return allocator::CachingHostAllocator_isPinnedPtr(ptr);
-  }
-
-  return dipu_host_allocator.isPinnedPtr(ptr);
+  return AddressRangeRegistry::instance().contains(pinnedHostMemoryDomain(),
+                                                   ptr);
 }
 
 }  // namespace dipu
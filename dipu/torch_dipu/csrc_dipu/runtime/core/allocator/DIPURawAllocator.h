@@ -9,6 +9,7 @@
 #include <c10/core/Device.h>
 
 #include "csrc_dipu/base/basedef.h"
+#include "csrc_dipu/runtime/core/AddressRangeRegistry.h"
 #include "csrc_dipu/runtime/core/MemChecker.h"
 #include "csrc_dipu/runtime/device/deviceapis.h"
 
@@ -49,6 +50,9 @@ class DIPURawHostAllocator : public c10::Allocator {
   c10::DeleterFnPtr raw_deleter() const override;
 };
 
+// The AddressRangeRegistry domain which holds all pinned host memory.
+AddressRangeRegistry::Domain pinnedHostMemoryDomain();
+
 DIPU_API bool isPinnedPtr(const void* ptr);
 
 }  // namespace dipu
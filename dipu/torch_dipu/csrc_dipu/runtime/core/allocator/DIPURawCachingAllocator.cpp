@@ -18,13 +18,15 @@ class RawCachingAllocator : public CacheAllocator {
             size_t real_size)
         : DataPtrContextBase(allocator, ptr, size), real_size_(real_size) {}
     ~Context() {
+      recordFree();
       std::deque<DIPUEvent> events;
       for (const auto& item : streams()) {
         events.emplace_back();
         events.back().record(item);
       }
       auto allocator_ = static_cast<const RawCachingAllocator*>(allocator());
-      allocator_->async_mem_pool()->add(std::make_tuple(ptr(), size()), events);
+      allocator_->async_mem_pool()->add(std::make_tuple(ptr(), size()), events,
+                                        real_size_);
       allocator_->set_memory_allocated(allocator_->memory_allocated() -
                                        real_size_);
       allocator_->empty_cache();
@@ -42,7 +44,14 @@ class RawCachingAllocator : public CacheAllocator {
     DIPU_DEBUG_ALLOCATOR(4, "RawCachingAllocator: malloc "
                                 << nbytes << " nbytes"
                                 << ", requires:" << size << " bytes");
-    auto ptr = raw_allocator()->raw_allocate(nbytes);
+    void* ptr = nullptr;
+    try {
+      ptr = raw_allocator()->raw_allocate(nbytes);
+    } catch (...) {
+      reclaim_stream_ordered_blocks();
+      empty_cache();
+      ptr = raw_allocator()->raw_allocate(nbytes);
+    }
     set_memory_reserved(memory_reserved() + nbytes);
     set_memory_allocated(memory_allocated() + nbytes);
     return {ptr, new Context(this, ptr, size, nbytes),
@@ -60,7 +69,7 @@ class RawCachingAllocator : public CacheAllocator {
         raw_allocator()->raw_deallocate(ptr);
         set_memory_reserved(memory_reserved() - nbytes);
       } else {
-        std::this_thread::yield();
+        async_mem_pool()->wait_ready();
       }
     }
   }
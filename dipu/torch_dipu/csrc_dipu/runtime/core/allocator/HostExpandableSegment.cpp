@@ -0,0 +1,154 @@
+// Copyright (c) 2024, DeepLink.
+#include "HostExpandableSegment.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <iterator>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#include <c10/util/Exception.h>
+
+#include "csrc_dipu/runtime/devproxy/deviceproxy.h"
+
+namespace dipu {
+
+namespace {
+
+size_t systemPageSize() {
+  static const auto size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  return size;
+}
+
+// Makes the kernel back [ptr, ptr + size) with memory now instead of on first
+// access, so that running out of memory is reported here.
+bool populate(char* ptr, size_t size) {
+#ifdef MADV_POPULATE_WRITE
+  if (madvise(ptr, size, MADV_POPULATE_WRITE) == 0) {
+    return true;
+  }
+  if (errno == ENOMEM) {
+    return false;
+  }
+#endif
+  // Kernels before 5.14, touch every page.
+  for (size_t offset = 0; offset < size; offset += systemPageSize()) {
+    ptr[offset] = 0;
+  }
+  return true;
+}
+
+}  // namespace
+
+HostExpandableSegment::HostExpandableSegment(size_t size, size_t page_size,
+                                             bool pin)
+    : page_size_(std::max(page_size, systemPageSize())), pin_(pin) {
+  TORCH_CHECK(page_size_ % systemPageSize() == 0,
+              "host expandable segment page size ", page_size,
+              " is not a multiple of the system page size");
+  size_t pages = (size + page_size_ - 1) / page_size_;
+  size_ = pages * page_size_;
+  void* ptr = mmap(nullptr, size_, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  TORCH_CHECK(ptr != MAP_FAILED, "failed to reserve ", size_,
+              " bytes of address space for a host expandable segment");
+  ptr_ = static_cast<char*>(ptr);
+}
+
+HostExpandableSegment::~HostExpandableSegment() {
+  for (auto [begin, end] : runs_) {
+    unmapRun(begin, end);
+  }
+  munmap(ptr_, size_);
+}
+
+SegmentRange HostExpandableSegment::map(SegmentRange range) {
+  auto offset = static_cast<size_t>(range.ptr - ptr_);
+  size_t begin = offset / page_size_;
+  size_t end = (offset + range.size + page_size_ - 1) / page_size_;
+  TORCH_CHECK(end <= size_ / page_size_,
+              "range exceeds the host expandable segment");
+  std::vector<size_t> added;
+  for (size_t i = begin; i < end;) {
+    auto next = runs_.upper_bound(i);
+    if (next != runs_.begin() && std::prev(next)->second > i) {
+      i = std::prev(next)->second;
+      continue;
+    }
+    // The unmapped pages up to the next run.
+    size_t run_end = next == runs_.end() ? end : std::min(next->first, end);
+    if (!mapRun(i, run_end)) {
+      for (auto j : added) {
+        unmapRun(j, runs_[j]);
+        runs_.erase(j);
+      }
+      return {ptr_ + begin * page_size_, 0};
+    }
+    runs_.emplace(i, run_end);
+    added.push_back(i);
+    i = run_end;
+  }
+  return {ptr_ + begin * page_size_, (end - begin) * page_size_};
+}
+
+SegmentRange HostExpandableSegment::unmap(SegmentRange range) {
+  auto offset = static_cast<size_t>(range.ptr - ptr_);
+  size_t begin = (offset + page_size_ - 1) / page_size_;
+  size_t end = std::min((offset + range.size) / page_size_, size_ / page_size_);
+  size_t first = end;
+  size_t last = begin;
+  auto it = runs_.lower_bound(begin);
+  while (it != runs_.end() && it->second <= end) {
+    unmapRun(it->first, it->second);
+    first = std::min(first, it->first);
+    last = it->second;
+    it = runs_.erase(it);
+  }
+  if (first >= last) {
+    return {range.ptr, 0};
+  }
+  return {ptr_ + first * page_size_, (last - first) * page_size_};
+}
+
+size_t HostExpandableSegment::mappedBytes() const {
+  size_t pages = 0;
+  for (auto [begin, end] : runs_) {
+    pages += end - begin;
+  }
+  return pages * page_size_;
+}
+
+bool HostExpandableSegment::mapRun(size_t begin, size_t end) {
+  char* ptr = ptr_ + begin * page_size_;
+  size_t size = (end - begin) * page_size_;
+  if (mprotect(ptr, size, PROT_READ | PROT_WRITE) != 0) {
+    return false;
+  }
+  if (populate(ptr, size)) {
+    if (!pin_) {
+      return true;
+    }
+    try {
+      devproxy::hostRegister(ptr, size);
+      return true;
+    } catch (const c10::Error&) {
+      // Out of page-lockable memory, handled like running out of memory.
+    }
+  }
+  madvise(ptr, size, MADV_DONTNEED);
+  mprotect(ptr, size, PROT_NONE);
+  return false;
+}
+
+void HostExpandableSegment::unmapRun(size_t begin, size_t end) {
+  char* ptr = ptr_ + begin * page_size_;
+  size_t size = (end - begin) * page_size_;
+  if (pin_) {
+    devproxy::hostUnregister(ptr);
+  }
+  madvise(ptr, size, MADV_DONTNEED);
+  mprotect(ptr, size, PROT_NONE);
+}
+
+}  // namespace dipu
@@ -0,0 +1,54 @@
+// Copyright (c) 2024, DeepLink.
+#pragma once
+
+#include <cstddef>
+#include <map>
+
+#include "ExpandableSegment.h"
+
+namespace dipu {
+
+// An ExpandableSegment of host memory, see Note [Expandable Segments]. The
+// whole range is reserved with mmap up front without committing memory. map()
+// commits pages and, if `pin` is set, page-locks them with
+// devproxy::hostRegister. unmap() returns them to the system.
+//
+// Pages are `page_size` bytes, a multiple of the system page size. Each run of
+// contiguous pages a map() call adds is pinned with a single hostRegister, as
+// registering costs about as much per call as per byte, and is later unmapped
+// as a whole, as hostUnregister only takes the registered pointer. Without
+// pinning only mmap/mprotect/madvise are used.
+class HostExpandableSegment final : public ExpandableSegment {
+ public:
+  HostExpandableSegment(size_t size, size_t page_size, bool pin);
+  ~HostExpandableSegment() override;
+
+  // Maps every page touched by range. Returns the mapped pages, size 0 if
+  // memory is exhausted.
+  SegmentRange map(SegmentRange range) override;
+  // Unmaps the runs of pages mapped together completely inside range. Returns
+  // the pages from the first to the last of them.
+  SegmentRange unmap(SegmentRange range) override;
+  char* ptr() const override { return ptr_; }
+  size_t size() const override { return size_; }
+
+  size_t mappedBytes() const;
+
+  HostExpandableSegment(const HostExpandableSegment&) = delete;
+  HostExpandableSegment& operator=(const HostExpandableSegment&) = delete;
+  HostExpandableSegment(HostExpandableSegment&&) = delete;
+  HostExpandableSegment& operator=(HostExpandableSegment&&) = delete;
+
+ private:
+  bool mapRun(size_t begin, size_t end);
+  void unmapRun(size_t begin, size_t end);
+
+  char* ptr_ = nullptr;
+  size_t size_;
+  size_t page_size_;
+  bool pin_;
+  // First page of each mapped run to its end.
+  std::map<size_t, size_t> runs_;
+};
+
+}  // namespace dipu
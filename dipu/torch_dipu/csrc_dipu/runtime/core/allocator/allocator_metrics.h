@@ -7,19 +7,20 @@
 #include <shared_mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include <c10/core/Device.h>
 #include <c10/util/Exception.h>
 
 #include "csrc_dipu/metrics/metrics.h"
+#include "csrc_dipu/runtime/core/AddressRangeRegistry.h"
 
 namespace dipu {
 
 class AllocatorMetrics {
   using integer = metrics::ExportedInteger;
 
-  std::mutex mutable mutex;
-  std::unordered_map<void*, std::size_t> memory;
+  AddressRangeRegistry::Domain memory;
 
   metrics::LabeledIntegerCounter allocate_nullptr_count;
   metrics::LabeledIntegerCounter allocate_duplicated_count;
@@ -34,7 +35,8 @@ class AllocatorMetrics {
       metrics::Collector::labelset const& labels,
       metrics::Collector& co = metrics::default_collector())
 
-      : allocate_nullptr_count{co.make_integer_counter("allocator_event_count",
+      : memory{AddressRangeRegistry::instance().newDomain()},
+        allocate_nullptr_count{co.make_integer_counter("allocator_event_count",
                                                        "")
                                    .with(labels({{"method", "allocate"},
                                                  {"event", "nullptr"}}))},
@@ -50,6 +52,14 @@ class AllocatorMetrics {
         deallocate_size{allocate_size.with({{"method", "deallocate"}})}  //
   {}
 
+  AllocatorMetrics(AllocatorMetrics const&) = delete;
+  AllocatorMetrics(AllocatorMetrics&&) = delete;
+  AllocatorMetrics& operator=(AllocatorMetrics const&) = delete;
+  AllocatorMetrics& operator=(AllocatorMetrics&&) = delete;
+  ~AllocatorMetrics() {
+    AddressRangeRegistry::instance().releaseDomain(memory);
+  }
+
   void allocate(void* data, std::size_t size) {
     if (size == 0 or not metrics::enable()) {
       // do nothing
@@ -80,8 +90,8 @@ class AllocatorMetrics {
     }
   }
 
+  // Called once, before the allocator is used.
   void set_device_number(std::string const& device) {
-    std::scoped_lock _(mutex);
 #define _OVERWRITE_DEVICE(field) field = (field).with({{"device", device}})
     _OVERWRITE_DEVICE(allocate_nullptr_count);
     _OVERWRITE_DEVICE(allocate_duplicated_count);
@@ -94,18 +104,11 @@ class AllocatorMetrics {
 
  private:
   auto insert(void* data, std::size_t size) -> bool {
-    std::scoped_lock _(mutex);
-    return memory.emplace(data, size).second;
+    return AddressRangeRegistry::instance().insert(memory, data, size);
   }
 
   auto remove(void* data, std::size_t& size) -> bool {
-    std::scoped_lock _(mutex);
-    if (auto iter = memory.find(data); iter != memory.end()) {
-      size = iter->second;
-      memory.erase(iter);
-      return true;
-    }
-    return false;
+    return AddressRangeRegistry::instance().erase(memory, data, &size);
   }
 
   auto static exp2(std::size_t from = 4U) -> std::vector<integer> {
@@ -69,7 +69,7 @@ struct DIPUGuardImpl : public c10::impl::DeviceGuardImplInterface {
 
   c10::Stream getStreamFromGlobalPool(c10::Device d,
                                       bool isHighPriority) const override {
-    return getDIPUStreamFromPool(d.index()).unwrap();
+    return getDIPUStreamFromPool(d.index(), isHighPriority).unwrap();
   }
 
   c10::Stream getDefaultStream(c10::Device device) const override {
@@ -81,5 +81,8 @@ struct DIPUDeviceProperties {
 
 using deviceId_t = c10::DeviceIndex;
 
+// Opaque handle of a vendor native graph, see beginStreamCapture.
+using deviceGraph_t = void*;
+
 }  // end namespace devapis
 }  // end namespace dipu
@@ -61,6 +61,14 @@ DIPU_API void streamWaitEvent(deviceStream_t stream, deviceEvent_t event);
 // same as query last event status in stream.(every op has a event)
 DIPU_API bool isStreamEmpty(deviceStream_t stream);
 
+// Optional native graph capture used by DIPU graphs. beginStreamCapture
+// returns false if the vendor cannot capture `stream`, in which case the DIOPI
+// calls are recorded and re-issued by DIPU instead.
+DIPU_WEAK bool beginStreamCapture(deviceStream_t stream);
+DIPU_WEAK deviceGraph_t endStreamCapture(deviceStream_t stream);
+DIPU_WEAK void launchGraph(deviceGraph_t graph, deviceStream_t stream);
+DIPU_WEAK void destroyGraph(deviceGraph_t graph);
+
 // =====================
 //  device event related
 // =====================
@@ -92,6 +100,12 @@ DIPU_API void freeDevice(void* p);
 
 DIPU_API bool isPinnedPtr(const void* p);
 
+// Optional, page-locks an existing host range for DMA. Used by the expandable
+// segments of the caching host allocator, which register each growth of a
+// segment as one range, and unregister it by its start address only.
+DIPU_WEAK void hostRegister(void* p, size_t nbytes);
+DIPU_WEAK void hostUnregister(void* p);
+
 // (asynchronous) set val
 DIPU_API void memSetAsync(deviceStream_t stream, void* ptr, int val,
                           size_t size);
@@ -122,5 +136,19 @@ DIPU_API void memCopyH2DAsync(deviceStream_t stream, size_t nbytes,
 DIPU_API void memCopyD2HAsync(deviceStream_t stream, size_t nbytes,
                               /*Host dstDev,*/ void* dst,
                               /*deviceId_t srcDevId,*/ const void* src);
+
+// Optional, (asynchronous) copy of `height` rows of `width` bytes, rows start
+// every `dpitch` bytes in dst and every `spitch` bytes in src. D2D copies are
+// on the current device.
+DIPU_WEAK void memCopy2DAsync(deviceStream_t stream, MemCPKind kind, void* dst,
+                              size_t dpitch, const void* src, size_t spitch,
+                              size_t width, size_t height);
+
+// Optional, (asynchronous) copy of `depth` planes like the above, planes start
+// every `dslice` bytes in dst and every `sslice` bytes in src.
+DIPU_WEAK void memCopy3DAsync(deviceStream_t stream, MemCPKind kind, void* dst,
+                              size_t dpitch, size_t dslice, const void* src,
+                              size_t spitch, size_t sslice, size_t width,
+                              size_t height, size_t depth);
 }  // end namespace devapis
 }  // end namespace dipu
@@ -1,11 +1,14 @@
 // Copyright (c) 2023, DeepLink.
 #include "deviceproxy.h"
 
+#include <array>
 #include <atomic>
 #include <sys/sysinfo.h>
 
 #include <c10/util/Exception.h>
 
+#include "csrc_dipu/base/environ.hpp"
+#include "csrc_dipu/metrics/metrics.h"
 #include "csrc_dipu/runtime/core/DIPUEventPool.h"
 #include "csrc_dipu/runtime/core/allocator/allocator_metrics.h"
 #include "csrc_dipu/runtime/device/basedef.h"
@@ -44,6 +47,26 @@ namespace {
 thread_local deviceId_t currentDevice = -1;
 // NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
 deviceId_t lastDevice = -1;
+
+// Device queries and switches which reach the vendor runtime. currentDevice
+// caches the device of each thread, so that they are rare.
+enum class VendorDeviceCall : size_t { GET, SET };
+
+void countVendorDeviceCall(VendorDeviceCall call) {
+  if (!metrics::enable()) {
+    return;
+  }
+  auto make = [](const char* name) {
+    return metrics::default_collector()
+        .make_integer_counter("device_vendor_call_count",
+                              "device queries and switches sent to vendor")
+        .with({{"call", name}});
+  };
+  // Using * to avoid being destructed.
+  static auto* counters = new std::array<metrics::LabeledIntegerCounter, 2>{
+      make("get_device"), make("set_device")};
+  (*counters)[static_cast<size_t>(call)].inc();
+}
 }  // namespace
 
 deviceId_t current_device() {
@@ -60,10 +83,20 @@ deviceId_t current_device() {
     } else {
       setDevice(0);
     }
+  } else if (!environ::deviceCache()) {
+    countVendorDeviceCall(VendorDeviceCall::GET);
+    currentDevice = devapis::current_device();
   }
   return currentDevice;
 }
 
+void syncDeviceCache() {
+  if (currentDevice >= 0) {
+    countVendorDeviceCall(VendorDeviceCall::GET);
+    currentDevice = devapis::current_device();
+  }
+}
+
 void setCpuAffinity(const int device) {
   static int affinity = get_env_or_default("DIPU_CPU_AFFINITY", 0);
   if (affinity < 0) {
@@ -95,8 +128,12 @@ void setDevice(deviceId_t devId) {
   TORCH_CHECK(devId < kDeviceCount && devId >= 0,
               "invalid device id: ", static_cast<int>(devId),
               " , device count:", kDeviceCount)
+  if (currentDevice == devId && environ::deviceCache()) {
+    return;
+  }
+  countVendorDeviceCall(VendorDeviceCall::SET);
+  devapis::setDevice(devId);
   if (currentDevice != devId) {
-    devapis::setDevice(devId);
     setCpuAffinity(devId);
     if (currentDevice < 0) {
       if (lastDevice < 0) {
@@ -168,6 +205,27 @@ bool isStreamEmpty(deviceStream_t stream) {
   return devapis::isStreamEmpty(stream);
 }
 
+bool beginStreamCapture(deviceStream_t stream) {
+  return devapis::beginStreamCapture &&
+         devapis::beginStreamCapture(stream);
+}
+
+deviceGraph_t endStreamCapture(deviceStream_t stream) {
+  TORCH_CHECK(devapis::endStreamCapture, "native graph capture unsupported");
+  return devapis::endStreamCapture(stream);
+}
+
+void launchGraph(deviceGraph_t graph, deviceStream_t stream) {
+  TORCH_CHECK(devapis::launchGraph, "native graph capture unsupported");
+  devapis::launchGraph(graph, stream);
+}
+
+void destroyGraph(deviceGraph_t graph) {
+  if (devapis::destroyGraph) {
+    devapis::destroyGraph(graph);
+  }
+}
+
 // =====================
 //  device event related
 // =====================
@@ -220,6 +278,20 @@ void freeDevice(void* p) {
 
 bool isPinnedPtr(const void* p) { return devapis::isPinnedPtr(p); }
 
+bool isHostRegisterSupported() {
+  return devapis::hostRegister && devapis::hostUnregister;
+}
+
+void hostRegister(void* p, size_t nbytes) {
+  TORCH_CHECK(isHostRegisterSupported(), "host register unsupported");
+  devapis::hostRegister(p, nbytes);
+}
+
+void hostUnregister(void* p) {
+  TORCH_CHECK(isHostRegisterSupported(), "host register unsupported");
+  devapis::hostUnregister(p);
+}
+
 // (asynchronous) set val
 void memSetAsync(const deviceStream_t stream, void* ptr, int val, size_t size) {
   return devapis::memSetAsync(stream, ptr, val, size);
@@ -276,5 +348,55 @@ void memCopyD2HAsync(const deviceStream_t stream, size_t nbytes,
   return devapis::memCopyD2HAsync(stream, nbytes, dst, src);
 }
 
+bool isMemCopy2DSupported() {
+  return devapis::memCopy2DAsync && devapis::memCopy3DAsync;
+}
+
+void memCopy2DAsync(const deviceStream_t stream, MemCPKind kind, void* dst,
+                    size_t dpitch, const void* src, size_t spitch,
+                    size_t width, size_t height) {
+  if (devapis::memCopy2DAsync) {
+    return devapis::memCopy2DAsync(stream, kind, dst, dpitch, src, spitch,
+                                   width, height);
+  }
+  if (dpitch == width && spitch == width) {
+    width *= height;
+    height = 1;
+  }
+  auto device = current_device();
+  for (size_t row = 0; row < height; ++row) {
+    auto* row_dst = static_cast<char*>(dst) + row * dpitch;
+    const auto* row_src = static_cast<const char*>(src) + row * spitch;
+    switch (kind) {
+      case MemCPKind::H2D:
+        devapis::memCopyH2DAsync(stream, width, row_dst, row_src);
+        break;
+      case MemCPKind::D2H:
+        devapis::memCopyD2HAsync(stream, width, row_dst, row_src);
+        break;
+      case MemCPKind::D2D:
+        devapis::memCopyD2DAsync(stream, width, device, row_dst, device,
+                                 row_src);
+        break;
+    }
+  }
+}
+
+void memCopy3DAsync(const deviceStream_t stream, MemCPKind kind, void* dst,
+                    size_t dpitch, size_t dslice, const void* src,
+                    size_t spitch, size_t sslice, size_t width, size_t height,
+                    size_t depth) {
+  if (devapis::memCopy3DAsync) {
+    return devapis::memCopy3DAsync(stream, kind, dst, dpitch, dslice, src,
+                                   spitch, sslice, width, height, depth);
+  }
+  for (size_t plane = 0; plane < depth; ++plane) {
+    // Qualified, devapis::memCopy2DAsync would be found by ADL too.
+    devproxy::memCopy2DAsync(
+        stream, kind, static_cast<char*>(dst) + plane * dslice, dpitch,
+        static_cast<const char*>(src) + plane * sslice, spitch, width, height);
+  }
+}
+
 }  // end namespace devproxy
 }  // end namespace dipu
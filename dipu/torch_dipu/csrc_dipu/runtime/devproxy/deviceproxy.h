@@ -7,10 +7,12 @@ namespace dipu {
 
 namespace devproxy {
 
+using dipu::devapis::deviceGraph_t;
 using dipu::devapis::deviceId_t;
 using dipu::devapis::DIPUDeviceProperties;
 using dipu::devapis::DIPUDeviceStatus;
 using dipu::devapis::EventStatus;
+using dipu::devapis::MemCPKind;
 using dipu::devapis::OpStatus;
 
 DIPU_API void initializeVendor();
@@ -25,6 +27,11 @@ DIPU_API DIPUDeviceStatus getDeviceStatus(int32_t device_index);
 // set current device given device according to id
 DIPU_API void setDevice(deviceId_t devId);
 
+// current_device() and setDevice() cache the device of each thread, and skip
+// the vendor runtime unless it changes. Call this after code outside of DIPU
+// switched the device of the calling thread. See also DIPU_DEVICE_CACHE.
+DIPU_API void syncDeviceCache();
+
 DIPU_API void resetDevice(deviceId_t devId = 0);
 
 DIPU_API void syncDevice();
@@ -54,6 +61,13 @@ DIPU_API void streamWaitEvent(deviceStream_t stream, deviceEvent_t event);
 // same as query last event status in stream.(every op has a event)
 DIPU_API bool isStreamEmpty(deviceStream_t stream);
 
+// Native graph capture, beginStreamCapture returns false if the vendor does
+// not support it.
+DIPU_API bool beginStreamCapture(deviceStream_t stream);
+DIPU_API deviceGraph_t endStreamCapture(deviceStream_t stream);
+DIPU_API void launchGraph(deviceGraph_t graph, deviceStream_t stream);
+DIPU_API void destroyGraph(deviceGraph_t graph);
+
 // =====================
 //  device event related
 // =====================
@@ -85,6 +99,11 @@ DIPU_API void freeDevice(void* p);
 
 DIPU_API bool isPinnedPtr(const void* p);
 
+// Page-locking existing host memory is optional for vendors.
+DIPU_API bool isHostRegisterSupported();
+DIPU_API void hostRegister(void* p, size_t nbytes);
+DIPU_API void hostUnregister(void* p);
+
 // (asynchronous) set val
 DIPU_API void memSetAsync(deviceStream_t stream, void* ptr, int val,
                           size_t size);
@@ -116,5 +135,20 @@ DIPU_API void memCopyD2HAsync(deviceStream_t stream, size_t nbytes,
                               /*Host dstDev,*/ void* dst,
                               /*deviceId_t srcDevId,*/ const void* src);
 
+// Whether the vendor copies pitched layouts natively, without the fallback of
+// memCopy2DAsync / memCopy3DAsync below.
+DIPU_API bool isMemCopy2DSupported();
+
+// (asynchronous) pitched copies, see devapis::memCopy2DAsync. Fall back to one
+// flat copy per row.
+DIPU_API void memCopy2DAsync(deviceStream_t stream, MemCPKind kind, void* dst,
+                             size_t dpitch, const void* src, size_t spitch,
+                             size_t width, size_t height);
+
+DIPU_API void memCopy3DAsync(deviceStream_t stream, MemCPKind kind, void* dst,
+                             size_t dpitch, size_t dslice, const void* src,
+                             size_t spitch, size_t sslice, size_t width,
+                             size_t height, size_t depth);
+
 }  // end namespace devproxy
 }  // end namespace dipu
@@ -15,6 +15,7 @@ from .device import *
 from .random_dipu import *
 from .memory import *
 from .streams import *
+from .graphs import *
 from .tensor import *
 from .storages import *
 from . import amp
@@ -56,6 +57,14 @@ __all__ = [
     "Stream",
     "Event",
     "is_current_stream_capturing",
+    # graph
+    "DIPUGraph",
+    "graph",
+    # tensor
+    "item_async",
+    "copy_many_",
+    "copy_plans",
+    "record_copy_plans",
     # random
     "get_rng_state",
     "get_rng_state_all",
@@ -75,12 +84,20 @@ __all__ = [
     "memory_reserved",
     "max_memory_allocated",
     "max_memory_reserved",
+    "mark_iteration_boundary",
+    "iteration_memory_report",
+    "memory_snapshot",
+    "sampled_memory_stacks",
+    "memory_pool",
+    "memory_pool_stats",
+    "release_memory_pool",
+    "malloc_async",
+    "free_async",
     "mem_get_info",  # "caching_allocator_alloc", "caching_allocator_delete", "memory_summary", "memory_stats"
     # custom api
     "NativeMemoryFormat",
     "native_memory_format_cast",
     "get_native_memory_format",
-    # not support mock cuda_graph now
     "nvtx",
 ]
 
@@ -0,0 +1,64 @@
+# Copyright (c) 2024, DeepLink.
+
+from typing import Optional
+
+from torch_dipu import _C
+from .streams import Stream, current_stream, stream as stream_context
+from .device import synchronize
+
+
+class DIPUGraph(_C._DIPUGraph):
+    r"""Captures the DIOPI calls issued on a stream and replays them.
+
+    Replaying skips Python, the dispatcher and the op wrappers, which pays off
+    for sequences repeated with the same shapes, e.g. inference or the
+    optimizer step. Tensors used while capturing are kept alive by the graph
+    and memory allocated while capturing comes from a private pool, so replay
+    reads and writes the same memory every time.
+
+    As with CUDA graphs, work is only recorded, not run, while capturing.
+    Unless the vendor captures natively, copies, CPU fallbacks and ``item()``
+    raise while capturing, as they would not run on replay.
+    """
+
+    def capture_begin(self, stream: Optional[Stream] = None) -> None:
+        super().capture_begin(stream if stream is not None else current_stream())
+
+    def capture_end(self) -> None:
+        super().capture_end()
+
+    def replay(self) -> None:
+        r"""Replays the graph, ordered with the work on the current stream."""
+        super().replay()
+
+    def reset(self) -> None:
+        r"""Drops the captured calls and releases the memory of the graph."""
+        super().reset()
+
+
+class graph:
+    r"""Context-manager that captures the work issued in its context into a
+    :class:`DIPUGraph`.
+
+    Arguments:
+        dipu_graph (DIPUGraph): graph to capture into.
+        stream (Stream, optional): stream to capture on, a stream from the
+            pool if not given. It is selected as the current stream within the
+            context.
+    """
+
+    def __init__(self, dipu_graph: DIPUGraph, stream: Optional[Stream] = None):
+        self.dipu_graph = dipu_graph
+        self.capture_stream = stream if stream is not None else Stream()
+        self.stream_ctx = stream_context(self.capture_stream)
+
+    def __enter__(self):
+        synchronize()
+        self.stream_ctx.__enter__()
+        self.dipu_graph.capture_begin(self.capture_stream)
+
+    def __exit__(self, *args):
+        try:
+            self.dipu_graph.capture_end()
+        finally:
+            self.stream_ctx.__exit__(*args)
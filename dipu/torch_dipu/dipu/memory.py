@@ -1,6 +1,7 @@
 # Copyright (c) 2023, DeepLink.
 
 import collections
+import contextlib
 from typing import Union, Tuple
 from torch_dipu import _C
 from .device import (
@@ -71,6 +72,41 @@ def caching_allocator_delete(mem_ptr):
     _C._dipu_dipuCachingAllocator_raw_delete(mem_ptr)
 
 
+def malloc_async(size: int, stream: Stream = None) -> int:
+    r"""Allocates memory in the order of a stream and returns its address.
+
+    The memory may be used by work submitted to :attr:`stream` from now on.
+    Memory given back by :func:`free_async` on the same stream is reused
+    without any synchronization. Work on other streams has to be ordered
+    against :attr:`stream` by the caller.
+
+    Arguments:
+        size (int): number of bytes to allocate.
+        stream (torch_dipu.dipu.Stream, optional): the stream, the current
+            stream if ``None``.
+    """
+    if stream is None:
+        stream = current_stream()
+    return _C._dipu_mallocAsync(size, stream)
+
+
+def free_async(ptr: int, stream: Stream = None) -> None:
+    r"""Frees memory from :func:`malloc_async` in the order of a stream.
+
+    Work submitted to :attr:`stream` from now on must not use the memory,
+    work on other streams which uses it must be ordered before this point of
+    :attr:`stream` by the caller.
+
+    Arguments:
+        ptr (int): address returned by :func:`malloc_async`.
+        stream (torch_dipu.dipu.Stream, optional): the stream, the current
+            stream if ``None``.
+    """
+    if stream is None:
+        stream = current_stream()
+    _C._dipu_freeAsync(ptr, stream)
+
+
 def empty_cache():
     r"""Releases all unoccupied cached memory currently held by the caching
     allocator so that those can be used in other dipu application and visible in
@@ -292,5 +328,128 @@ def reset_peak_memory_stats(device: Union[Device, int] = None) -> None:
     _C.reset_peak_memory_stats(device)
 
 
+def mark_iteration_boundary(device: Union[Device, int] = None) -> None:
+    r"""Marks the end of a training iteration for the caching allocator.
+
+    With ``DIPU_BF_ITERATION_WARMUP=N`` the BF allocator records the peak of
+    the first ``N`` iterations on every stream shard, then reserves one arena
+    per shard sized for a single iteration, so that later iterations do not
+    allocate device memory. :func:`empty_cache` releases the arenas and warm-up
+    starts over. The TORCH allocator ignores this.
+    """
+    if device is None:
+        device = current_device()
+    if isinstance(device, int):
+        device = torch.device(__dipu__ + ":" + str(device))
+    _C._dipu_markIterationBoundary(device)
+
+
+def iteration_memory_report(device: Union[Device, int] = None) -> dict:
+    r"""Returns what the allocator learned from the iterations marked by
+    :func:`mark_iteration_boundary`, including the ratio of reserved memory to
+    the peak allocated memory."""
+    if device is None:
+        device = current_device()
+    if isinstance(device, int):
+        device = torch.device(__dipu__ + ":" + str(device))
+    report = _C._dipu_iterationMemoryReport(device)
+    return {
+        "iterations": report.iterations,
+        "warmup_iterations": report.warmup_iterations,
+        "peak_bytes": report.peak_bytes,
+        "transient_peak_bytes": report.transient_peak_bytes,
+        "arena_bytes": report.arena_bytes,
+        "reserved_bytes": report.reserved_bytes,
+        "reserved_to_peak_ratio": (
+            report.reserved_bytes / report.peak_bytes if report.peak_bytes else 0.0
+        ),
+        "device_allocations_after_warmup": report.device_allocations_after_warmup,
+    }
+
+
+def _snapshot(device: Union[Device, int] = None) -> dict:
+    r"""Returns the segments and blocks cached by the allocator of ``device``,
+    in the format of :func:`torch.cuda.memory._snapshot`.
+
+    Blocks are ``active_allocated``, ``active_pending_free`` (freed but still
+    waiting for the streams which used them) or ``inactive``. Supported by the
+    TORCH, BF and BS allocators.
+    """
+    if device is None:
+        device = current_device()
+    if isinstance(device, int):
+        device = torch.device(__dipu__ + ":" + str(device))
+    return _C._dipu_memorySnapshot(device)
+
+
+def memory_snapshot(device: Union[Device, int] = None) -> list:
+    r"""Returns the segments cached by the allocator, see :func:`_snapshot`."""
+    return _snapshot(device)["segments"]
+
+
+@contextlib.contextmanager
+def memory_pool(name: str):
+    r"""Context manager which serves the device allocations of the current
+    thread from the private pool ``name``.
+
+    Blocks cached by a private pool are only reused by allocations made inside
+    the same pool, so phases with different lifetimes (e.g. evaluation or
+    large temporary workspaces) do not fragment the cache of each other. Use
+    :func:`release_memory_pool` to return the memory of a pool to the device.
+
+    Example::
+
+        with torch_dipu.memory_pool("eval"):
+            output = model(input)
+    """
+    previous = _C._dipu_setCurrentMemoryPool(_C._dipu_getMemoryPool(name))
+    try:
+        yield
+    finally:
+        _C._dipu_setCurrentMemoryPool(previous)
+
+
+def memory_pool_stats(name: str, device: Union[Device, int] = None) -> dict:
+    r"""Returns the current and peak allocated and reserved bytes of the
+    private pool ``name`` on ``device``."""
+    if device is None:
+        device = current_device()
+    if isinstance(device, int):
+        device = torch.device(__dipu__ + ":" + str(device))
+    return _C._dipu_memoryPoolStats(device, _C._dipu_getMemoryPool(name))
+
+
+def release_memory_pool(name: str, device: Union[Device, int] = None) -> None:
+    r"""Returns all memory cached by the private pool ``name`` on ``device`` to
+    the device. Memory still used by tensors stays in the pool."""
+    if device is None:
+        device = current_device()
+    if isinstance(device, int):
+        device = torch.device(__dipu__ + ":" + str(device))
+    _C._dipu_releaseMemoryPool(device, _C._dipu_getMemoryPool(name))
+
+
+def sampled_memory_stacks() -> list:
+    r"""Returns the live allocations sampled by the leak detector, grouped by
+    the stack which allocated them and sorted by size, largest first.
+
+    Each item is a dict with ``frames`` (symbolized stack), ``count`` and
+    ``size`` (bytes) of the sampled allocations still alive. Sampling is
+    enabled by ``DIPU_MEM_CHECK_SAMPLE``, see ``DIPU_MEM_CHECK_SAMPLE_BYTES``
+    and ``DIPU_MEM_CHECK_SAMPLE_INTERVAL`` for the rate. A stack whose size
+    keeps growing across iterations is a likely leak.
+    """
+    return _C._dipu_sampledMemoryStacks()
+
+
+def _dump_snapshot(filename="dump_snapshot.pickle", device=None):
+    r"""Saves :func:`_snapshot` to ``filename``, which can be loaded by
+    https://pytorch.org/memory_viz."""
+    import pickle
+
+    with open(filename, "wb") as f:
+        pickle.dump(_snapshot(device), f)
+
+
 def _set_allocator_settings(env: str):
     return _C._dipu_dipuCachingAllocator_set_allocator_settings(env)
@@ -81,7 +81,8 @@ class Stream(_C._DIPUStreamBase, _StreamBase, metaclass=CombinedStreamMeta):
             the stream. If :attr:`device` is ``None`` (default) or a negative
             integer, this will use the current device.
         priority(int, optional): priority of the stream. Lower numbers
-                                 represent higher priorities.
+                                 represent higher priorities, negative ones
+                                 take the stream from the high priority pool.
     """
 
     def __init__(self, device=None, priority=0, **kwargs):
@@ -151,6 +152,19 @@ class Stream(_C._DIPUStreamBase, _StreamBase, metaclass=CombinedStreamMeta):
         """
         super().synchronize()
 
+    def add_callback(self, fn):
+        r"""Calls a function once all the work currently submitted to the
+        stream has completed.
+
+        Arguments:
+            fn (callable): a function taking no arguments.
+
+        .. note:: ``fn`` runs on a background thread of the device, after the
+           callbacks added before it to any stream of the same device. It
+           must not block on other callbacks.
+        """
+        super().add_callback(fn)
+
     @property
     def _as_parameter_(self):
         return ctypes.c_void_p(self.dipu_stream)
@@ -168,10 +182,9 @@ class Stream(_C._DIPUStreamBase, _StreamBase, metaclass=CombinedStreamMeta):
             self.device, self.dipu_stream
         )
 
-    # mock
     @property
     def priority(self):
-        return 0
+        return super().priority
 
 
 def _dipu_set_stream(
@@ -238,9 +251,9 @@ original_is_current_stream_capturing = torch.cuda.is_current_stream_capturing
 
 def is_current_stream_capturing() -> bool:
     # cuda.is_available is patched and we can't use it here
-    if dipu.vendor_type == "CUDA":
-        return original_is_current_stream_capturing()
-    return False
+    if dipu.vendor_type == "CUDA" and original_is_current_stream_capturing():
+        return True
+    return _C._dipu_isCurrentStreamCapturing()
 
 
 class StreamContext:
@@ -32,3 +32,70 @@ def apply_tensor_type_patch():
     if mockcuda:
         _C._mockCudaTensorType()
     torch.Tensor.type = _wrap_tensor_type
+
+
+def item_async(tensor: torch.Tensor) -> torch.futures.Future:
+    r"""Returns a future of ``tensor.item()`` without blocking.
+
+    The element is copied into pinned memory behind the work already submitted
+    to the current stream, and the future completes once that copy has, e.g.
+    to check a loss or ``found_inf`` a step later instead of draining the
+    stream every step.
+
+    Arguments:
+        tensor (Tensor): a tensor with one element.
+
+    .. note:: Callbacks added with ``then`` run on a background thread of the
+       device and must not block on other callbacks.
+    """
+    future = torch.futures.Future()
+    if tensor.device.type != __diputype__:
+        future.set_result(tensor.item())
+    else:
+        _C._dipu_itemAsync(tensor, future.set_result)
+    return future
+
+
+def copy_many_(dsts, srcs, non_blocking: bool = False) -> None:
+    r"""Copies every tensor of ``srcs`` into the tensor of ``dsts`` at the same
+    position, like ``dst.copy_(src, non_blocking)`` for each pair.
+
+    Small host-to-device copies of one device, e.g. the tensors of a state
+    dict or of a dict batch, are packed into one pinned buffer and sent in a
+    single transfer. Device-to-host copies are batched the same way when they
+    would block anyway. The pairs take effect in order, a pair may read what
+    an earlier pair wrote.
+
+    Arguments:
+        dsts (sequence of Tensor): the tensors copied into.
+        srcs (sequence of Tensor): the tensors copied from.
+        non_blocking (bool): same as for ``Tensor.copy_``.
+    """
+    _C._dipu_copyMany(list(dsts), list(srcs), non_blocking)
+
+
+def record_copy_plans(enabled: bool = True) -> None:
+    r"""Starts (or stops) recording the plans returned by :func:`copy_plans`.
+    Recording is off unless ``DIPU_DUMP_COPY_PLANS`` is set, as it takes a
+    lock shared by all the copies.
+    """
+    _C._dipu_recordCopyPlans(enabled)
+
+
+def copy_plans() -> list:
+    r"""Returns how ``copy_`` copied each pair of dtypes and layouts while
+    recorded, see :func:`record_copy_plans`, most copied first, to find copies
+    taking more than one step.
+
+    Each entry is a dict with the ``direction`` (``"h2d"``, ``"d2h"``,
+    ``"d2self"``, ...), the ``dst_dtype``/``src_dtype``, the ``sizes`` and
+    ``dst_strides``/``src_strides``, the ``steps`` run (``"memcpy"``,
+    ``"pitched_memcpy"``, ``"cast"``, ``"diopi_copy"`` or ``"cpu_copy"``), the
+    number of temporary tensors allocated (``intermediates``), and how many
+    copies used it (``count``). Set ``DIPU_DUMP_COPY_PLANS=1`` to print them
+    at exit.
+
+    .. note:: Steps are those of DIPU's default copy strategy, a vendor may
+       handle some of them on its own.
+    """
+    return _C._dipu_copyPlans()